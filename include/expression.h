@@ -3,6 +3,7 @@
 
 #include "tree.h"
 #include "pvector.h"
+#include <pthread.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -13,6 +14,12 @@ struct expression_variable {
 	double value;
 };
 
+struct expression_derive_memo;
+struct expression_derive_tasks;
+struct expression_trace;
+struct expression_deps;
+struct expression_pool;
+
 struct expression {
 	struct tree tree;
 	struct pvector variables;
@@ -20,11 +27,40 @@ struct expression {
 	struct pvector graph_files;
 	size_t differentiating_variable;
 	FILE *latex_file;
+
+	// Derivatives are hash-consed into one shared DAG arena
+	int hashcons;
+	struct tree_arena *dag_arena;
+
+	// Derivatives carry structural hashes, see tnode_hash_combine()
+	int merkle;
+
+	// Derivatives of subtrees are memoized by structural hash and reused across orders.
+	// Only derivations into a hash-consing arena (hashcons, Jacobians) use the memo,
+	// there hits are shared in O(1). Copying them out costs more than deriving again
+	int memoize;
+	struct expression_derive_memo *derive_memo;
+
+	// Large trees are derived on these threads, the pool is not owned
+	struct expression_pool *pool;
+	struct expression_derive_tasks *derive_tasks;
+
+	// Derivation steps for latex_file are traced in memory and rendered after each order.
+	// The top levels of the tree are shown, at most trace_max steps, 0 takes the default.
+	// Deeper steps are counted by rule
+	size_t trace_max;
+	struct expression_trace *trace;
+
+	// Variables of the nodes being derived, set by the partial derivative engine
+	struct expression_deps *derive_deps;
 };
 
 int expression_ctor(struct expression *expr);
 int expression_dtor(struct expression *expr);
 
+/**
+ * The clone shares the tree with expr copy-on-write, see tree_share().
+ */
 int expression_clone(struct expression *expr, struct expression *nexpr);
 
 int expression_taylor_series_nth(struct expression *expr,
@@ -40,10 +76,75 @@ int expression_derivative_plot(struct expression *expr, int nth_derivative);
 int expression_validate(struct expression *expr);
 int expression_load(struct expression *expr, const char *filename);
 int expression_store(struct expression *expr, const char *filename);
+int expression_load_binary(struct expression *expr, const char *filename);
+int expression_store_binary(struct expression *expr, const char *filename);
+/**
+ * Stores the tree so that it can be opened with tree_mapped_ctor()
+ * and expression_bin_codec, then evaluated in place.
+ */
+int expression_store_mapped(struct expression *expr, const char *filename);
 
 // int expression_derive(struct expression *expr, struct expression *derivative);
 
 int expression_derive_nth(struct expression *expr, int nth);
+/**
+ * Drops the memoized subtree derivatives, they are rebuilt on the next derivation.
+ */
+int expression_derive_memo_clear(struct expression *expr);
+
+/**
+ * Records that node was derived, only the node and the rule are kept.
+ */
+int expression_trace_record(struct expression *expr, struct tree_node *node,
+			    struct tree_node *derivative);
+/**
+ * Writes the shown steps of deriving root into derivative and a count of the others,
+ * then clears the trace. The shown steps are derived again, root has to be alive.
+ */
+int expression_trace_render(struct expression *expr, struct tree_node *root,
+			    struct tree_node *derivative, FILE *out_stream);
+int expression_trace_clear(struct expression *expr);
+
+/**
+ * d(node)/d(var_idx) into the selected arena, without LaTeX steps.
+ */
+struct tree_node *expression_derive_tnode(struct expression *expr, struct tree_node *node,
+					  size_t var_idx);
+
+/**
+ * Returns 1 if the node depends on the variable, 0 if it does not,
+ * -1 if the node is not in the table.
+ */
+int expression_deps_find(const struct expression_deps *deps, const struct tree_node *node,
+			 size_t var_idx);
+
+/**
+ * Partial derivatives, partials[row * vars_cnt + var] is d(row)/d(var).
+ *
+ * All partials are hash-consed into one arena, so subexpressions shared by
+ * several of them are built and stored once. Partials that are zero by structure
+ * are NULL and are never derived.
+ */
+struct expression_jacobian {
+	struct tree_arena *arena;
+	struct tree_node **partials;
+	size_t rows_cnt;
+	size_t vars_cnt;
+	size_t nonzero_cnt;
+};
+
+/**
+ * One row per expression, the columns are the variables of exprs[0].
+ * The other expressions are matched to them by name.
+ */
+int expression_jacobian_ctor(struct expression_jacobian *jac,
+			     struct expression *const *exprs, size_t exprs_cnt);
+int expression_gradient_ctor(struct expression_jacobian *grad, struct expression *expr);
+/**
+ * d2(expr)/d(row)d(var), the symmetric halves share their nodes.
+ */
+int expression_hessian_ctor(struct expression_jacobian *hess, struct expression *expr);
+int expression_jacobian_dtor(struct expression_jacobian *jac);
 
 int expression_simplify(struct expression *expr, struct expression *derivative);
 struct tree_node *tnode_simplify(struct expression *expr, struct tree_node *node);
@@ -52,6 +153,245 @@ int tnode_evaluate(struct expression *expr,
 				   struct tree_node *node, double *fnum);
 int expression_evaluate(struct expression *expr, double *fnum);
 
+/**
+ * Value and first derivative by one variable.
+ */
+struct expression_dual {
+	double value;
+	double deriv;
+};
+
+/**
+ * Forward mode: one pass over the tree with the operator partials,
+ * no derivative tree is built.
+ */
+int tnode_evaluate_dual(struct expression *expr, struct tree_node *node,
+			size_t var_idx, struct expression_dual *dual);
+
+/**
+ * Reverse mode tape of a subtree, recorded once and reused for any point.
+ * The value buffers are written by every sweep, one tape per thread.
+ */
+struct expression_tape {
+	struct tree_compact compact;
+	double *values;
+	double *adjoints;
+	// Variables up to the highest index in the subtree
+	size_t vars_cnt;
+};
+
+int expression_tape_ctor(struct expression_tape *tape, struct tree_node *node);
+int expression_tape_dtor(struct expression_tape *tape);
+/**
+ * Evaluates at vars, then one backward sweep fills grad with the partial
+ * derivative by every variable. vars and grad hold vars_cnt values.
+ */
+int expression_tape_gradient(struct expression *expr, struct expression_tape *tape,
+			     const double *vars, size_t vars_cnt, double *fnum, double *grad);
+
+/**
+ * Taylor mode: coeffs[k] = f^(k)(x0) / k! for k <= nth, x0 is the current value
+ * of the variable. One pass over the tree on truncated series, O(nth^2) per node.
+ */
+int tnode_evaluate_series(struct expression *expr, struct tree_node *node,
+			  size_t var_idx, size_t nth, double *coeffs);
+
+/**
+ * Enclosure of the values over a range of inputs. Points where evaluation
+ * fails or gives NaN are not enclosed, PARTIAL marks that some of them may
+ * exist and EMPTY that there is no other point, lo and hi are unset then.
+ */
+struct expression_interval {
+	double lo;
+	double hi;
+	int flags;
+};
+
+#define EXPRESSION_INTERVAL_F_PARTIAL	(0x1)
+#define EXPRESSION_INTERVAL_F_EMPTY	(0x2)
+
+/**
+ * The variable var_idx runs over range, the other variables keep their values.
+ */
+int tnode_evaluate_interval(struct expression *expr, struct tree_node *node,
+			    size_t var_idx, struct expression_interval range,
+			    struct expression_interval *result);
+int tcompact_evaluate_interval(struct expression *expr, const struct tree_compact *compact,
+			       size_t var_idx, struct expression_interval range,
+			       struct expression_interval *result);
+/**
+ * Evaluates a compact tree in one linear pass, shared subtrees are computed once.
+ */
+int tcompact_evaluate(struct expression *expr,
+		      const struct tree_compact *compact, double *fnum);
+int tfrozen_evaluate(struct expression *expr,
+		     const struct tree_frozen *frozen, double *fnum);
+int tmapped_evaluate(struct expression *expr,
+		     const struct tree_mapped *mapped, double *fnum);
+
+/**
+ * Register bytecode of an expression.
+ *
+ * Registers hold the constants, then the variables by index, then temporaries.
+ * The opcode is the operator index, unary operators only read lhs.
+ */
+struct expression_insn {
+	uint32_t opcode;
+	uint32_t dst;
+	uint32_t lhs;
+	uint32_t rhs;
+};
+
+struct expression_program {
+	struct expression_insn *code;
+	size_t len;
+	size_t capacity;
+
+	double *consts;
+	size_t consts_cnt;
+	size_t vars_cnt;
+
+	size_t regs_cnt;
+	uint32_t result;
+
+	int flags;
+};
+
+/**
+ * Batch evaluation runs sin, cos, ln and pow through the vector kernels below.
+ * Results then differ from libm in the last bits, off by default.
+ */
+#define EXPRESSION_PROGRAM_F_FAST_MATH (0x1)
+
+DSError_t expression_program_ctor(struct expression_program *program);
+DSError_t expression_program_dtor(struct expression_program *program);
+/**
+ * Compiles the subtree, shared nodes are computed once.
+ * Operators with missing children are rejected here rather than at evaluation.
+ */
+int tnode_compile(struct expression *expr, struct tree_node *node,
+		  struct expression_program *program);
+int expression_program_evaluate(struct expression *expr,
+				const struct expression_program *program, double *fnum);
+/**
+ * Evaluates at n values of the variable var_idx, the other variables keep their values.
+ * Every instruction runs over a block of points at once.
+ * Points where evaluation fails are NAN.
+ */
+int expression_program_evaluate_batch(struct expression *expr,
+				      const struct expression_program *program, size_t var_idx,
+				      const double *xs, double *ys, size_t n);
+int tnode_evaluate_batch(struct expression *expr, struct tree_node *node, int flags,
+			 size_t var_idx, const double *xs, double *ys, size_t n);
+
+/**
+ * Per-thread evaluation state, variable values by index and scratch registers.
+ * Programs are only read while running, so any number of contexts can run
+ * one program at once. Bindings are set by writing vars directly.
+ */
+struct expression_context {
+	double *vars;
+	size_t vars_cnt;
+
+	double *regs;
+	size_t regs_cnt;
+};
+
+/**
+ * Starts with the current values of the expression variables.
+ */
+int expression_context_ctor(struct expression_context *ctx, struct expression *expr);
+int expression_context_dtor(struct expression_context *ctx);
+int expression_context_evaluate(struct expression_context *ctx,
+				const struct expression_program *program, double *fnum);
+int expression_context_evaluate_batch(struct expression_context *ctx,
+				      const struct expression_program *program, size_t var_idx,
+				      const double *xs, double *ys, size_t n);
+
+/**
+ * The expression and its stored derivatives compiled once,
+ * programs[0] is the expression and programs[n] its n-th derivative.
+ */
+struct expression_compiled {
+	struct expression_program *programs;
+	size_t cnt;
+};
+
+int expression_compiled_ctor(struct expression_compiled *compiled, struct expression *expr);
+int expression_compiled_dtor(struct expression_compiled *compiled);
+
+struct expression_pool_worker;
+struct expression_pool_job;
+
+/**
+ * Threads for expression_pool_evaluate_batch() and expression_pool_run_tasks(),
+ * one call at a time.
+ */
+struct expression_pool {
+	pthread_t *threads;
+	struct expression_pool_worker *workers;
+	size_t threads_cnt;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_cond_t done;
+
+	struct expression_pool_job *job;
+	uint64_t generation;
+	size_t active;
+	int stop;
+};
+
+/**
+ * threads_cnt counts the calling thread, 0 takes one per online CPU.
+ */
+int expression_pool_ctor(struct expression_pool *pool, size_t threads_cnt);
+int expression_pool_dtor(struct expression_pool *pool);
+/**
+ * expression_program_evaluate_batch() split in chunks of chunk points, 0 picks a default.
+ * Idle threads steal chunks, ys is filled in place so the order does not depend on them.
+ */
+int expression_pool_evaluate_batch(struct expression_pool *pool, struct expression *expr,
+				   const struct expression_program *program, size_t var_idx,
+				   const double *xs, double *ys, size_t n, size_t chunk);
+
+typedef int (*expression_pool_task)(void *arg, size_t idx);
+
+/**
+ * Calls task(arg, idx) for every idx < n, idle threads steal the pending ones.
+ * The tasks run in any order and on any thread.
+ */
+int expression_pool_run_tasks(struct expression_pool *pool, size_t n,
+			      expression_pool_task task, void *arg);
+
+typedef double (*expression_jit_fn)(const double *vars);
+
+struct expression_jit {
+	expression_jit_fn fn;
+	void *code;
+	size_t size;
+};
+
+/**
+ * Compiles the program to x86-64 SSE2 code, fn takes the variable values by index.
+ * Fails on other targets and on operators without a jit template,
+ * expression_program_evaluate() runs the program then.
+ * fn returns NAN where the interpreter fails on division by zero.
+ */
+int expression_jit_ctor(struct expression_jit *jit, const struct expression_program *program);
+int expression_jit_dtor(struct expression_jit *jit);
+
+/**
+ * Vector kernels, four points per step with AVX2 when the CPU has it.
+ * Max error against glibc: sin and cos 2 ulp for |x| <= 1e5,
+ * log 1 ulp, pow 2 * (1 + |y * ln(x)|) ulp.
+ * Arguments outside of these ranges fall back to libm, so the special values match it.
+ */
+void expression_simd_sin(const double *x, double *y, size_t n);
+void expression_simd_cos(const double *x, double *y, size_t n);
+void expression_simd_log(const double *x, double *y, size_t n);
+void expression_simd_pow(const double *x, const double *p, double *y, size_t n);
+
 int expression_parse_str(char *str, struct expression *expr);
 int expression_parse_file(const char *filename, struct expression *expr);
 
@@ -69,11 +409,26 @@ enum expression_indexes {
 	DERIVATOR_IDX_SMALL_O,
 };
 
+struct expression_jit_emitter;
+
 struct expression_operator {
 	enum expression_indexes idx;
 	const char *name;
 	struct tree_node* (*deriver)(struct expression *expr, struct tree_node *node);
-	int (*evaluator)(struct expression *expr, struct tree_node *node, double *fnum);
+	// args hold the values of the left and the right child, nargs counts them
+	int (*evaluator)(struct expression *expr, const double *args,
+			 size_t nargs, double *fnum);
+	// Partial derivatives by the children at args, fnum is the value of the operator there
+	int (*partials)(struct expression *expr, const double *args,
+			size_t nargs, double fnum, double *dargs);
+	// Truncated power series of the operator, args and the result hold len coefficients
+	int (*series)(struct expression *expr, const double *const *args, size_t nargs,
+		      size_t len, double *scratch, double *c);
+	// Bounds of the operator over the argument ranges
+	int (*interval)(struct expression *expr, const struct expression_interval *args,
+			size_t nargs, struct expression_interval *res);
+	// Emits x86-64 code that takes lhs in xmm0 and rhs in xmm1, the result is in xmm0
+	int (*jit)(struct expression_jit_emitter *emitter);
 	const char *latex_name;
 	int priority;
 };
@@ -98,11 +453,18 @@ DSError_t expression_deserializer_endp(tree_dtype *value, const char *str, const
  */
 DSError_t expression_serializer(tree_dtype value, FILE *out_stream);
 
+/**
+ * Operators are the symbols of the binary format
+ */
+extern const struct tree_bin_codec expression_bin_codec;
+
 DSError_t expression_to_latex(struct expression *expr, FILE *out_stream);
 DSError_t tnode_write_latex_eq(struct expression *expr, struct tree_node *tnode,
 			       FILE *out_stream);
 DSError_t tnode_to_latex(struct expression *expr,
 				struct tree_node *node, FILE *out_stream);
+DSError_t tfrozen_to_latex(struct expression *expr,
+			   const struct tree_frozen *frozen, FILE *out_stream);
 DSError_t write_latex_header(FILE *latex_file);
 DSError_t write_latex_footer(FILE *latex_file);
 
@@ -115,18 +477,53 @@ struct tree_node *expr_create_variable_tnode(size_t idx);
 struct tree_node *expr_create_operator_tnode(const struct expression_operator *op, 
                                               struct tree_node *left, 
                                               struct tree_node *right);
+/**
+ * Builds op(left, right) from already simplified operands, applying the
+ * simplification rules and constant folding on the way.
+ * The operands are consumed even on failure.
+ */
+struct tree_node *expr_simplify_operator_tnode(struct expression *expr,
+					       const struct expression_operator *op,
+					       struct tree_node *left,
+					       struct tree_node *right);
 struct tree_node *expr_copy_tnode(struct expression *expr, struct tree_node *original);
 
+/**
+ * Value hash and equality that do not depend on operator addresses.
+ */
+uint64_t expression_value_hash(tree_dtype value);
+int expression_value_equal(tree_dtype a, tree_dtype b);
+int expr_tnode_equal(const struct tree_node *a, const struct tree_node *b);
+/**
+ * Fills the structural hashes of the expression tree.
+ */
+int expression_hash(struct expression *expr);
+
 #define DECLARE_EXPERSSION_OP(_idx, opname, opstring_name, oplatex, oppriority)	\
 	struct tree_node *expr_op_deriver_##opname(struct expression *expr,	\
 				struct tree_node *node);			\
 	int expr_op_evaluator_##opname(struct expression *expr,			\
-				struct tree_node *node, double *fnum);		\
+				const double *args, size_t nargs,		\
+				double *fnum);					\
+	int expr_op_partials_##opname(struct expression *expr,			\
+				const double *args, size_t nargs,		\
+				double fnum, double *dargs);			\
+	int expr_op_series_##opname(struct expression *expr,			\
+				const double *const *args, size_t nargs,	\
+				size_t len, double *scratch, double *c);	\
+	int expr_op_interval_##opname(struct expression *expr,			\
+				const struct expression_interval *args,		\
+				size_t nargs, struct expression_interval *res);	\
+	int expr_op_jit_##opname(struct expression_jit_emitter *emitter);	\
 	static const struct expression_operator expr_operator_##opname = {	\
 		.idx = _idx,							\
 		.name = opstring_name,						\
 		.deriver = expr_op_deriver_##opname,				\
 		.evaluator = expr_op_evaluator_##opname,			\
+		.partials = expr_op_partials_##opname,				\
+		.series = expr_op_series_##opname,				\
+		.interval = expr_op_interval_##opname,				\
+		.jit = expr_op_jit_##opname,					\
 		.latex_name = oplatex,						\
 		.priority = oppriority,						\
 	}
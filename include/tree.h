@@ -11,6 +11,8 @@ extern "C" {
 
 typedef struct {
 	int flags;
+	// Structural hash of the node and its subtree, 0 if not computed
+	uint32_t hash;
 
 	union {
 		void *ptr;
@@ -21,6 +23,8 @@ typedef struct {
 
 typedef DSError_t (*value_deserializer)(tree_dtype *value, const char *str);
 typedef DSError_t (*value_serializer)(tree_dtype value, FILE *out_stream);
+typedef uint64_t (*value_hasher)(tree_dtype value);
+typedef int (*value_comparator)(tree_dtype a, tree_dtype b);
 
 struct tree_node {
 	union {
@@ -35,9 +39,12 @@ struct tree_node {
 
 typedef void (*tree_node_value_dtor)(struct tree_node *node);
 
+struct tree_arena;
+
 struct tree {
 	struct tree_node *root;
 	tree_node_value_dtor tree_node_dtor;
+	struct tree_arena *arena;
 };
 
 DSError_t tree_ctor(struct tree *tree);
@@ -48,12 +55,395 @@ struct tree_node *tnode_ctor(void);
 void tnode_dtor(struct tree_node *node, tree_node_value_dtor vdtor);
 void tnode_recursive_dtor(struct tree_node *node, tree_node_value_dtor vdtor);
 
+/**
+ * Slab allocator for tree nodes.
+ *
+ * While an arena is selected for the current thread, tnode_ctor() takes
+ * nodes from it and tnode_dtor() puts them on its free list.
+ * A tree with the arena set releases all its nodes at once in tree_dtor().
+ */
+DSError_t tree_arena_ctor(struct tree_arena **arena);
+/**
+ * Drops one reference, the slabs are freed with the last one.
+ */
+void tree_arena_dtor(struct tree_arena *arena);
+struct tree_arena *tree_arena_ref(struct tree_arena *arena);
+
+enum {
+	// Nodes may have several parents, tnode_dtor() leaves them alone
+	TREE_ARENA_F_SHARED	= 0x1,
+	// Identical nodes are interned once by tnode_intern()
+	TREE_ARENA_F_HASHCONS	= 0x2 | TREE_ARENA_F_SHARED,
+	// Node constructors fill value.hash, see tnode_hash_combine()
+	TREE_ARENA_F_MERKLE	= 0x4,
+};
+
+DSError_t tree_arena_set_flags(struct tree_arena *arena, int flags);
+int tree_arena_get_flags(const struct tree_arena *arena);
+
+/**
+ * Selects the arena for the calling thread, NULL selects calloc.
+ * Returns the previously selected arena.
+ */
+struct tree_arena *tree_arena_select(struct tree_arena *arena);
+struct tree_arena *tree_arena_selected(void);
+
+/**
+ * Moves all nodes of other into arena, other is left empty.
+ * Lets threads build parts of one tree in arenas of their own.
+ * Arenas with interned nodes or a parent can not be merged.
+ */
+DSError_t tree_arena_merge(struct tree_arena *arena, struct tree_arena *other);
+
+size_t tree_arena_reserved_bytes(const struct tree_arena *arena);
+size_t tree_arena_used_bytes(const struct tree_arena *arena);
+
+/**
+ * Hash-consing in the selected arena.
+ *
+ * Returns the node equal to this one by value and children pointers,
+ * releasing the argument if such node is already interned.
+ * Without a hash-consing arena the node is returned as is.
+ */
+struct tree_node *tnode_intern(struct tree_node *node);
+int tnode_is_interned(const struct tree_node *node);
+
+/**
+ * Copy-on-write clone in O(1), the trees share all nodes.
+ *
+ * The clone gets a small arena on top of the source's one, whose nodes are never
+ * changed or released again while clones are around. The source arena is left as is,
+ * the source tree moves onto an arena of its own on its first tree_cow_path().
+ * Trees with value destructors can not be shared.
+ */
+DSError_t tree_share(struct tree *tree, struct tree *clone);
+/**
+ * Makes the node reached from the root by path mutable, copying the shared nodes on the way.
+ * Nonzero path[i] goes to the right child at depth i.
+ */
+DSError_t tree_cow_path(struct tree *tree, const uint8_t *path, size_t len,
+			struct tree_node **node);
+/**
+ * Makes every node of the tree mutable in one pass, copying the shared nodes once.
+ * Hashes are kept. Trees that share nothing are left as they are.
+ */
+DSError_t tree_unshare(struct tree *tree);
+
+/**
+ * Merkle hashing of subtrees.
+ *
+ * The hash of a node mixes the hash of its value with the hashes of its children,
+ * so equal subtrees hash equally in any tree and in any run, as long as the value
+ * hash is stable. Hashes are kept in value.hash, which is 0 until computed.
+ */
+int tnode_hash_enabled(void);
+/**
+ * Returns 0 if a child has no hash yet.
+ */
+uint32_t tnode_hash_combine(uint64_t value_hash, const struct tree_node *left,
+			    const struct tree_node *right);
+/**
+ * Fills the missing hashes in the subtree, hashed subtrees are not visited.
+ */
+DSError_t tnode_hash(struct tree_node *root, value_hasher hasher);
+/**
+ * Structural equality, without comparator values are compared bitwise.
+ * Different hashes reject in O(1), identical and interned nodes match in O(1).
+ * Returns -1 if out of memory.
+ */
+int tnode_equal(const struct tree_node *a, const struct tree_node *b,
+		value_comparator comparator);
+
+enum tree_walk_event {
+	TREE_WALK_END,
+	TREE_WALK_ERROR,
+	TREE_WALK_PRE,
+	TREE_WALK_IN,
+	TREE_WALK_POST,
+};
+
+enum {
+	TREE_WALK_F_PRE		= 1 << TREE_WALK_PRE,
+	TREE_WALK_F_IN		= 1 << TREE_WALK_IN,
+	TREE_WALK_F_POST	= 1 << TREE_WALK_POST,
+	TREE_WALK_F_ALL		= TREE_WALK_F_PRE | TREE_WALK_F_IN | TREE_WALK_F_POST,
+};
+
+struct tree_walk_frame {
+	struct tree_node *node;
+	int state;
+};
+
+#define TREE_WALKER_INLINE_DEPTH (64)
+
+/**
+ * Iterative depth-first walker with an explicit stack.
+ *
+ * Every node is reported as TREE_WALK_PRE before its children,
+ * TREE_WALK_IN between them and TREE_WALK_POST after them,
+ * limited to the events requested with TREE_WALK_F_* flags.
+ * The walker also keeps a stack of values for bottom-up walks.
+ * Shallow trees do not touch the heap.
+ */
+struct tree_walker {
+	int events;
+
+	struct tree_walk_frame *frames;
+	size_t depth;
+	size_t frames_capacity;
+
+	tree_dtype *values;
+	size_t values_len;
+	size_t values_capacity;
+
+	struct tree_walk_frame inline_frames[TREE_WALKER_INLINE_DEPTH];
+	tree_dtype inline_values[TREE_WALKER_INLINE_DEPTH];
+};
+
+DSError_t tree_walker_ctor(struct tree_walker *walker, struct tree_node *root,
+			   int events);
+void tree_walker_dtor(struct tree_walker *walker);
+
+enum tree_walk_event tree_walker_next(struct tree_walker *walker, struct tree_node **node);
+/**
+ * Called after TREE_WALK_PRE, drops the children and TREE_WALK_POST of the node.
+ */
+void tree_walker_skip(struct tree_walker *walker);
+/**
+ * Parent of the last reported node, NULL for the root.
+ */
+struct tree_node *tree_walker_parent(const struct tree_walker *walker);
+
+DSError_t tree_walker_grow_values(struct tree_walker *walker);
+
+static inline DSError_t tree_walker_push(struct tree_walker *walker, tree_dtype value) {
+	if (walker->values_len == walker->values_capacity &&
+	    tree_walker_grow_values(walker)) {
+		return DS_ALLOCATION;
+	}
+
+	walker->values[walker->values_len++] = value;
+
+	return DS_OK;
+}
+
+static inline tree_dtype tree_walker_pop(struct tree_walker *walker) {
+	return walker->values[--walker->values_len];
+}
+
+typedef DSError_t (*tree_walk_visitor)(struct tree_node *node, void *ctx);
+
+/**
+ * Calls visitor for every node in the order given by the event:
+ * TREE_WALK_PRE, TREE_WALK_IN or TREE_WALK_POST.
+ */
+DSError_t tree_walk(struct tree_node *root, enum tree_walk_event order,
+		    tree_walk_visitor visitor, void *ctx);
+
+#define TREE_CNODE_INDEX_BITS	(28)
+#define TREE_CNODE_INDEX_MASK	((1u << TREE_CNODE_INDEX_BITS) - 1)
+#define TREE_CNODE_NIL		TREE_CNODE_INDEX_MASK
+#define TREE_CNODE_FLAGS_MASK	(0xFu)
+
+/**
+ * 16-byte node of a compact tree.
+ *
+ * Children are 28-bit indices, TREE_CNODE_NIL for none.
+ * The upper bits of left hold the value flags, so they must fit in TREE_CNODE_FLAGS_MASK.
+ */
+struct tree_cnode {
+	uint32_t left;
+	uint32_t right;
+
+	union {
+		void *ptr;
+		size_t varidx;
+		double fnum;
+	};
+};
+
+/**
+ * Tree stored in one contiguous buffer in post-order:
+ * children always precede their parents and the root is the last node.
+ * A subtree reachable through several parents is stored once.
+ */
+struct tree_compact {
+	struct tree_cnode *nodes;
+	size_t len;
+	size_t capacity;
+};
+
+static inline uint32_t tree_cnode_left(const struct tree_cnode *cnode) {
+	return cnode->left & TREE_CNODE_INDEX_MASK;
+}
+
+static inline uint32_t tree_cnode_right(const struct tree_cnode *cnode) {
+	return cnode->right & TREE_CNODE_INDEX_MASK;
+}
+
+static inline int tree_cnode_flags(const struct tree_cnode *cnode) {
+	return (int)(cnode->left >> TREE_CNODE_INDEX_BITS);
+}
+
+DSError_t tree_compact_ctor(struct tree_compact *compact);
+DSError_t tree_compact_dtor(struct tree_compact *compact);
+
+/**
+ * Replaces the contents of compact with the tree under root.
+ */
+DSError_t tree_compact_from_node(struct tree_compact *compact, struct tree_node *root);
+/**
+ * Builds a pointer tree with tnode_ctor().
+ * Nodes stored once are shared only if the selected arena is shared.
+ */
+DSError_t tree_compact_to_node(const struct tree_compact *compact, struct tree_node **root);
+DSError_t tree_compact_copy(const struct tree_compact *src, struct tree_compact *dst);
+DSError_t tree_compact_serialize(const struct tree_compact *compact, FILE *file,
+				 value_serializer serializer);
+
+enum {
+	TREE_FNODE_LEFT		= 0x1,
+	TREE_FNODE_RIGHT	= 0x2,
+};
+
+struct tree_fnode {
+	// Nodes in the subtree, this one included
+	uint32_t size;
+	uint16_t flags;
+	uint16_t children;
+
+	union {
+		void *ptr;
+		size_t varidx;
+		double fnum;
+	};
+};
+
+/**
+ * Immutable tree in post-order with implicit child links.
+ *
+ * The right child of a node directly precedes it, the left one
+ * precedes the right subtree. Shared subtrees are expanded.
+ */
+struct tree_frozen {
+	struct tree_fnode *nodes;
+	size_t len;
+	// Values a post-order scan keeps at most
+	size_t stack_depth;
+};
+
+static inline size_t tree_frozen_right(const struct tree_frozen *frozen, size_t idx) {
+	(void)frozen;
+
+	return idx - 1;
+}
+
+static inline size_t tree_frozen_left(const struct tree_frozen *frozen, size_t idx) {
+	if (frozen->nodes[idx].children & TREE_FNODE_RIGHT) {
+		return idx - 1 - frozen->nodes[idx - 1].size;
+	}
+
+	return idx - 1;
+}
+
+static inline tree_dtype tree_fnode_value(const struct tree_fnode *fnode) {
+	// Copied as an integer, so pointers never pass through float registers
+	tree_dtype value = { .flags = fnode->flags, .varidx = fnode->varidx };
+
+	return value;
+}
+
+DSError_t tree_freeze(const struct tree *tree, struct tree_frozen *frozen);
+DSError_t tnode_freeze(struct tree_node *root, struct tree_frozen *frozen);
+DSError_t tree_frozen_dtor(struct tree_frozen *frozen);
+
+/**
+ * Structural hash of values and shape, equal trees hash equally.
+ */
+uint64_t tree_frozen_hash(const struct tree_frozen *frozen);
+
 DSError_t tree_store(struct tree *tree, const char *filename, value_serializer serializer);
 DSError_t tree_serialize_node(struct tree_node *node, FILE *file, value_serializer serializer);
 
 DSError_t tree_load(struct tree *tree, const char *filename, value_deserializer deserializer);
+/**
+ * Loads a tree in the tree_store() format from a file or a pipe without reading it whole.
+ */
+DSError_t tree_load_stream(struct tree *tree, FILE *file, value_deserializer deserializer);
 DSError_t tree_deserialize_node(struct tree_node **node, char *buffer, size_t *pos, value_deserializer deserializer);
 
+#define TREE_BIN_MAGIC		"DTRB"
+#define TREE_BIN_VERSION	(1)
+
+enum tree_bin_value {
+	// 8 raw bytes of the value, doubles keep every bit
+	TREE_BIN_VALUE_RAW,
+	// Unsigned varint, such as an index
+	TREE_BIN_VALUE_VARINT,
+	// Pointer to one of the codec symbols
+	TREE_BIN_VALUE_SYMBOL,
+};
+
+/**
+ * Describes values for the binary format.
+ *
+ * Pointer values are written as indices in the symbol table of the file,
+ * the table keeps symbol names, so the codec order may change between versions.
+ */
+struct tree_bin_codec {
+	enum tree_bin_value (*value_kind)(int flags);
+
+	size_t symbols_cnt;
+	const void *(*symbol)(size_t idx);
+	const char *(*symbol_name)(size_t idx);
+	// symbols_cnt for a pointer that is not a symbol
+	size_t (*symbol_index)(const void *symbol);
+};
+
+/**
+ * Binary format: header with the symbol table and the node count,
+ * then nodes in post-order. A node is a varint of flags and children bits,
+ * varint distances back to its children and the value.
+ * Shared nodes of a shared arena are written once.
+ */
+DSError_t tree_store_binary(struct tree *tree, const char *filename,
+			    const struct tree_bin_codec *codec);
+DSError_t tree_load_binary(struct tree *tree, const char *filename,
+			   const struct tree_bin_codec *codec);
+
+#define TREE_MAPPED_MAGIC	"DTRM"
+#define TREE_MAPPED_VERSION	(1)
+
+/**
+ * Read-only view of a compact tree file mapped into memory.
+ *
+ * Nodes are struct tree_cnode right in the mapping, symbol values
+ * hold indices into symbols. The pages are shared by every process
+ * mapping the same file, nothing is read until it is touched.
+ */
+struct tree_mapped {
+	const struct tree_cnode *nodes;
+	size_t len;
+
+	const struct tree_bin_codec *codec;
+	const void **symbols;
+	size_t symbols_cnt;
+
+	void *map;
+	size_t map_size;
+};
+
+/**
+ * Writes the tree as a compact tree with a fixed layout, so it can be mapped.
+ */
+DSError_t tree_store_mapped(struct tree *tree, const char *filename,
+			    const struct tree_bin_codec *codec);
+DSError_t tree_mapped_ctor(struct tree_mapped *mapped, const char *filename,
+			   const struct tree_bin_codec *codec);
+DSError_t tree_mapped_dtor(struct tree_mapped *mapped);
+DSError_t tree_mapped_serialize(const struct tree_mapped *mapped, FILE *file,
+				value_serializer serializer);
+
 struct tree_dump_params {
 	FILE *out_stream;
 	const char *drawing_filename;
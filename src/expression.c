@@ -22,6 +22,17 @@ int expression_ctor(struct expression *expr) {
 		return S_FAIL;
 	}
 
+	expr->hashcons = 0;
+	expr->merkle = 0;
+	expr->dag_arena = NULL;
+	expr->memoize = 0;
+	expr->derive_memo = NULL;
+	expr->pool = NULL;
+	expr->derive_tasks = NULL;
+	expr->trace_max = 0;
+	expr->trace = NULL;
+	expr->derive_deps = NULL;
+
 	if (pvector_init(&(expr->variables), sizeof(struct expression_variable))) {
 		return S_FAIL;
 	}
@@ -52,6 +63,11 @@ int expression_dtor(struct expression *expr) {
 	pvector_destroy(&expr->derivatives);
 	pvector_destroy(&expr->graph_files);
 
+	expression_derive_memo_clear(expr);
+	expression_trace_clear(expr);
+	tree_arena_dtor(expr->dag_arena);
+	expr->dag_arena = NULL;
+
 	return S_OK;
 }
 
@@ -122,6 +138,11 @@ int expression_validate(struct expression *expr) {
 		return S_FAIL;
 	}
 
+	// Constant flags are set in place, so nodes shared with clones are copied first
+	if (tree_unshare(&expr->tree)) {
+		return S_FAIL;
+	}
+
 	int ret = tnode_validate(expr, expr->tree.root);
 
 	return ret;
@@ -155,6 +176,74 @@ int expression_store(struct expression *expr, const char *filename) {
 	return S_OK;
 }
 
+static enum tree_bin_value expression_bin_value_kind(int flags) {
+	switch (flags & DERIVATOR_F_OPERATOR) {
+		case DERIVATOR_F_VARIABLE:
+			return TREE_BIN_VALUE_VARINT;
+		case DERIVATOR_F_OPERATOR:
+			return TREE_BIN_VALUE_SYMBOL;
+		default:
+			return TREE_BIN_VALUE_RAW;
+	}
+}
+
+static const void *expression_bin_symbol(size_t idx) {
+	return expression_operators[idx];
+}
+
+static const char *expression_bin_symbol_name(size_t idx) {
+	return expression_operators[idx]->name;
+}
+
+// Every translation unit has its own operator copies, so they are told apart by idx
+static size_t expression_bin_symbol_index(const void *symbol) {
+	return ((const struct expression_operator *)symbol)->idx;
+}
+
+const struct tree_bin_codec expression_bin_codec = {
+	.value_kind = expression_bin_value_kind,
+	.symbols_cnt = sizeof(expression_operators) / sizeof(*expression_operators) - 1,
+	.symbol = expression_bin_symbol,
+	.symbol_name = expression_bin_symbol_name,
+	.symbol_index = expression_bin_symbol_index,
+};
+
+int expression_load_binary(struct expression *expr, const char *filename) {
+	assert (expr);
+	assert (filename);
+
+	tree_dtor(&expr->tree);
+
+	// Flags are stored exactly, there is nothing to validate
+	if (tree_load_binary(&expr->tree, filename, &expression_bin_codec)) {
+		return S_FAIL;
+	}
+
+	return S_OK;
+}
+
+int expression_store_binary(struct expression *expr, const char *filename) {
+	assert (expr);
+	assert (filename);
+
+	if (tree_store_binary(&expr->tree, filename, &expression_bin_codec)) {
+		return S_FAIL;
+	}
+
+	return S_OK;
+}
+
+int expression_store_mapped(struct expression *expr, const char *filename) {
+	assert (expr);
+	assert (filename);
+
+	if (tree_store_mapped(&expr->tree, filename, &expression_bin_codec)) {
+		return S_FAIL;
+	}
+
+	return S_OK;
+}
+
 DSError_t expression_deserializer(tree_dtype *value, const char *str) {
 	assert (value);
 	assert (str);
@@ -202,6 +291,55 @@ DSError_t expression_serializer(tree_dtype value, FILE *out_stream) {
 	return DS_INVALID_ARG;
 }
 
+uint64_t expression_value_hash(tree_dtype value) {
+	uint64_t bits = 0;
+
+	switch (value.flags & DERIVATOR_F_OPERATOR) {
+		case DERIVATOR_F_OPERATOR:
+			// Operators differ by address between translation units
+			bits = ((const struct expression_operator *)value.ptr)->idx;
+			break;
+		case DERIVATOR_F_VARIABLE:
+			bits = value.varidx;
+			break;
+		default:
+			memcpy(&bits, &value.fnum, sizeof(bits));
+			break;
+	}
+
+	return bits * 0x9e3779b97f4a7c15ULL ^ (uint64_t)(unsigned int)value.flags;
+}
+
+int expression_value_equal(tree_dtype a, tree_dtype b) {
+	if (a.flags != b.flags) {
+		return 0;
+	}
+
+	switch (a.flags & DERIVATOR_F_OPERATOR) {
+		case DERIVATOR_F_OPERATOR:
+			return ((const struct expression_operator *)a.ptr)->idx ==
+			       ((const struct expression_operator *)b.ptr)->idx;
+		case DERIVATOR_F_VARIABLE:
+			return a.varidx == b.varidx;
+		default:
+			return !memcmp(&a.fnum, &b.fnum, sizeof(a.fnum));
+	}
+}
+
+int expr_tnode_equal(const struct tree_node *a, const struct tree_node *b) {
+	return tnode_equal(a, b, expression_value_equal);
+}
+
+int expression_hash(struct expression *expr) {
+	assert (expr);
+
+	if (tnode_hash(expr->tree.root, expression_value_hash)) {
+		return S_FAIL;
+	}
+
+	return S_OK;
+}
+
 struct tree_node *expr_create_number_tnode(double fnum) {
 	struct tree_node *node = tnode_ctor();
 
@@ -213,7 +351,11 @@ struct tree_node *expr_create_number_tnode(double fnum) {
 	node->left = NULL;
 	node->right = NULL;
 
-	return node;
+	if (tnode_hash_enabled()) {
+		node->value.hash = tnode_hash_combine(expression_value_hash(node->value), NULL, NULL);
+	}
+
+	return tnode_intern(node);
 }
 
 struct tree_node *expr_create_variable_tnode(size_t idx) {
@@ -227,7 +369,11 @@ struct tree_node *expr_create_variable_tnode(size_t idx) {
 	node->left = NULL;
 	node->right = NULL;
 
-	return node;
+	if (tnode_hash_enabled()) {
+		node->value.hash = tnode_hash_combine(expression_value_hash(node->value), NULL, NULL);
+	}
+
+	return tnode_intern(node);
 }
 
 struct tree_node *expr_create_operator_tnode(const struct expression_operator *op, 
@@ -254,36 +400,84 @@ struct tree_node *expr_create_operator_tnode(const struct expression_operator *o
 		}
 	}
 
-	return node;
+	if (tnode_hash_enabled()) {
+		node->value.hash = tnode_hash_combine(expression_value_hash(node->value), left, right);
+	}
+
+	return tnode_intern(node);
 }
 
 struct tree_node *expr_copy_tnode(struct expression *expr, struct tree_node *original) {
 	assert (original);
+	(void)expr;
+
+	int ret = S_OK;
+	struct tree_node *node = NULL, *copy = NULL;
+	struct tree_walker walker;
 
-	struct tree_node *copy = tnode_ctor();
-	if (!copy)
+	if (tree_walker_ctor(&walker, original, TREE_WALK_F_PRE | TREE_WALK_F_POST)) {
 		return NULL;
+	}
+
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+
+		// Interned subtrees are immutable and may be shared as is
+		if (event == TREE_WALK_PRE && tnode_is_interned(node)) {
+			tree_walker_skip(&walker);
+
+			if (tree_walker_push(&walker, (tree_dtype){ .ptr = node })) {
+				_CT_FAIL();
+			}
+			continue;
+		}
 
-	copy->value = original->value;
+		if (event == TREE_WALK_PRE) {
+			continue;
+		}
+
+		copy = tnode_ctor();
+		if (!copy) {
+			_CT_FAIL();
+		}
 
-	if (original->left) {
-		copy->left = expr_copy_tnode(expr, original->left);
+		copy->value = node->value;
+
+		if (node->right) {
+			copy->right = tree_walker_pop(&walker).ptr;
+		}
+		if (node->left) {
+			copy->left = tree_walker_pop(&walker).ptr;
+		}
 
-		if (!copy->left) {
-			tnode_recursive_dtor(copy, NULL);
-			return NULL;
+		copy = tnode_intern(copy);
+		if (!copy) {
+			_CT_FAIL();
 		}
+
+		if (tree_walker_push(&walker, (tree_dtype){ .ptr = copy })) {
+			_CT_FAIL();
+		}
+		copy = NULL;
 	}
 
-	if (original->right) {
-		copy->right = expr_copy_tnode(expr, original->right);
+	copy = tree_walker_pop(&walker).ptr;
+
+_CT_EXIT_POINT:
+	if (ret) {
+		tnode_recursive_dtor(copy, NULL);
+		copy = NULL;
 
-		if (!copy->right) {
-			tnode_recursive_dtor(copy, NULL);
-			return NULL;
+		while (walker.values_len) {
+			tnode_recursive_dtor(tree_walker_pop(&walker).ptr, NULL);
 		}
 	}
 
+	tree_walker_dtor(&walker);
+
 	return copy;
 }
 
@@ -293,6 +487,11 @@ int expression_clone(struct expression *expr, struct expression *nexpr) {
 
 	*nexpr = (struct expression) {
 		.differentiating_variable = expr->differentiating_variable,
+		.hashcons = expr->hashcons,
+		.merkle = expr->merkle,
+		.memoize = expr->memoize,
+		.pool = expr->pool,
+		.trace_max = expr->trace_max,
 		.tree = {0},
 		.variables = NULL,
 	};
@@ -301,9 +500,23 @@ int expression_clone(struct expression *expr, struct expression *nexpr) {
 		return S_FAIL;
 	};
 
-	nexpr->tree.root = expr_copy_tnode(expr, expr->tree.root);
 	nexpr->latex_file = expr->latex_file;
 
+	// Trees without an arena may free their nodes, so they are copied
+	if (expr->tree.arena && expr->tree.root) {
+		if (tree_share(&expr->tree, &nexpr->tree)) {
+			return S_FAIL;
+		}
+	} else {
+		if (tree_arena_ctor(&nexpr->tree.arena)) {
+			return S_FAIL;
+		}
+
+		struct tree_arena *prev_arena = tree_arena_select(nexpr->tree.arena);
+		nexpr->tree.root = expr_copy_tnode(expr, expr->tree.root);
+		tree_arena_select(prev_arena);
+	}
+
 	if (!nexpr->tree.root) {
 		return S_FAIL;
 	}
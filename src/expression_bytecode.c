@@ -0,0 +1,783 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tree.h"
+#include "expression.h"
+
+static const double deps = 1e-9;
+
+#define EXPRESSION_PROGRAM_INLINE_REGS (256)
+
+DSError_t expression_program_ctor(struct expression_program *program) {
+	assert (program);
+
+	*program = (struct expression_program){0};
+
+	return DS_OK;
+}
+
+DSError_t expression_program_dtor(struct expression_program *program) {
+	assert (program);
+
+	free(program->code);
+	free(program->consts);
+	*program = (struct expression_program){0};
+
+	return DS_OK;
+}
+
+static int expression_program_reserve(struct expression_program *program, size_t needed) {
+	if (needed <= program->capacity) {
+		return S_OK;
+	}
+
+	size_t capacity = program->capacity ? program->capacity * 2 : 64;
+	while (capacity < needed) {
+		capacity *= 2;
+	}
+
+	struct expression_insn *code = (struct expression_insn *)
+		realloc(program->code, capacity * sizeof(*code));
+	if (!code) {
+		return S_FAIL;
+	}
+
+	program->code = code;
+	program->capacity = capacity;
+
+	return S_OK;
+}
+
+// Binary operators need both children, unary ones the left one
+static int expression_insn_check(const struct tree_cnode *cnode, enum expression_indexes idx) {
+	int has_left = tree_cnode_left(cnode) != TREE_CNODE_NIL;
+	int has_right = tree_cnode_right(cnode) != TREE_CNODE_NIL;
+
+	switch (idx) {
+		case DERIVATOR_IDX_PLUS:
+		case DERIVATOR_IDX_MINUS:
+		case DERIVATOR_IDX_MULTIPLY:
+		case DERIVATOR_IDX_DIVIDE:
+		case DERIVATOR_IDX_POW:
+			return has_left && has_right ? S_OK : S_FAIL;
+		case DERIVATOR_IDX_LN:
+		case DERIVATOR_IDX_SIN:
+		case DERIVATOR_IDX_COS:
+		case DERIVATOR_IDX_SMALL_O:
+			return has_left ? S_OK : S_FAIL;
+		default:
+			return S_FAIL;
+	}
+}
+
+// Shared by the interpreter and constant folding, so both round the same way
+static inline int expression_insn_apply(uint32_t opcode, double lnum, double rnum, double *fnum) {
+	switch ((enum expression_indexes)opcode) {
+		case DERIVATOR_IDX_PLUS:
+			*fnum = lnum + rnum;
+			return S_OK;
+		case DERIVATOR_IDX_MINUS:
+			*fnum = lnum - rnum;
+			return S_OK;
+		case DERIVATOR_IDX_MULTIPLY:
+			*fnum = lnum * rnum;
+			return S_OK;
+		case DERIVATOR_IDX_DIVIDE:
+			if (fabs(rnum) < deps) {
+				return S_FAIL;
+			}
+			*fnum = lnum / rnum;
+			return S_OK;
+		case DERIVATOR_IDX_POW:
+			*fnum = pow(lnum, rnum);
+			return S_OK;
+		case DERIVATOR_IDX_LN:
+			*fnum = log(lnum);
+			return S_OK;
+		case DERIVATOR_IDX_SIN:
+			*fnum = sin(lnum);
+			return S_OK;
+		case DERIVATOR_IDX_COS:
+			*fnum = cos(lnum);
+			return S_OK;
+		case DERIVATOR_IDX_SMALL_O:
+			*fnum = 0;
+			return S_OK;
+		default:
+			return S_FAIL;
+	}
+}
+
+enum {
+	EXPRESSION_VALUE_CONST	= UINT32_MAX,
+	EXPRESSION_VALUE_VAR	= UINT32_MAX - 1,
+};
+
+/*
+ * Value numbering: equal subexpressions get one number even if they
+ * are different nodes. Values are created in topological order.
+ */
+struct expression_value {
+	uint32_t opcode;
+	uint32_t lhs;
+	uint32_t rhs;
+	uint32_t reg;
+	union {
+		double fnum;
+		size_t varidx;
+	};
+};
+
+struct expression_lowering {
+	struct expression_value *values;
+	size_t len;
+
+	uint32_t *table;
+	size_t table_mask;
+};
+
+static uint64_t expression_value_key(const struct expression_value *value) {
+	uint64_t bits = 0;
+	memcpy(&bits, &value->fnum, sizeof(bits));
+
+	uint64_t hsh = (uint64_t)value->opcode * 0x9e3779b97f4a7c15ULL;
+	hsh ^= ((uint64_t)value->lhs << 32 | value->rhs) + (hsh << 6) + (hsh >> 2);
+	hsh ^= bits + 0x7f4a7c159e3779b9ULL + (hsh << 6) + (hsh >> 2);
+	hsh ^= hsh >> 29;
+	hsh *= 0xbf58476d1ce4e5b9ULL;
+
+	return hsh ^ (hsh >> 32);
+}
+
+static int expression_value_same(const struct expression_value *a, const struct expression_value *b) {
+	return	a->opcode == b->opcode && a->lhs == b->lhs && a->rhs == b->rhs &&
+		!memcmp(&a->fnum, &b->fnum, sizeof(a->fnum));
+}
+
+static uint32_t expression_value_number(struct expression_lowering *lowering,
+					struct expression_value value) {
+	size_t slot = (size_t)expression_value_key(&value) & lowering->table_mask;
+
+	while (lowering->table[slot] != UINT32_MAX) {
+		if (expression_value_same(&lowering->values[lowering->table[slot]], &value)) {
+			return lowering->table[slot];
+		}
+		slot = (slot + 1) & lowering->table_mask;
+	}
+
+	lowering->table[slot] = (uint32_t)lowering->len;
+	lowering->values[lowering->len] = value;
+
+	return (uint32_t)lowering->len++;
+}
+
+static int expression_value_is(const struct expression_lowering *lowering, uint32_t vn, double fnum) {
+	const struct expression_value *value = &lowering->values[vn];
+
+	return value->opcode == EXPRESSION_VALUE_CONST &&
+	       !memcmp(&value->fnum, &fnum, sizeof(fnum));
+}
+
+/*
+ * Folds constants and applies the identities that give bit-exact results:
+ * x^1 = x, x^0 = 1, x^2 = x*x, x*1 = 1*x = x, x/1 = x, x-0 = x.
+ */
+static uint32_t expression_value_operator(struct expression_lowering *lowering,
+					  uint32_t opcode, uint32_t lhs, uint32_t rhs) {
+	const struct expression_value *lvalue = &lowering->values[lhs];
+	const struct expression_value *rvalue = &lowering->values[rhs];
+	struct expression_value value = { .opcode = opcode, .lhs = lhs, .rhs = rhs };
+
+	if (lvalue->opcode == EXPRESSION_VALUE_CONST && rvalue->opcode == EXPRESSION_VALUE_CONST) {
+		double fnum = 0;
+
+		// Division by zero still fails when the program runs
+		if (!expression_insn_apply(opcode, lvalue->fnum, rvalue->fnum, &fnum)) {
+			return expression_value_number(lowering, (struct expression_value){
+				.opcode = EXPRESSION_VALUE_CONST, .fnum = fnum });
+		}
+	}
+
+	switch ((enum expression_indexes)opcode) {
+		case DERIVATOR_IDX_POW:
+			if (expression_value_is(lowering, rhs, 1)) {
+				return lhs;
+			}
+			if (expression_value_is(lowering, rhs, 0)) {
+				return expression_value_number(lowering, (struct expression_value){
+					.opcode = EXPRESSION_VALUE_CONST, .fnum = 1 });
+			}
+			if (expression_value_is(lowering, rhs, 2)) {
+				value = (struct expression_value){
+					.opcode = DERIVATOR_IDX_MULTIPLY, .lhs = lhs, .rhs = lhs };
+			}
+			break;
+		case DERIVATOR_IDX_MULTIPLY:
+			if (expression_value_is(lowering, rhs, 1)) {
+				return lhs;
+			}
+			if (expression_value_is(lowering, lhs, 1)) {
+				return rhs;
+			}
+			break;
+		case DERIVATOR_IDX_DIVIDE:
+		case DERIVATOR_IDX_MINUS:
+			if (expression_value_is(lowering, rhs, opcode == DERIVATOR_IDX_DIVIDE ? 1 : 0)) {
+				return lhs;
+			}
+			break;
+		case DERIVATOR_IDX_SMALL_O:
+			return expression_value_number(lowering, (struct expression_value){
+				.opcode = EXPRESSION_VALUE_CONST, .fnum = 0 });
+		case DERIVATOR_IDX_PLUS:
+		case DERIVATOR_IDX_LN:
+		case DERIVATOR_IDX_SIN:
+		case DERIVATOR_IDX_COS:
+		default:
+			break;
+	}
+
+	return expression_value_number(lowering, value);
+}
+
+static int expression_lowering_number(struct expression_lowering *lowering,
+				      const struct tree_compact *compact, uint32_t *vn) {
+	for (size_t i = 0; i < compact->len; i++) {
+		const struct tree_cnode *cnode = &compact->nodes[i];
+		struct expression_value value = {0};
+
+		switch (tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) {
+			case DERIVATOR_F_NUMBER:
+				value.opcode = EXPRESSION_VALUE_CONST;
+				memcpy(&value.fnum, &cnode->fnum, sizeof(value.fnum));
+				vn[i] = expression_value_number(lowering, value);
+				break;
+			case DERIVATOR_F_VARIABLE:
+				value.opcode = EXPRESSION_VALUE_VAR;
+				value.varidx = cnode->varidx;
+				vn[i] = expression_value_number(lowering, value);
+				break;
+			case DERIVATOR_F_OPERATOR: {
+				const struct expression_operator *op = cnode->ptr;
+				if (expression_insn_check(cnode, op->idx)) {
+					return S_FAIL;
+				}
+
+				uint32_t left = tree_cnode_left(cnode), right = tree_cnode_right(cnode);
+				vn[i] = expression_value_operator(lowering, (uint32_t)op->idx, vn[left],
+								  right != TREE_CNODE_NIL ? vn[right] : vn[left]);
+				break;
+			}
+			default:
+				return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+/*
+ * Registers hold the constants first, then the variables, then temporaries.
+ * Leaves take no instructions, temporaries are reused after their last use.
+ * The last_use and free_regs arrays are reused from the numbering.
+ */
+static int expression_lowering_emit(struct expression_program *program,
+				    struct expression_lowering *lowering, uint32_t root,
+				    uint32_t *last_use, uint32_t *free_regs) {
+	struct expression_value *values = lowering->values;
+	size_t consts_cnt = 0, free_cnt = 0;
+	uint32_t temps_cnt = 0;
+
+	// Liveness from the root, dead values are what the identities left behind
+	for (size_t i = 0; i < lowering->len; i++) {
+		last_use[i] = UINT32_MAX;
+	}
+	last_use[root] = root;
+
+	for (size_t i = lowering->len; i-- > 0; ) {
+		if (last_use[i] == UINT32_MAX) {
+			continue;
+		}
+
+		if (values[i].opcode == EXPRESSION_VALUE_CONST) {
+			consts_cnt++;
+		} else if (values[i].opcode == EXPRESSION_VALUE_VAR) {
+			if (values[i].varidx >= program->vars_cnt) {
+				program->vars_cnt = values[i].varidx + 1;
+			}
+		} else {
+			if (last_use[values[i].lhs] == UINT32_MAX) {
+				last_use[values[i].lhs] = (uint32_t)i;
+			}
+			if (last_use[values[i].rhs] == UINT32_MAX) {
+				last_use[values[i].rhs] = (uint32_t)i;
+			}
+		}
+	}
+
+	if (program->vars_cnt + consts_cnt >= UINT32_MAX - lowering->len) {
+		return S_FAIL;
+	}
+
+	program->consts = (double *)calloc(consts_cnt ? consts_cnt : 1, sizeof(double));
+	if (!program->consts) {
+		return S_FAIL;
+	}
+
+	uint32_t temps_base = (uint32_t)(consts_cnt + program->vars_cnt);
+
+	for (size_t i = 0; i < lowering->len; i++) {
+		struct expression_value *value = &values[i];
+
+		if (last_use[i] == UINT32_MAX) {
+			continue;
+		}
+
+		if (value->opcode == EXPRESSION_VALUE_CONST) {
+			value->reg = (uint32_t)program->consts_cnt;
+			program->consts[program->consts_cnt++] = value->fnum;
+			continue;
+		}
+
+		if (value->opcode == EXPRESSION_VALUE_VAR) {
+			value->reg = (uint32_t)(consts_cnt + value->varidx);
+			continue;
+		}
+
+		if (expression_program_reserve(program, program->len + 1)) {
+			return S_FAIL;
+		}
+
+		uint32_t lreg = values[value->lhs].reg, rreg = values[value->rhs].reg;
+		program->code[program->len++] = (struct expression_insn){
+			.opcode = value->opcode,
+			.lhs = lreg,
+			.rhs = rreg,
+		};
+
+		// Operands die before the result is written, so it may take their register
+		if (lreg >= temps_base && last_use[value->lhs] == i) {
+			free_regs[free_cnt++] = lreg;
+		}
+		if (value->rhs != value->lhs && rreg >= temps_base && last_use[value->rhs] == i) {
+			free_regs[free_cnt++] = rreg;
+		}
+
+		value->reg = free_cnt ? free_regs[--free_cnt] : temps_base + temps_cnt++;
+		program->code[program->len - 1].dst = value->reg;
+	}
+
+	program->regs_cnt = temps_base + temps_cnt;
+	program->result = values[root].reg;
+
+	return S_OK;
+}
+
+int tnode_compile(struct expression *expr, struct tree_node *node,
+		  struct expression_program *program) {
+	assert (expr);
+	assert (node);
+	assert (program);
+
+	int ret = S_OK;
+	uint32_t *scratch = NULL;
+	struct expression_lowering lowering = {0};
+	struct tree_compact compact;
+	tree_compact_ctor(&compact);
+
+	int flags = program->flags;
+	expression_program_dtor(program);
+	program->flags = flags;
+
+	if (tree_compact_from_node(&compact, node)) {
+		_CT_FAIL();
+	}
+
+	size_t table_size = 2;
+	while (table_size < 2 * compact.len) {
+		table_size *= 2;
+	}
+
+	scratch = (uint32_t *)calloc(2 * compact.len, sizeof(*scratch));
+	lowering.values = (struct expression_value *)calloc(compact.len, sizeof(*lowering.values));
+	lowering.table = (uint32_t *)malloc(table_size * sizeof(*lowering.table));
+	if (!scratch || !lowering.values || !lowering.table) {
+		_CT_FAIL();
+	}
+
+	memset(lowering.table, 0xFF, table_size * sizeof(*lowering.table));
+	lowering.table_mask = table_size - 1;
+
+	if (expression_lowering_number(&lowering, &compact, scratch)) {
+		_CT_FAIL();
+	}
+
+	if (expression_lowering_emit(program, &lowering, scratch[compact.len - 1],
+				     scratch, scratch + compact.len)) {
+		_CT_FAIL();
+	}
+
+_CT_EXIT_POINT:
+	if (ret) {
+		expression_program_dtor(program);
+	}
+
+	free(lowering.table);
+	free(lowering.values);
+	free(scratch);
+	tree_compact_dtor(&compact);
+
+	return ret;
+}
+
+// Registers already hold the constants and the variables
+static int expression_program_run(const struct expression_program *program, double *regs) {
+	const struct expression_insn *insn = program->code;
+	const struct expression_insn *end = program->code + program->len;
+
+	for (; insn != end; insn++) {
+		if (expression_insn_apply(insn->opcode, regs[insn->lhs], regs[insn->rhs],
+					  &regs[insn->dst])) {
+			return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+int expression_program_evaluate(struct expression *expr,
+				const struct expression_program *program, double *fnum) {
+	assert (expr);
+	assert (program);
+	assert (fnum);
+
+	if (!program->regs_cnt || program->vars_cnt > expr->variables.len) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	double inline_regs[EXPRESSION_PROGRAM_INLINE_REGS];
+	double *regs = inline_regs;
+
+	if (program->regs_cnt > EXPRESSION_PROGRAM_INLINE_REGS) {
+		regs = (double *)calloc(program->regs_cnt, sizeof(double));
+		if (!regs) {
+			return S_FAIL;
+		}
+	}
+
+	memcpy(regs, program->consts, program->consts_cnt * sizeof(double));
+
+	for (size_t i = 0; i < program->vars_cnt; i++) {
+		struct expression_variable *variable = NULL;
+		if (pvector_get(&expr->variables, i, (void **)&variable)) {
+			_CT_FAIL();
+		}
+
+		regs[program->consts_cnt + i] = variable->value;
+	}
+
+	if (expression_program_run(program, regs)) {
+		log_error("Division by zero.");
+		_CT_FAIL();
+	}
+
+	*fnum = regs[program->result];
+
+_CT_EXIT_POINT:
+	if (regs != inline_regs) {
+		free(regs);
+	}
+
+	return ret;
+}
+
+#define EXPRESSION_BATCH_BLOCK (256)
+#define EXPRESSION_BATCH_MAX_BYTES (1 << 22)
+
+#define EXPRESSION_BATCH_LOOP(len, expr)				\
+	for (size_t j = 0; j < (len); j++) {				\
+		dst[j] = (expr);					\
+	}
+
+// Runs one instruction over len points, registers are rows of block points
+static void expression_insn_apply_block(const struct expression_insn *insn, int flags,
+					double *regs, size_t block, size_t len, uint8_t *failed) {
+	double *dst = regs + insn->dst * block;
+	const double *lhs = regs + insn->lhs * block;
+	const double *rhs = regs + insn->rhs * block;
+
+	switch ((enum expression_indexes)insn->opcode) {
+		case DERIVATOR_IDX_PLUS:
+			EXPRESSION_BATCH_LOOP(len, lhs[j] + rhs[j]);
+			break;
+		case DERIVATOR_IDX_MINUS:
+			EXPRESSION_BATCH_LOOP(len, lhs[j] - rhs[j]);
+			break;
+		case DERIVATOR_IDX_MULTIPLY:
+			EXPRESSION_BATCH_LOOP(len, lhs[j] * rhs[j]);
+			break;
+		case DERIVATOR_IDX_DIVIDE:
+			for (size_t j = 0; j < len; j++) {
+				failed[j] |= fabs(rhs[j]) < deps;
+			}
+			EXPRESSION_BATCH_LOOP(len, lhs[j] / rhs[j]);
+			break;
+		case DERIVATOR_IDX_POW:
+			if (flags & EXPRESSION_PROGRAM_F_FAST_MATH) {
+				expression_simd_pow(lhs, rhs, dst, len);
+				break;
+			}
+			EXPRESSION_BATCH_LOOP(len, pow(lhs[j], rhs[j]));
+			break;
+		case DERIVATOR_IDX_LN:
+			if (flags & EXPRESSION_PROGRAM_F_FAST_MATH) {
+				expression_simd_log(lhs, dst, len);
+				break;
+			}
+			EXPRESSION_BATCH_LOOP(len, log(lhs[j]));
+			break;
+		case DERIVATOR_IDX_SIN:
+			if (flags & EXPRESSION_PROGRAM_F_FAST_MATH) {
+				expression_simd_sin(lhs, dst, len);
+				break;
+			}
+			EXPRESSION_BATCH_LOOP(len, sin(lhs[j]));
+			break;
+		case DERIVATOR_IDX_COS:
+			if (flags & EXPRESSION_PROGRAM_F_FAST_MATH) {
+				expression_simd_cos(lhs, dst, len);
+				break;
+			}
+			EXPRESSION_BATCH_LOOP(len, cos(lhs[j]));
+			break;
+		case DERIVATOR_IDX_SMALL_O:
+			EXPRESSION_BATCH_LOOP(len, 0);
+			break;
+		default:
+			memset(failed, 1, len);
+			break;
+	}
+}
+
+int expression_context_ctor(struct expression_context *ctx, struct expression *expr) {
+	assert (ctx);
+	assert (expr);
+
+	*ctx = (struct expression_context){0};
+
+	if (!expr->variables.len) {
+		return S_OK;
+	}
+
+	ctx->vars = (double *)calloc(expr->variables.len, sizeof(double));
+	if (!ctx->vars) {
+		return S_FAIL;
+	}
+	ctx->vars_cnt = expr->variables.len;
+
+	for (size_t i = 0; i < ctx->vars_cnt; i++) {
+		struct expression_variable *variable = NULL;
+		if (pvector_get(&expr->variables, i, (void **)&variable)) {
+			expression_context_dtor(ctx);
+			return S_FAIL;
+		}
+
+		ctx->vars[i] = variable->value;
+	}
+
+	return S_OK;
+}
+
+int expression_context_dtor(struct expression_context *ctx) {
+	assert (ctx);
+
+	free(ctx->vars);
+	free(ctx->regs);
+	*ctx = (struct expression_context){0};
+
+	return S_OK;
+}
+
+static int expression_context_reserve(struct expression_context *ctx, size_t regs_cnt) {
+	if (regs_cnt <= ctx->regs_cnt) {
+		return S_OK;
+	}
+
+	double *regs = (double *)realloc(ctx->regs, regs_cnt * sizeof(double));
+	if (!regs) {
+		return S_FAIL;
+	}
+
+	ctx->regs = regs;
+	ctx->regs_cnt = regs_cnt;
+
+	return S_OK;
+}
+
+int expression_context_evaluate(struct expression_context *ctx,
+				const struct expression_program *program, double *fnum) {
+	assert (ctx);
+	assert (program);
+	assert (fnum);
+
+	if (!program->regs_cnt || program->vars_cnt > ctx->vars_cnt) {
+		return S_FAIL;
+	}
+
+	if (expression_context_reserve(ctx, program->regs_cnt)) {
+		return S_FAIL;
+	}
+
+	memcpy(ctx->regs, program->consts, program->consts_cnt * sizeof(double));
+	memcpy(ctx->regs + program->consts_cnt, ctx->vars, program->vars_cnt * sizeof(double));
+
+	if (expression_program_run(program, ctx->regs)) {
+		return S_FAIL;
+	}
+
+	*fnum = ctx->regs[program->result];
+
+	return S_OK;
+}
+
+int expression_context_evaluate_batch(struct expression_context *ctx,
+				      const struct expression_program *program, size_t var_idx,
+				      const double *xs, double *ys, size_t n) {
+	assert (ctx);
+	assert (program);
+	assert (xs || !n);
+	assert (ys || !n);
+
+	if (!program->regs_cnt || program->vars_cnt > ctx->vars_cnt) {
+		return S_FAIL;
+	}
+
+	size_t block = EXPRESSION_BATCH_BLOCK;
+	while (block > 1 && program->regs_cnt * block * sizeof(double) > EXPRESSION_BATCH_MAX_BYTES) {
+		block /= 2;
+	}
+
+	if (expression_context_reserve(ctx, program->regs_cnt * block)) {
+		return S_FAIL;
+	}
+
+	uint8_t failed[EXPRESSION_BATCH_BLOCK] = {0};
+	double *regs = ctx->regs;
+
+	// Constants and the other variables are the same in every block
+	for (size_t i = 0; i < program->consts_cnt; i++) {
+		for (size_t j = 0; j < block; j++) {
+			regs[i * block + j] = program->consts[i];
+		}
+	}
+
+	for (size_t i = 0; i < program->vars_cnt; i++) {
+		for (size_t j = 0; j < block; j++) {
+			regs[(program->consts_cnt + i) * block + j] = ctx->vars[i];
+		}
+	}
+
+	for (size_t start = 0; start < n; start += block) {
+		size_t len = n - start < block ? n - start : block;
+
+		if (var_idx < program->vars_cnt) {
+			memcpy(regs + (program->consts_cnt + var_idx) * block, xs + start,
+			       len * sizeof(double));
+		}
+		memset(failed, 0, len);
+
+		for (size_t i = 0; i < program->len; i++) {
+			expression_insn_apply_block(&program->code[i], program->flags, regs, block, len, failed);
+		}
+
+		for (size_t j = 0; j < len; j++) {
+			ys[start + j] = failed[j] ? NAN : regs[program->result * block + j];
+		}
+	}
+
+	return S_OK;
+}
+
+int expression_program_evaluate_batch(struct expression *expr,
+				      const struct expression_program *program, size_t var_idx,
+				      const double *xs, double *ys, size_t n) {
+	assert (expr);
+	assert (program);
+
+	struct expression_context ctx;
+	if (expression_context_ctor(&ctx, expr)) {
+		return S_FAIL;
+	}
+
+	int ret = expression_context_evaluate_batch(&ctx, program, var_idx, xs, ys, n);
+	expression_context_dtor(&ctx);
+
+	return ret;
+}
+
+int tnode_evaluate_batch(struct expression *expr, struct tree_node *node, int flags,
+			 size_t var_idx, const double *xs, double *ys, size_t n) {
+	assert (expr);
+	assert (node);
+
+	struct expression_program program;
+	expression_program_ctor(&program);
+	program.flags = flags;
+
+	if (tnode_compile(expr, node, &program)) {
+		return S_FAIL;
+	}
+
+	int ret = expression_program_evaluate_batch(expr, &program, var_idx, xs, ys, n);
+	expression_program_dtor(&program);
+
+	return ret;
+}
+
+int expression_compiled_ctor(struct expression_compiled *compiled, struct expression *expr) {
+	assert (compiled);
+	assert (expr);
+
+	*compiled = (struct expression_compiled){0};
+
+	int ret = S_OK;
+	size_t cnt = 1 + expr->derivatives.len;
+
+	compiled->programs = (struct expression_program *)calloc(cnt, sizeof(*compiled->programs));
+	if (!compiled->programs) {
+		return S_FAIL;
+	}
+	compiled->cnt = cnt;
+
+	for (size_t i = 0; i < cnt; i++) {
+		struct tree *tree = &expr->tree;
+		if (i && pvector_get(&expr->derivatives, i - 1, (void **)&tree)) {
+			_CT_FAIL();
+		}
+
+		if (!tree->root || tnode_compile(expr, tree->root, &compiled->programs[i])) {
+			_CT_FAIL();
+		}
+	}
+
+_CT_EXIT_POINT:
+	if (ret) {
+		expression_compiled_dtor(compiled);
+	}
+
+	return ret;
+}
+
+int expression_compiled_dtor(struct expression_compiled *compiled) {
+	assert (compiled);
+
+	for (size_t i = 0; i < compiled->cnt; i++) {
+		expression_program_dtor(&compiled->programs[i]);
+	}
+	free(compiled->programs);
+	*compiled = (struct expression_compiled){0};
+
+	return S_OK;
+}
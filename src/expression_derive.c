@@ -34,7 +34,7 @@ struct tree_node *expr_op_deriver_addition(struct expression *expr, struct tree_
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_PLUS), left_deriv, right_deriv);
 	left_deriv = NULL;
 	right_deriv = NULL;
@@ -67,7 +67,7 @@ struct tree_node *expr_op_deriver_subtraction(struct expression *expr, struct tr
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MINUS), left_deriv, right_deriv);
 	left_deriv = NULL;
 	right_deriv = NULL;
@@ -101,7 +101,7 @@ struct tree_node *expr_op_deriver_multiplication(struct expression *expr, struct
 		_CT_FAIL();
 	}
 
-	left_product = expr_create_operator_tnode(
+	left_product = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), u, dv_dx);
 	u = NULL;
 	dv_dx = NULL;
@@ -117,7 +117,7 @@ struct tree_node *expr_op_deriver_multiplication(struct expression *expr, struct
 		_CT_FAIL();
 	}
 
-	right_product = expr_create_operator_tnode(
+	right_product = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), v, du_dx);
 	v = NULL;
 	du_dx = NULL;
@@ -126,7 +126,7 @@ struct tree_node *expr_op_deriver_multiplication(struct expression *expr, struct
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_PLUS), left_product, right_product);
 	left_product = NULL;
 	right_product = NULL;
@@ -149,43 +149,89 @@ struct tree_node *expr_op_deriver_division(struct expression *expr, struct tree_
 	int ret = S_OK;
 
 	struct tree_node
-		*product_der = NULL,
 		*v = NULL,
+		*du_dx = NULL,
+		*v_du = NULL,
+		*u = NULL,
+		*dv_dx = NULL,
+		*u_dv = NULL,
+		*numerator = NULL,
+		*v_sq = NULL,
 		*two_node = NULL,
 		*v_squared = NULL,
 		*op_node = NULL;
 
-	product_der = expr_op_deriver_multiplication(expr, node);
-	if (!product_der) {
+	v = expr_copy_tnode(expr, node->right);
+	du_dx = tnode_derive(expr, node->left);
+
+	if (!v || !du_dx) {
 		_CT_FAIL();
 	}
 
-	product_der->value.ptr = DERIV_OP(DERIVATOR_IDX_MINUS);
+	v_du = expr_simplify_operator_tnode(expr,
+		DERIV_OP(DERIVATOR_IDX_MULTIPLY), v, du_dx);
+	v = NULL;
+	du_dx = NULL;
+
+	if (!v_du) {
+		_CT_FAIL();
+	}
 
-	v = expr_copy_tnode(expr, node->right);
+	u = expr_copy_tnode(expr, node->left);
+	dv_dx = tnode_derive(expr, node->right);
+
+	if (!u || !dv_dx) {
+		_CT_FAIL();
+	}
+
+	u_dv = expr_simplify_operator_tnode(expr,
+		DERIV_OP(DERIVATOR_IDX_MULTIPLY), u, dv_dx);
+	u = NULL;
+	dv_dx = NULL;
+
+	if (!u_dv) {
+		_CT_FAIL();
+	}
+
+	numerator = expr_simplify_operator_tnode(expr,
+		DERIV_OP(DERIVATOR_IDX_MINUS), v_du, u_dv);
+	v_du = NULL;
+	u_dv = NULL;
+
+	if (!numerator) {
+		_CT_FAIL();
+	}
+
+	v_sq = expr_copy_tnode(expr, node->right);
 	two_node = expr_create_number_tnode(2);
 
-	if (!v || !two_node) {
+	if (!v_sq || !two_node) {
 		_CT_FAIL();
 	}
 
-	v_squared = expr_create_operator_tnode(
-		DERIV_OP(DERIVATOR_IDX_POW), v, two_node);
-	v = NULL;
+	v_squared = expr_simplify_operator_tnode(expr,
+		DERIV_OP(DERIVATOR_IDX_POW), v_sq, two_node);
+	v_sq = NULL;
 	two_node = NULL;
 
 	if (!v_squared) {
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
-		DERIV_OP(DERIVATOR_IDX_DIVIDE), product_der, v_squared);
-	product_der = NULL;
+	op_node = expr_simplify_operator_tnode(expr,
+		DERIV_OP(DERIVATOR_IDX_DIVIDE), numerator, v_squared);
+	numerator = NULL;
 	v_squared = NULL;
 
 _CT_EXIT_POINT:
-	tnode_recursive_dtor(product_der, NULL);
 	tnode_recursive_dtor(v, NULL);
+	tnode_recursive_dtor(du_dx, NULL);
+	tnode_recursive_dtor(v_du, NULL);
+	tnode_recursive_dtor(u, NULL);
+	tnode_recursive_dtor(dv_dx, NULL);
+	tnode_recursive_dtor(u_dv, NULL);
+	tnode_recursive_dtor(numerator, NULL);
+	tnode_recursive_dtor(v_sq, NULL);
 	tnode_recursive_dtor(two_node, NULL);
 	tnode_recursive_dtor(v_squared, NULL);
 
@@ -223,7 +269,7 @@ struct tree_node *expr_op_deriver_power_const(
 		_CT_FAIL();
 	}
 
-	v_min_one = expr_create_operator_tnode(
+	v_min_one = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MINUS), v_pow_cpy, one_scalar);
 	v_pow_cpy = NULL;
 	one_scalar = NULL;
@@ -232,7 +278,7 @@ struct tree_node *expr_op_deriver_power_const(
 		_CT_FAIL();
 	}
 
-	u_pow_vm = expr_create_operator_tnode(
+	u_pow_vm = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_POW), u_cpy, v_min_one);
 	u_cpy = NULL;
 	v_min_one = NULL;
@@ -241,7 +287,7 @@ struct tree_node *expr_op_deriver_power_const(
 		_CT_FAIL();
 	}
 
-	v_mul_upow = expr_create_operator_tnode(
+	v_mul_upow = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), v_cpy, u_pow_vm);
 	v_cpy = NULL;
 	u_pow_vm = NULL;
@@ -255,7 +301,7 @@ struct tree_node *expr_op_deriver_power_const(
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), v_mul_upow, u_derivative);
 	v_mul_upow = NULL;
 	u_derivative = NULL;
@@ -291,7 +337,10 @@ struct tree_node *expr_op_deriver_power(struct expression *expr, struct tree_nod
 	struct tree_node *u = node->left;
 	struct tree_node *v = node->right;
 
-	if ((v->value.flags & DERIVATOR_F_CONSTANT) == DERIVATOR_F_CONSTANT) {
+	// An exponent without x is a constant for d/dx, and ln(u) may not be defined
+	if ((v->value.flags & DERIVATOR_F_CONSTANT) == DERIVATOR_F_CONSTANT ||
+	    (expr->derive_deps &&
+	     !expression_deps_find(expr->derive_deps, v, expr->differentiating_variable))) {
 		return expr_op_deriver_power_const(expr, node);
 	}
 
@@ -306,7 +355,7 @@ struct tree_node *expr_op_deriver_power(struct expression *expr, struct tree_nod
 		_CT_FAIL();
 	}
 
-	ln_u = expr_create_operator_tnode(
+	ln_u = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_LN), u_cpy, NULL);
 	u_cpy = NULL;
 
@@ -314,7 +363,7 @@ struct tree_node *expr_op_deriver_power(struct expression *expr, struct tree_nod
 		_CT_FAIL();
 	}
 
-	mul_op = expr_create_operator_tnode(
+	mul_op = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), v_cpy, ln_u);
 	v_cpy = NULL;
 	ln_u = NULL;
@@ -331,7 +380,7 @@ struct tree_node *expr_op_deriver_power(struct expression *expr, struct tree_nod
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), o_pow, mul_derivative);
 	o_pow = NULL;
 	mul_derivative = NULL;
@@ -373,7 +422,7 @@ struct tree_node *expr_op_deriver_log(struct expression *expr, struct tree_node
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_DIVIDE), du_dx, u_cpy);
 	du_dx = NULL;
 	u_cpy = NULL;
@@ -414,7 +463,7 @@ struct tree_node *expr_op_deriver_cos(struct expression *expr, struct tree_node
 		_CT_FAIL();
 	}
 
-	sin_node = expr_create_operator_tnode(
+	sin_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_SIN), u_cpy, NULL);
 	u_cpy = NULL;
 
@@ -427,7 +476,7 @@ struct tree_node *expr_op_deriver_cos(struct expression *expr, struct tree_node
 		_CT_FAIL();
 	}
 
-	min_sin = expr_create_operator_tnode(
+	min_sin = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), min_one, sin_node);
 	min_one = NULL;
 	sin_node = NULL;
@@ -436,7 +485,7 @@ struct tree_node *expr_op_deriver_cos(struct expression *expr, struct tree_node
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), min_sin, du_dx);
 	min_sin = NULL;
 	du_dx = NULL;
@@ -478,7 +527,7 @@ struct tree_node *expr_op_deriver_sin(struct expression *expr, struct tree_node
 		_CT_FAIL();
 	}
 
-	cos_node = expr_create_operator_tnode(
+	cos_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_COS), u_cpy, NULL);
 	u_cpy = NULL;
 
@@ -486,7 +535,7 @@ struct tree_node *expr_op_deriver_sin(struct expression *expr, struct tree_node
 		_CT_FAIL();
 	}
 
-	op_node = expr_create_operator_tnode(
+	op_node = expr_simplify_operator_tnode(expr,
 		DERIV_OP(DERIVATOR_IDX_MULTIPLY), cos_node, du_dx);
 	cos_node = NULL;
 	du_dx = NULL;
@@ -506,11 +555,12 @@ struct tree_node *expr_op_deriver_small_o(struct expression *expr, struct tree_n
 	return expr_copy_tnode(expr, node);
 }
 
-// dx/dx = 1
+// dx/dx = 1, dy/dx = 0
 struct tree_node *expr_op_deriver_variable(struct expression *expr, struct tree_node *node) {
-	(void)node;
+	assert (expr);
+	assert (node);
 
-	return expr_create_number_tnode(1);
+	return expr_create_number_tnode(node->value.varidx == expr->differentiating_variable ? 1 : 0);
 }
 
 // C/dx = 0
@@ -521,12 +571,253 @@ static struct tree_node *expr_op_deriver_constant(
 	return expr_create_number_tnode(0);
 }
 
+#define DERIVE_MEMO_MIN_CAPACITY (64)
+
+/*
+ * Derivatives of the subtrees seen so far, by structural hash and variable.
+ * Used only while a hash-consing arena is selected, see derive_memo_enabled().
+ * Sources are kept as private copies in the memo arena, interned nodes are
+ * immutable and kept as is. Hits hand out copies, which share interned nodes in O(1).
+ */
+struct expression_memo_entry {
+	uint32_t hash;
+	size_t var_idx;
+	struct tree_node *node;
+	struct tree_node *derivative;
+};
+
+struct expression_derive_memo {
+	struct expression_memo_entry *entries;
+	size_t len;
+	size_t capacity;
+	struct tree_arena *arena;
+};
+
+int expression_derive_memo_clear(struct expression *expr) {
+	assert (expr);
+
+	struct expression_derive_memo *memo = expr->derive_memo;
+	if (!memo) {
+		return S_OK;
+	}
+
+	tree_arena_dtor(memo->arena);
+	free(memo->entries);
+	free(memo);
+	expr->derive_memo = NULL;
+
+	return S_OK;
+}
+
+static size_t derive_memo_slot(const struct expression_derive_memo *memo,
+			       uint32_t hash, size_t var_idx) {
+	return (hash ^ var_idx * 0x9e3779b9u) & (memo->capacity - 1);
+}
+
+static int derive_memo_grow(struct expression_derive_memo *memo) {
+	size_t old_capacity = memo->capacity;
+	struct expression_memo_entry *old_entries = memo->entries;
+
+	size_t capacity = old_capacity ? old_capacity * 2 : DERIVE_MEMO_MIN_CAPACITY;
+	struct expression_memo_entry *entries = (struct expression_memo_entry *)
+		calloc(capacity, sizeof(*entries));
+	if (!entries) {
+		return S_FAIL;
+	}
+
+	memo->entries = entries;
+	memo->capacity = capacity;
+
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (!old_entries[i].node) {
+			continue;
+		}
+
+		size_t slot = derive_memo_slot(memo, old_entries[i].hash, old_entries[i].var_idx);
+		while (entries[slot].node) {
+			slot = (slot + 1) & (capacity - 1);
+		}
+		entries[slot] = old_entries[i];
+	}
+
+	free(old_entries);
+
+	return S_OK;
+}
+
+// Without hash-consing every hit would be a deep copy, slower than deriving again
+static int derive_memo_enabled(struct expression *expr) {
+	struct tree_arena *arena = tree_arena_selected();
+
+	return expr->memoize && arena &&
+	       (tree_arena_get_flags(arena) & TREE_ARENA_F_HASHCONS) == TREE_ARENA_F_HASHCONS;
+}
+
+// Returns the node itself if it is interned, otherwise a copy in the memo arena
+static struct tree_node *derive_memo_keep(struct expression *expr,
+					  struct expression_derive_memo *memo,
+					  struct tree_node *node) {
+	if (tnode_is_interned(node)) {
+		return node;
+	}
+
+	struct tree_arena *prev_arena = tree_arena_select(memo->arena);
+	struct tree_node *copy = expr_copy_tnode(expr, node);
+	tree_arena_select(prev_arena);
+
+	return copy;
+}
+
+// The node must be hashed, NULL if there is no entry
+static struct tree_node *derive_memo_find(struct expression *expr, struct tree_node *node) {
+	struct expression_derive_memo *memo = expr->derive_memo;
+	if (!memo || !memo->len) {
+		return NULL;
+	}
+
+	size_t var_idx = expr->differentiating_variable;
+	size_t slot = derive_memo_slot(memo, node->value.hash, var_idx);
+
+	for (; memo->entries[slot].node; slot = (slot + 1) & (memo->capacity - 1)) {
+		struct expression_memo_entry *entry = &memo->entries[slot];
+
+		if (entry->hash == node->value.hash && entry->var_idx == var_idx &&
+		    expr_tnode_equal(entry->node, node) == 1) {
+			return entry->derivative;
+		}
+	}
+
+	return NULL;
+}
+
+static int derive_memo_insert(struct expression *expr, struct tree_node *node,
+			      struct tree_node *derivative) {
+	struct expression_derive_memo *memo = expr->derive_memo;
+
+	if (!memo) {
+		memo = (struct expression_derive_memo *)calloc(1, sizeof(*memo));
+		if (!memo) {
+			return S_FAIL;
+		}
+
+		if (tree_arena_ctor(&memo->arena)) {
+			free(memo);
+			return S_FAIL;
+		}
+		expr->derive_memo = memo;
+	}
+
+	if (2 * (memo->len + 1) > memo->capacity && derive_memo_grow(memo)) {
+		return S_FAIL;
+	}
+
+	// Later orders look the derivative up by its own hash
+	if (tnode_hash(derivative, expression_value_hash)) {
+		return S_FAIL;
+	}
+
+	struct expression_memo_entry entry = {
+		.hash = node->value.hash,
+		.var_idx = expr->differentiating_variable,
+		.node = derive_memo_keep(expr, memo, node),
+		.derivative = derive_memo_keep(expr, memo, derivative),
+	};
+
+	if (!entry.node || !entry.derivative) {
+		return S_FAIL;
+	}
+
+	size_t slot = derive_memo_slot(memo, entry.hash, entry.var_idx);
+	while (memo->entries[slot].node) {
+		slot = (slot + 1) & (memo->capacity - 1);
+	}
+	memo->entries[slot] = entry;
+	memo->len++;
+
+	return S_OK;
+}
+
+#define DERIVE_TASKS_MIN_TREE (1 << 14)
+#define DERIVE_TASKS_PER_THREAD (8)
+#define DERIVE_TASK_MIN_NODES (64)
+
+/*
+ * Subtrees of a large tree are derived on expr->pool first, each into an arena
+ * of its own. tnode_derive() then takes their derivatives by node while it
+ * derives the rest, so the result is the same as the one of a single thread.
+ */
+struct expression_derive_task {
+	struct tree_node *node;
+	struct tree_node *derivative;
+	struct tree_arena *arena;
+};
+
+struct expression_derive_tasks {
+	struct expression_derive_task *tasks;
+	size_t len;
+	size_t capacity;
+	struct expression *expr;
+	int failed;
+};
+
+static int derive_task_cmp(const void *a, const void *b) {
+	uintptr_t lhs = (uintptr_t)((const struct expression_derive_task *)a)->node;
+	uintptr_t rhs = (uintptr_t)((const struct expression_derive_task *)b)->node;
+
+	return (lhs > rhs) - (lhs < rhs);
+}
+
+// Each derivative is handed out once, a second visit derives the node again
+static struct tree_node *derive_tasks_take(struct expression *expr, struct tree_node *node) {
+	struct expression_derive_tasks *split = expr->derive_tasks;
+	if (!split) {
+		return NULL;
+	}
+
+	struct expression_derive_task key = { .node = node };
+	struct expression_derive_task *task = (struct expression_derive_task *)
+		bsearch(&key, split->tasks, split->len, sizeof(key), derive_task_cmp);
+	if (!task) {
+		return NULL;
+	}
+
+	struct tree_node *derivative = task->derivative;
+	task->derivative = NULL;
+
+	return derivative;
+}
+
 static struct tree_node *tnode_derive(struct expression *expr, struct tree_node *node) {
 	assert (node);
 
-	struct tree_node *derivative_node = NULL;	
+	// Derived on the pool already, see tnode_derive_tasks()
+	struct tree_node *derivative_node = derive_tasks_take(expr, node);
+	if (derivative_node) {
+		return derivative_node;
+	}
+
+	// Subtrees without the variable are not walked at all, see expression_jacobian_ctor()
+	if (expr->derive_deps &&
+	    !expression_deps_find(expr->derive_deps, node, expr->differentiating_variable)) {
+		return expr_create_number_tnode(0);
+	}
 
-	if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_NUMBER) {
+	struct tree_node *memoized = NULL;
+
+	// Leaves are cheaper to derive than to look up
+	int memoize = (node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_OPERATOR &&
+		derive_memo_enabled(expr);
+
+	if (memoize) {
+		if (tnode_hash(node, expression_value_hash)) {
+			return NULL;
+		}
+		memoized = derive_memo_find(expr, node);
+	}
+
+	if (memoized) {
+		derivative_node = expr_copy_tnode(expr, memoized);
+	} else if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_NUMBER) {
 		derivative_node = expr_op_deriver_constant(expr, node);
 	} else if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE) {
 		derivative_node = expr_op_deriver_variable(expr, node);
@@ -537,24 +828,212 @@ static struct tree_node *tnode_derive(struct expression *expr, struct tree_node
 		derivative_node = op->deriver(expr, node);
 	}
 
-	if (derivative_node) {
-		struct tree_node *nnode = tnode_simplify(expr, derivative_node);
+	// Derivers build through expr_simplify_operator_tnode(), the result is simplified already
+	if (derivative_node && !memoized && memoize &&
+	    derive_memo_insert(expr, node, derivative_node)) {
 		tnode_recursive_dtor(derivative_node, NULL);
-		derivative_node = nnode;
+		derivative_node = NULL;
 	}
 
-	if (derivative_node && expr->latex_file) {
-		fprintf(expr->latex_file, "\\begin{equation}\n");
-		fprintf(expr->latex_file, "\\frac{d}{dx}(");
-		tnode_to_latex(expr, node, expr->latex_file);
-		fprintf(expr->latex_file, ") = ");
-		tnode_to_latex(expr, derivative_node, expr->latex_file);
-		fprintf(expr->latex_file, "\\end{equation}\n\n");
+	// Rendered after the whole derivative, see expression_trace_render()
+	if (derivative_node && expr->latex_file &&
+	    expression_trace_record(expr, node, derivative_node)) {
+		tnode_recursive_dtor(derivative_node, NULL);
+		derivative_node = NULL;
 	}
 
 	return derivative_node;
 }
 
+static int tnode_size(struct tree_node *node, size_t *size) {
+	struct tree_walker walker;
+
+	if (tree_walker_ctor(&walker, node, TREE_WALK_F_POST)) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	enum tree_walk_event event = TREE_WALK_END;
+
+	*size = 0;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+		(*size)++;
+	}
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+static void derive_tasks_push(struct expression_derive_tasks *split, struct tree_node *node) {
+	if (split->len == split->capacity) {
+		size_t capacity = split->capacity ? split->capacity * 2 : DERIVE_TASKS_PER_THREAD;
+		struct expression_derive_task *tasks = (struct expression_derive_task *)
+			realloc(split->tasks, capacity * sizeof(*tasks));
+		if (!tasks) {
+			split->failed = 1;
+			return;
+		}
+
+		split->tasks = tasks;
+		split->capacity = capacity;
+	}
+
+	split->tasks[split->len++] = (struct expression_derive_task){ .node = node };
+}
+
+// Children of the subtrees above cutoff are tasks unless they are too small to pay off
+static void derive_tasks_collect(struct expression_derive_tasks *split,
+				 struct tree_node *node, size_t cutoff) {
+	struct tree_walker walker;
+
+	if (tree_walker_ctor(&walker, node, TREE_WALK_F_POST)) {
+		split->failed = 1;
+		return;
+	}
+
+	// Subtree sizes are on the value stack
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			split->failed = 1;
+			break;
+		}
+
+		size_t left = 0, right = 0;
+
+		if (node->right) {
+			right = tree_walker_pop(&walker).varidx;
+		}
+		if (node->left) {
+			left = tree_walker_pop(&walker).varidx;
+		}
+
+		if (left + right + 1 > cutoff) {
+			if (left <= cutoff && left >= DERIVE_TASK_MIN_NODES) {
+				derive_tasks_push(split, node->left);
+			}
+			if (right <= cutoff && right >= DERIVE_TASK_MIN_NODES) {
+				derive_tasks_push(split, node->right);
+			}
+		}
+
+		if (tree_walker_push(&walker, (tree_dtype){ .varidx = left + right + 1 })) {
+			split->failed = 1;
+			break;
+		}
+	}
+
+	tree_walker_dtor(&walker);
+}
+
+static int derive_task_run(void *arg, size_t idx) {
+	struct expression_derive_tasks *split = (struct expression_derive_tasks *)arg;
+	struct expression_derive_task *task = &split->tasks[idx];
+
+	struct tree_arena *prev_arena = tree_arena_select(task->arena);
+	task->derivative = tnode_derive(split->expr, task->node);
+	tree_arena_select(prev_arena);
+
+	return task->derivative ? S_OK : S_FAIL;
+}
+
+/*
+ * tnode_derive() into the selected arena, which is passed as well.
+ * Memoized, hash-consed and LaTeX derivations share state across subtrees,
+ * so they stay on the calling thread.
+ */
+static struct tree_node *tnode_derive_tasks(struct expression *expr, struct tree_node *node,
+					    struct tree_arena *arena) {
+	assert (expr);
+	assert (node);
+	assert (arena);
+
+	if (!expr->pool || expr->pool->threads_cnt <= 1 ||
+	    expr->hashcons || expr->memoize || expr->latex_file) {
+		return tnode_derive(expr, node);
+	}
+
+	size_t size = 0;
+	if (tnode_size(node, &size)) {
+		return NULL;
+	}
+
+	if (size < DERIVE_TASKS_MIN_TREE) {
+		return tnode_derive(expr, node);
+	}
+
+	int ret = S_OK;
+	struct tree_node *derivative = NULL;
+	size_t cutoff = size / (expr->pool->threads_cnt * DERIVE_TASKS_PER_THREAD);
+	struct expression_derive_tasks split = { .expr = expr };
+
+	derive_tasks_collect(&split, node, cutoff);
+	if (split.failed) {
+		_CT_FAIL();
+	}
+
+	qsort(split.tasks, split.len, sizeof(*split.tasks), derive_task_cmp);
+
+	for (size_t i = 0; i < split.len; i++) {
+		if (tree_arena_ctor(&split.tasks[i].arena) ||
+		    tree_arena_set_flags(split.tasks[i].arena, tree_arena_get_flags(arena))) {
+			_CT_FAIL();
+		}
+	}
+
+	if (expression_pool_run_tasks(expr->pool, split.len, derive_task_run, &split)) {
+		_CT_FAIL();
+	}
+
+	for (size_t i = 0; i < split.len; i++) {
+		if (tree_arena_merge(arena, split.tasks[i].arena)) {
+			_CT_FAIL();
+		}
+	}
+
+	expr->derive_tasks = &split;
+	derivative = tnode_derive(expr, node);
+	expr->derive_tasks = NULL;
+
+	// Derivatives the rest did not reach, the nodes are in the arena already
+	for (size_t i = 0; i < split.len; i++) {
+		tnode_recursive_dtor(split.tasks[i].derivative, NULL);
+		split.tasks[i].derivative = NULL;
+	}
+
+_CT_EXIT_POINT:
+	for (size_t i = 0; i < split.len; i++) {
+		tree_arena_dtor(split.tasks[i].arena);
+	}
+	free(split.tasks);
+
+	return ret ? NULL : derivative;
+}
+
+struct tree_node *expression_derive_tnode(struct expression *expr, struct tree_node *node,
+					  size_t var_idx) {
+	assert (expr);
+	assert (node);
+
+	size_t differentiating_variable = expr->differentiating_variable;
+	FILE *latex_file = expr->latex_file;
+
+	expr->differentiating_variable = var_idx;
+	expr->latex_file = NULL;
+
+	struct tree_node *derivative = tnode_derive(expr, node);
+
+	expr->differentiating_variable = differentiating_variable;
+	expr->latex_file = latex_file;
+
+	return derivative;
+}
+
 /*
 int expression_derive(struct expression *expr, struct expression *derivative) {
 	assert (expr);
@@ -634,21 +1113,73 @@ int expression_derive_nth(struct expression *expr, int nth) {
 		}
 	}
 
+	// Copies of hashed nodes keep their hashes
+	if (expr->merkle && expression_hash(expr)) {
+		return S_FAIL;
+	}
+
 	for (int i = counted_derivatives + 1; i <= nth; i++) {
 		if (expr->latex_file) {
 			fprintf(expr->latex_file,
 				"\\subsection{Find the %dth derivative}\n\n", i);
 		}
 
-		struct tree_node *cur_derivative = tnode_derive(expr, latest_derivative);
+		struct tree derivative_tree = {0};
+		if (tree_ctor(&derivative_tree)) {
+			return S_FAIL;
+		}
 
-		if (!cur_derivative) {
+		if (expr->hashcons) {
+			if (!expr->dag_arena) {
+				if (tree_arena_ctor(&expr->dag_arena)) {
+					return S_FAIL;
+				}
+
+				if (tree_arena_set_flags(expr->dag_arena,
+							 TREE_ARENA_F_HASHCONS)) {
+					return S_FAIL;
+				}
+			}
+
+			derivative_tree.arena = tree_arena_ref(expr->dag_arena);
+		} else if (tree_arena_ctor(&derivative_tree.arena)) {
 			return S_FAIL;
 		}
 
-		struct tree derivative_tree = {0};
-		if (tree_ctor(&derivative_tree)) {
+		if (expr->merkle) {
+			int flags = tree_arena_get_flags(derivative_tree.arena);
+			if (tree_arena_set_flags(derivative_tree.arena, flags | TREE_ARENA_F_MERKLE)) {
+				tree_dtor(&derivative_tree);
+				return S_FAIL;
+			}
+		}
+
+		struct tree_arena *prev_arena = tree_arena_select(derivative_tree.arena);
+		struct tree_node *source = latest_derivative;
+
+		// Derivatives are simplified as they are built, only the source may not be
+		if (latest_derivative == expr->tree.root) {
+			source = tnode_simplify(expr, latest_derivative);
+		}
+
+		struct tree_node *cur_derivative = source ?
+			tnode_derive_tasks(expr, source, derivative_tree.arena) : NULL;
+
+		// The steps point into the source, they are rendered before it is dropped
+		if (cur_derivative && expr->latex_file &&
+		    expression_trace_render(expr, source, cur_derivative, expr->latex_file)) {
 			tnode_recursive_dtor(cur_derivative, NULL);
+			cur_derivative = NULL;
+		}
+
+		if (source != latest_derivative) {
+			tnode_recursive_dtor(source, NULL);
+		}
+		tree_arena_select(prev_arena);
+
+		if (!cur_derivative) {
+			expression_trace_clear(expr);
+			tree_dtor(&derivative_tree);
 			return S_FAIL;
 		}
 		derivative_tree.root = cur_derivative;
@@ -669,16 +1200,6 @@ int expression_derive_nth(struct expression *expr, int nth) {
 	return S_OK;
 }
 
-double factorial(int nth) {
-	double fact = 1;
-
-	for (int i = 1; i <= nth; i++) {
-		fact *= i;
-	}
-
-	return fact;
-}
-
 int expression_taylor_series_nth(struct expression *expr,
 				 struct expression *series, int nth) {
 	assert (expr);
@@ -705,20 +1226,25 @@ int expression_taylor_series_nth(struct expression *expr,
 		*x_minus_x0_node = NULL,
 		*simplified_root = NULL;
 	double tailor0 = 0;
+	double *coeffs = NULL;
 
 	if (nth < 0) {
 		log_error("No integration yet!");
 		_CT_FAIL();
 	}
 
-	if (expression_derive_nth(expr, nth)) {
+	// Coefficients come from one Taylor-mode pass, no symbolic derivatives needed
+	coeffs = (double *)calloc((size_t)nth + 1, sizeof(double));
+	if (!coeffs) {
 		_CT_FAIL();
 	}
 
-	if (expression_evaluate(expr, &tailor0)) {
+	if (tnode_evaluate_series(expr, expr->tree.root, expr->differentiating_variable,
+				  (size_t)nth, coeffs)) {
 		log_error("0Th expr evaluate");
 		_CT_FAIL();
 	}
+	tailor0 = coeffs[0];
 
 	ox_node = expr_create_variable_tnode(expr->differentiating_variable);
 	ox_power = expr_create_number_tnode(nth);
@@ -769,20 +1295,7 @@ int expression_taylor_series_nth(struct expression *expr,
 	}
 
 	for (int i = 1; i <= nth; i++) {
-		struct tree *derivative_tree = NULL;
-		if (pvector_get(&expr->derivatives, (size_t) (i - 1),
-					(void **)&derivative_tree)) {
-			_CT_FAIL();
-		};
-
-		double fnum = 0;
-		if (tnode_evaluate(expr, derivative_tree->root, &fnum)) {
-			_CT_FAIL();
-		}
-
-		fnum /= factorial(i);
-
-		nth_tailor = expr_create_number_tnode(fnum);
+		nth_tailor = expr_create_number_tnode(coeffs[i]);
 		x_node = expr_create_variable_tnode(expr->differentiating_variable);
 		x0_node = expr_create_number_tnode(diff_variable->value);
 		x_power = expr_create_number_tnode(i);
@@ -834,6 +1347,7 @@ int expression_taylor_series_nth(struct expression *expr,
 		nth_tailor_sym = NULL;
 
 		tailor_root->left = new_tailor_op;
+		tailor_root->value.hash = 0;
 		last_tailor_node = new_tailor_op;
 
 		new_tailor_op = NULL;
@@ -860,6 +1374,7 @@ int expression_taylor_series_nth(struct expression *expr,
 	tailor_root = NULL;
 
 _CT_EXIT_POINT:
+	free(coeffs);
 	tnode_recursive_dtor(ox_node, NULL);
 	tnode_recursive_dtor(ox_power, NULL);
 	tnode_recursive_dtor(ox_powered_node, NULL);
@@ -9,42 +9,36 @@ static const double deps = 1e-9;
 
 #define EXPR_BINARY_OP(expr_name, ...)							\
 	int expr_op_evaluator_##expr_name(struct expression *expr,			\
-					struct tree_node *node, double *fnum) {		\
+					const double *args, size_t nargs,		\
+					double *fnum) {					\
 		assert (expr);								\
-		assert (node);								\
+		assert (args);								\
 		assert (fnum);								\
 											\
-		if (!node->left || !node->right) {					\
+		if (nargs < 2) {							\
 			return S_FAIL;							\
 		}									\
 											\
-		double lnum = 0;							\
-		double rnum = 0;							\
-											\
-		if (	tnode_evaluate(expr, node->left, &lnum) ||			\
-			tnode_evaluate(expr, node->right, &rnum)) {			\
-			return S_FAIL;							\
-		}									\
+		double lnum = args[0];							\
+		double rnum = args[1];							\
 		__VA_ARGS__								\
 		return S_OK;								\
 	}										\
 
 #define EXPR_UNARY_OP(expr_name, ...)							\
 	int expr_op_evaluator_##expr_name(struct expression *expr,			\
-					struct tree_node *node, double *fnum) {		\
+					const double *args, size_t nargs,		\
+					double *fnum) {					\
 		assert (expr);								\
-		assert (node);								\
+		assert (args);								\
 		assert (fnum);								\
 											\
-		if (!node->left) {							\
+		if (nargs < 1) {							\
 			return S_FAIL;							\
 		}									\
 											\
-		double src_num = 0;							\
-											\
-		if (	tnode_evaluate(expr, node->left, &src_num)) {			\
-			return S_FAIL;							\
-		}									\
+		double src_num = args[0];						\
+		(void)src_num;								\
 		__VA_ARGS__								\
 		return S_OK;								\
 	}										\
@@ -89,28 +83,119 @@ EXPR_UNARY_OP(small_o,
 	*fnum = 0;
 )
 
+#define EXPR_BINARY_PARTIALS(expr_name, ...)						\
+	int expr_op_partials_##expr_name(struct expression *expr,			\
+					const double *args, size_t nargs,		\
+					double fnum, double *dargs) {			\
+		assert (expr);								\
+		assert (args);								\
+		assert (dargs);								\
+											\
+		if (nargs < 2) {							\
+			return S_FAIL;							\
+		}									\
+											\
+		double lnum = args[0];							\
+		double rnum = args[1];							\
+		(void)lnum; (void)rnum; (void)fnum;					\
+		__VA_ARGS__								\
+		return S_OK;								\
+	}										\
+
+#define EXPR_UNARY_PARTIALS(expr_name, ...)						\
+	int expr_op_partials_##expr_name(struct expression *expr,			\
+					const double *args, size_t nargs,		\
+					double fnum, double *dargs) {			\
+		assert (expr);								\
+		assert (args);								\
+		assert (dargs);								\
+											\
+		if (nargs < 1) {							\
+			return S_FAIL;							\
+		}									\
+											\
+		double src_num = args[0];						\
+		(void)src_num; (void)fnum;						\
+		__VA_ARGS__								\
+		return S_OK;								\
+	}										\
+
+EXPR_BINARY_PARTIALS(addition,
+	dargs[0] = 1;
+	dargs[1] = 1;
+)
+
+EXPR_BINARY_PARTIALS(subtraction,
+	dargs[0] = 1;
+	dargs[1] = -1;
+)
+
+EXPR_BINARY_PARTIALS(multiplication,
+	dargs[0] = rnum;
+	dargs[1] = lnum;
+)
+
+EXPR_BINARY_PARTIALS(division,
+	if (fabs(rnum) < deps) {
+	       return S_FAIL;
+	}
+
+	dargs[0] = 1 / rnum;
+	dargs[1] = -fnum / rnum;
+)
+
+// The exponent partial is NaN for a non-positive base, it only matters for a varying exponent
+EXPR_BINARY_PARTIALS(power,
+	dargs[0] = rnum * pow(lnum, rnum - 1);
+	dargs[1] = fnum * log(lnum);
+)
+
+EXPR_UNARY_PARTIALS(log,
+	dargs[0] = 1 / src_num;
+)
+
+EXPR_UNARY_PARTIALS(sin,
+	dargs[0] = cos(src_num);
+)
+
+EXPR_UNARY_PARTIALS(cos,
+	dargs[0] = -sin(src_num);
+)
+
+EXPR_UNARY_PARTIALS(small_o,
+	dargs[0] = 0;
+)
+
 int expr_op_evaluator_variable(struct expression *expr,
-				   struct tree_node *node, double *fnum) {
+				   const double *args, size_t nargs, double *fnum) {
 	assert (expr);
-	assert (node);
 	assert (fnum);
 
+	// Variables are leaves, their values come from the expression, not from args
+	(void)args;
+	(void)nargs;
+
 	return S_FAIL;
 }
 
-int tnode_evaluate(struct expression *expr,
-				   struct tree_node *node, double *fnum) {
-	assert (expr);
-	assert (node);
-	assert (fnum);
+// A right child without the left one is not a valid argument list
+static size_t tnode_nargs(const struct tree_node *node) {
+	if (!node->left) {
+		return 0;
+	}
 
-	if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_NUMBER) {
-		*fnum = node->value.fnum;
+	return node->right ? 2 : 1;
+}
+
+static int tvalue_evaluate_leaf(struct expression *expr,
+				tree_dtype value, double *fnum) {
+	if ((value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_NUMBER) {
+		*fnum = value.fnum;
 		return S_OK;
 	}
 
-	if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE) {
-		size_t var_idx = node->value.varidx;
+	if ((value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE) {
+		size_t var_idx = value.varidx;
 
 		struct expression_variable *variable = NULL;
 		if (pvector_get(&expr->variables, var_idx, (void *)&variable)) {
@@ -122,13 +207,356 @@ int tnode_evaluate(struct expression *expr,
 		return S_OK;
 	}
 
-	if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_OPERATOR) {
-		const struct expression_operator *op = node->value.ptr;
-		int st = op->evaluator(expr, node, fnum);
-		return st;
+	return S_FAIL;
+}
+
+static int tnode_evaluate_walk(struct expression *expr,
+			       struct tree_node *node, double *fnum) {
+	int ret = S_OK;
+	struct tree_walker walker;
+
+	if (tree_walker_ctor(&walker, node, TREE_WALK_F_POST)) {
+		return S_FAIL;
 	}
 
-	return S_FAIL;
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+
+		tree_dtype result = {0};
+
+		if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_OPERATOR) {
+			const struct expression_operator *op = node->value.ptr;
+			double args[2] = {0};
+
+			if (node->right) {
+				args[1] = tree_walker_pop(&walker).fnum;
+			}
+			if (node->left) {
+				args[0] = tree_walker_pop(&walker).fnum;
+			}
+
+			if (op->evaluator(expr, args, tnode_nargs(node), &result.fnum)) {
+				_CT_FAIL();
+			}
+		} else if (tvalue_evaluate_leaf(expr, node->value, &result.fnum)) {
+			_CT_FAIL();
+		}
+
+		if (tree_walker_push(&walker, result)) {
+			_CT_FAIL();
+		}
+	}
+
+	*fnum = tree_walker_pop(&walker).fnum;
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+// Native recursion is cheaper for the common shallow case, deep subtrees go to the walker
+static int tnode_evaluate_depth(struct expression *expr, struct tree_node *node,
+				size_t depth, double *fnum) {
+	if (depth >= TREE_WALKER_INLINE_DEPTH) {
+		return tnode_evaluate_walk(expr, node, fnum);
+	}
+
+	if ((node->value.flags & DERIVATOR_F_OPERATOR) != DERIVATOR_F_OPERATOR) {
+		return tvalue_evaluate_leaf(expr, node->value, fnum);
+	}
+
+	const struct expression_operator *op = node->value.ptr;
+	double args[2] = {0};
+
+	if (node->left && tnode_evaluate_depth(expr, node->left, depth + 1, &args[0])) {
+		return S_FAIL;
+	}
+	if (node->right && tnode_evaluate_depth(expr, node->right, depth + 1, &args[1])) {
+		return S_FAIL;
+	}
+
+	return op->evaluator(expr, args, tnode_nargs(node), fnum);
+}
+
+int tnode_evaluate(struct expression *expr,
+				   struct tree_node *node, double *fnum) {
+	assert (expr);
+	assert (node);
+	assert (fnum);
+
+	return tnode_evaluate_depth(expr, node, 0, fnum);
+}
+
+/*
+ * Chain rule over the operator partials. A child with zero tangent adds
+ * nothing even if its partial is not finite, as the exponent of x^2 at x = 0.
+ */
+static int tnode_dual_apply(struct expression *expr, const struct expression_operator *op,
+			    const struct expression_dual *args, size_t nargs,
+			    struct expression_dual *result) {
+	double values[2] = { args[0].value, args[1].value };
+	double partials[2] = {0};
+
+	if (op->evaluator(expr, values, nargs, &result->value) ||
+	    op->partials(expr, values, nargs, result->value, partials)) {
+		return S_FAIL;
+	}
+
+	result->deriv = 0;
+	for (size_t i = 0; i < nargs; i++) {
+		if (fpclassify(args[i].deriv) != FP_ZERO) {
+			result->deriv += partials[i] * args[i].deriv;
+		}
+	}
+
+	return S_OK;
+}
+
+static int tvalue_dual_leaf(struct expression *expr, tree_dtype value, size_t var_idx,
+			    struct expression_dual *dual) {
+	dual->deriv = (value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE &&
+		      value.varidx == var_idx;
+
+	return tvalue_evaluate_leaf(expr, value, &dual->value);
+}
+
+// The walker stack holds the value and then the derivative of every pending child
+static int tnode_evaluate_dual_walk(struct expression *expr, struct tree_node *node,
+				    size_t var_idx, struct expression_dual *dual) {
+	int ret = S_OK;
+	struct tree_walker walker;
+
+	if (tree_walker_ctor(&walker, node, TREE_WALK_F_POST)) {
+		return S_FAIL;
+	}
+
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+
+		struct expression_dual result = {0};
+
+		if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_OPERATOR) {
+			struct expression_dual args[2] = {0};
+
+			if (node->right) {
+				args[1].deriv = tree_walker_pop(&walker).fnum;
+				args[1].value = tree_walker_pop(&walker).fnum;
+			}
+			if (node->left) {
+				args[0].deriv = tree_walker_pop(&walker).fnum;
+				args[0].value = tree_walker_pop(&walker).fnum;
+			}
+
+			if (tnode_dual_apply(expr, node->value.ptr, args, tnode_nargs(node), &result)) {
+				_CT_FAIL();
+			}
+		} else if (tvalue_dual_leaf(expr, node->value, var_idx, &result)) {
+			_CT_FAIL();
+		}
+
+		if (tree_walker_push(&walker, (tree_dtype){ .fnum = result.value }) ||
+		    tree_walker_push(&walker, (tree_dtype){ .fnum = result.deriv })) {
+			_CT_FAIL();
+		}
+	}
+
+	dual->deriv = tree_walker_pop(&walker).fnum;
+	dual->value = tree_walker_pop(&walker).fnum;
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+static int tnode_evaluate_dual_depth(struct expression *expr, struct tree_node *node,
+				     size_t var_idx, size_t depth, struct expression_dual *dual) {
+	if (depth >= TREE_WALKER_INLINE_DEPTH) {
+		return tnode_evaluate_dual_walk(expr, node, var_idx, dual);
+	}
+
+	if ((node->value.flags & DERIVATOR_F_OPERATOR) != DERIVATOR_F_OPERATOR) {
+		return tvalue_dual_leaf(expr, node->value, var_idx, dual);
+	}
+
+	struct expression_dual args[2] = {0};
+
+	if (node->left && tnode_evaluate_dual_depth(expr, node->left, var_idx, depth + 1, &args[0])) {
+		return S_FAIL;
+	}
+	if (node->right && tnode_evaluate_dual_depth(expr, node->right, var_idx, depth + 1, &args[1])) {
+		return S_FAIL;
+	}
+
+	return tnode_dual_apply(expr, node->value.ptr, args, tnode_nargs(node), dual);
+}
+
+int tnode_evaluate_dual(struct expression *expr, struct tree_node *node,
+			size_t var_idx, struct expression_dual *dual) {
+	assert (expr);
+	assert (node);
+	assert (dual);
+
+	return tnode_evaluate_dual_depth(expr, node, var_idx, 0, dual);
+}
+
+#define EVALUATE_INLINE_VALUES (256)
+
+/*
+ * Operators are symbol indices when symbols are given, as in mapped files.
+ * Children have to precede parents, the nodes may come from a file.
+ */
+static int tcnodes_evaluate(struct expression *expr, const struct tree_cnode *nodes, size_t len,
+			    const void **symbols, size_t symbols_cnt, double *fnum) {
+	if (!len) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	double inline_values[EVALUATE_INLINE_VALUES];
+	double *values = inline_values;
+
+	if (len > EVALUATE_INLINE_VALUES) {
+		values = (double *)calloc(len, sizeof(double));
+		if (!values) {
+			return S_FAIL;
+		}
+	}
+
+	for (size_t i = 0; i < len; i++) {
+		const struct tree_cnode *cnode = &nodes[i];
+
+		if ((tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) != DERIVATOR_F_OPERATOR) {
+			tree_dtype value = { .flags = tree_cnode_flags(cnode), .varidx = cnode->varidx };
+
+			if (tvalue_evaluate_leaf(expr, value, &values[i])) {
+				_CT_FAIL();
+			}
+			continue;
+		}
+
+		const struct expression_operator *op = cnode->ptr;
+		if (symbols) {
+			if (cnode->varidx >= symbols_cnt) {
+				_CT_FAIL();
+			}
+			op = (const struct expression_operator *)symbols[cnode->varidx];
+		}
+
+		uint32_t left = tree_cnode_left(cnode), right = tree_cnode_right(cnode);
+		double args[2] = {0};
+		size_t nargs = 0;
+
+		if ((left != TREE_CNODE_NIL && left >= i) || (right != TREE_CNODE_NIL && right >= i)) {
+			_CT_FAIL();
+		}
+
+		if (left != TREE_CNODE_NIL) {
+			args[nargs++] = values[left];
+
+			if (right != TREE_CNODE_NIL) {
+				args[nargs++] = values[right];
+			}
+		}
+
+		if (op->evaluator(expr, args, nargs, &values[i])) {
+			_CT_FAIL();
+		}
+	}
+
+	*fnum = values[len - 1];
+
+_CT_EXIT_POINT:
+	if (values != inline_values) {
+		free(values);
+	}
+
+	return ret;
+}
+
+int tcompact_evaluate(struct expression *expr,
+		      const struct tree_compact *compact, double *fnum) {
+	assert (expr);
+	assert (compact);
+	assert (fnum);
+
+	return tcnodes_evaluate(expr, compact->nodes, compact->len, NULL, 0, fnum);
+}
+
+int tmapped_evaluate(struct expression *expr,
+		     const struct tree_mapped *mapped, double *fnum) {
+	assert (expr);
+	assert (mapped);
+	assert (fnum);
+
+	return tcnodes_evaluate(expr, mapped->nodes, mapped->len,
+				mapped->symbols, mapped->symbols_cnt, fnum);
+}
+
+int tfrozen_evaluate(struct expression *expr,
+		     const struct tree_frozen *frozen, double *fnum) {
+	assert (expr);
+	assert (frozen);
+	assert (fnum);
+
+	if (!frozen->len) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	double inline_values[EVALUATE_INLINE_VALUES];
+	double *values = inline_values;
+	size_t values_len = 0;
+
+	if (frozen->stack_depth > EVALUATE_INLINE_VALUES) {
+		values = (double *)calloc(frozen->stack_depth, sizeof(double));
+		if (!values) {
+			return S_FAIL;
+		}
+	}
+
+	for (size_t i = 0; i < frozen->len; i++) {
+		const struct tree_fnode *fnode = &frozen->nodes[i];
+
+		if ((fnode->flags & DERIVATOR_F_OPERATOR) != DERIVATOR_F_OPERATOR) {
+			if (tvalue_evaluate_leaf(expr, tree_fnode_value(fnode), &values[values_len++])) {
+				_CT_FAIL();
+			}
+			continue;
+		}
+
+		const struct expression_operator *op = fnode->ptr;
+		double args[2] = {0};
+		size_t nargs = 0;
+
+		if (fnode->children & TREE_FNODE_RIGHT) {
+			args[1] = values[--values_len];
+		}
+		if (fnode->children & TREE_FNODE_LEFT) {
+			args[0] = values[--values_len];
+			nargs = (fnode->children & TREE_FNODE_RIGHT) ? 2 : 1;
+		}
+
+		if (op->evaluator(expr, args, nargs, &values[values_len++])) {
+			_CT_FAIL();
+		}
+	}
+
+	*fnum = values[0];
+
+_CT_EXIT_POINT:
+	if (values != inline_values) {
+		free(values);
+	}
+
+	return ret;
 }
 
 int expression_evaluate(struct expression *expr, double *fnum) {
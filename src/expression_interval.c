@@ -0,0 +1,359 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "tree.h"
+#include "expression.h"
+
+static const double deps = 1e-9;
+
+#define INTERVAL_INLINE_VALUES (64)
+
+/*
+ * Bounds are rounded outwards by one ulp after every operation, which covers
+ * both the rounding of + - * / and the error of libm sin, cos, log and pow.
+ * Points where the operator is undefined or NaN are left out of the bounds
+ * and only raise EXPRESSION_INTERVAL_F_PARTIAL.
+ */
+
+#define EXPR_BINARY_INTERVAL(expr_name, ...)						\
+	int expr_op_interval_##expr_name(struct expression *expr,			\
+					 const struct expression_interval *args,	\
+					 size_t nargs,					\
+					 struct expression_interval *res) {		\
+		assert (expr);								\
+		assert (args);								\
+		assert (res);								\
+											\
+		if (nargs < 2) {							\
+			return S_FAIL;							\
+		}									\
+											\
+		struct expression_interval a = args[0];					\
+		struct expression_interval b = args[1];					\
+		*res = (struct expression_interval){					\
+			.flags = (a.flags | b.flags) & EXPRESSION_INTERVAL_F_PARTIAL,	\
+		};									\
+		if ((a.flags | b.flags) & EXPRESSION_INTERVAL_F_EMPTY) {		\
+			res->flags |= EXPRESSION_INTERVAL_F_EMPTY;			\
+			return S_OK;							\
+		}									\
+		__VA_ARGS__								\
+		interval_round_out(res);						\
+		return S_OK;								\
+	}										\
+
+#define EXPR_UNARY_INTERVAL(expr_name, ...)						\
+	int expr_op_interval_##expr_name(struct expression *expr,			\
+					 const struct expression_interval *args,	\
+					 size_t nargs,					\
+					 struct expression_interval *res) {		\
+		assert (expr);								\
+		assert (args);								\
+		assert (res);								\
+											\
+		if (nargs < 1) {							\
+			return S_FAIL;							\
+		}									\
+											\
+		struct expression_interval a = args[0];					\
+		*res = (struct expression_interval){					\
+			.flags = a.flags & EXPRESSION_INTERVAL_F_PARTIAL,		\
+		};									\
+		if (a.flags & EXPRESSION_INTERVAL_F_EMPTY) {				\
+			res->flags |= EXPRESSION_INTERVAL_F_EMPTY;			\
+			return S_OK;							\
+		}									\
+		__VA_ARGS__								\
+		interval_round_out(res);						\
+		return S_OK;								\
+	}										\
+
+// NaN bounds come from inf - inf and the like, they only happen at infinite points
+static void interval_round_out(struct expression_interval *res) {
+	if (res->flags & EXPRESSION_INTERVAL_F_EMPTY) {
+		return;
+	}
+
+	if (isnan(res->lo) || isnan(res->hi)) {
+		res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+		res->lo = isnan(res->lo) ? -INFINITY : res->lo;
+		res->hi = isnan(res->hi) ? INFINITY : res->hi;
+	}
+
+	res->lo = nextafter(res->lo, -INFINITY);
+	res->hi = nextafter(res->hi, INFINITY);
+}
+
+// Hull of the values at the corners, a NaN corner makes the bounds unknown
+static void interval_corners(double v0, double v1, double v2, double v3,
+			     struct expression_interval *res) {
+	if (isnan(v0) || isnan(v1) || isnan(v2) || isnan(v3)) {
+		res->lo = -INFINITY;
+		res->hi = INFINITY;
+		res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+		return;
+	}
+
+	res->lo = fmin(fmin(v0, v1), fmin(v2, v3));
+	res->hi = fmax(fmax(v0, v1), fmax(v2, v3));
+}
+
+static void interval_divide(struct expression_interval a, double lo, double hi,
+			    struct expression_interval *res) {
+	interval_corners(a.lo / lo, a.lo / hi, a.hi / lo, a.hi / hi, res);
+}
+
+// There is a point offset + 2 * pi * k in [lo, hi], rounding only ever adds one
+static int interval_has_period_point(double lo, double hi, double offset) {
+	double tol = 4 * DBL_EPSILON * fmax(1, fmax(fabs(lo), fabs(hi)));
+	double k = ceil((lo - tol - offset) / (2 * M_PI));
+
+	return offset + 2 * M_PI * k <= hi + tol;
+}
+
+static void interval_sincos(struct expression_interval a, double (*fn)(double),
+			    double max_at, struct expression_interval *res) {
+	if (isinf(a.lo) || isinf(a.hi)) {
+		res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+	}
+
+	if (!(a.hi - a.lo < 2 * M_PI)) {
+		res->lo = -1;
+		res->hi = 1;
+		return;
+	}
+
+	double lo = fn(a.lo), hi = fn(a.hi);
+	res->lo = fmin(lo, hi);
+	res->hi = fmax(lo, hi);
+
+	if (interval_has_period_point(a.lo, a.hi, max_at)) {
+		res->hi = 1;
+	}
+	if (interval_has_period_point(a.lo, a.hi, max_at + M_PI)) {
+		res->lo = -1;
+	}
+}
+
+EXPR_BINARY_INTERVAL(addition,
+	res->lo = a.lo + b.lo;
+	res->hi = a.hi + b.hi;
+)
+
+EXPR_BINARY_INTERVAL(subtraction,
+	res->lo = a.lo - b.hi;
+	res->hi = a.hi - b.lo;
+)
+
+// 0 * inf is NaN at that point only, the other corners still bound the rest
+EXPR_BINARY_INTERVAL(multiplication,
+	double v[4] = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+
+	for (size_t i = 0; i < 4; i++) {
+		if (isnan(v[i])) {
+			v[i] = 0;
+			res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+		}
+	}
+
+	interval_corners(v[0], v[1], v[2], v[3], res);
+)
+
+// The divisor is split around (-deps, deps) where the evaluator fails
+EXPR_BINARY_INTERVAL(division,
+	int has_neg = b.lo <= -deps;
+	int has_pos = b.hi >= deps;
+
+	if (!has_neg && !has_pos) {
+		res->flags |= EXPRESSION_INTERVAL_F_EMPTY;
+		return S_OK;
+	}
+
+	if (b.lo < deps && b.hi > -deps) {
+		res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+	}
+
+	if (has_neg) {
+		interval_divide(a, b.lo, fmin(b.hi, -deps), res);
+	}
+
+	if (has_pos) {
+		struct expression_interval pos = { .flags = res->flags };
+		interval_divide(a, fmax(b.lo, deps), b.hi, &pos);
+
+		if (has_neg) {
+			pos.lo = fmin(pos.lo, res->lo);
+			pos.hi = fmax(pos.hi, res->hi);
+		}
+		*res = pos;
+	}
+)
+
+/*
+ * A constant integer exponent is defined for any base. A constant fractional
+ * one needs a non-negative base. A varying exponent is bounded at the corners
+ * of a non-negative base only.
+ */
+EXPR_BINARY_INTERVAL(power,
+	int is_point = !(b.lo < b.hi);
+	double p = b.lo;
+
+	if (is_point && fpclassify(p - nearbyint(p)) == FP_ZERO) {
+		int odd = fabs(fmod(p, 2)) >= 1;
+		int has_zero = a.lo <= 0 && a.hi >= 0;
+
+		// Monotonic on either side of zero
+		interval_corners(pow(a.lo, p), pow(a.lo, p), pow(a.hi, p), pow(a.hi, p), res);
+
+		if (has_zero && p > 0 && !odd) {
+			res->lo = 0;
+		} else if (has_zero && p < 0) {
+			res->lo = odd ? -INFINITY : res->lo;
+			res->hi = INFINITY;
+		}
+	} else if (a.hi < 0 && is_point) {
+		res->flags |= EXPRESSION_INTERVAL_F_EMPTY;
+		return S_OK;
+	} else if (a.lo < 0 && !is_point) {
+		// Integer exponents in the range still reach negative bases
+		res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+		res->lo = -INFINITY;
+		res->hi = INFINITY;
+	} else {
+		if (a.lo < 0) {
+			res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+			a.lo = 0;
+		}
+
+		// y * ln(x) is bilinear in y and ln(x), so are its extremes
+		interval_corners(pow(a.lo, b.lo), pow(a.lo, b.hi), pow(a.hi, b.lo), pow(a.hi, b.hi), res);
+	}
+)
+
+EXPR_UNARY_INTERVAL(log,
+	if (a.hi < 0) {
+		res->flags |= EXPRESSION_INTERVAL_F_EMPTY;
+		return S_OK;
+	}
+
+	if (a.lo < 0) {
+		res->flags |= EXPRESSION_INTERVAL_F_PARTIAL;
+		a.lo = 0;
+	}
+
+	res->lo = log(a.lo);
+	res->hi = log(a.hi);
+)
+
+EXPR_UNARY_INTERVAL(sin,
+	interval_sincos(a, sin, M_PI / 2, res);
+)
+
+EXPR_UNARY_INTERVAL(cos,
+	interval_sincos(a, cos, 0, res);
+)
+
+EXPR_UNARY_INTERVAL(small_o,
+	res->lo = 0;
+	res->hi = 0;
+)
+
+int tcompact_evaluate_interval(struct expression *expr, const struct tree_compact *compact,
+			       size_t var_idx, struct expression_interval range,
+			       struct expression_interval *result) {
+	assert (expr);
+	assert (compact);
+	assert (result);
+
+	if (!compact->len) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	struct expression_interval inline_values[INTERVAL_INLINE_VALUES];
+	struct expression_interval *values = inline_values;
+
+	if (compact->len > INTERVAL_INLINE_VALUES) {
+		values = (struct expression_interval *)calloc(compact->len, sizeof(*values));
+		if (!values) {
+			return S_FAIL;
+		}
+	}
+
+	for (size_t i = 0; i < compact->len; i++) {
+		const struct tree_cnode *cnode = &compact->nodes[i];
+
+		switch (tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) {
+			case DERIVATOR_F_NUMBER:
+				values[i] = (struct expression_interval){ cnode->fnum, cnode->fnum, 0 };
+				break;
+			case DERIVATOR_F_VARIABLE: {
+				if (cnode->varidx == var_idx) {
+					values[i] = range;
+					break;
+				}
+
+				struct expression_variable *variable = NULL;
+				if (pvector_get(&expr->variables, cnode->varidx, (void **)&variable)) {
+					_CT_FAIL();
+				}
+				values[i] = (struct expression_interval){ variable->value, variable->value, 0 };
+				break;
+			}
+			case DERIVATOR_F_OPERATOR: {
+				const struct expression_operator *op = cnode->ptr;
+				uint32_t left = tree_cnode_left(cnode), right = tree_cnode_right(cnode);
+				struct expression_interval args[2] = {0};
+				size_t nargs = 0;
+
+				if (left == TREE_CNODE_NIL || left >= i ||
+				    (right != TREE_CNODE_NIL && right >= i)) {
+					_CT_FAIL();
+				}
+
+				args[nargs++] = values[left];
+				if (right != TREE_CNODE_NIL) {
+					args[nargs++] = values[right];
+				}
+
+				if (op->interval(expr, args, nargs, &values[i])) {
+					_CT_FAIL();
+				}
+				break;
+			}
+			default:
+				_CT_FAIL();
+		}
+	}
+
+	*result = values[compact->len - 1];
+
+_CT_EXIT_POINT:
+	if (values != inline_values) {
+		free(values);
+	}
+
+	return ret;
+}
+
+int tnode_evaluate_interval(struct expression *expr, struct tree_node *node,
+			    size_t var_idx, struct expression_interval range,
+			    struct expression_interval *result) {
+	assert (expr);
+	assert (node);
+	assert (result);
+
+	struct tree_compact compact;
+	tree_compact_ctor(&compact);
+
+	int ret = S_FAIL;
+	if (!tree_compact_from_node(&compact, node)) {
+		ret = tcompact_evaluate_interval(expr, &compact, var_idx, range, result);
+	}
+
+	tree_compact_dtor(&compact);
+
+	return ret;
+}
@@ -0,0 +1,422 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tree.h"
+#include "expression.h"
+
+#define DEPS_MIN_CAPACITY (64)
+#define DEPS_NO_VARIABLE (SIZE_MAX)
+
+/*
+ * Variable sets of the nodes under a derived root, by node address.
+ * The roots are hash-consed, so a subtree shared by several parents
+ * is one node and is visited once.
+ */
+struct expression_deps {
+	const struct tree_node **nodes;
+	uint64_t *masks;
+	size_t words;
+	size_t len;
+	size_t capacity;
+};
+
+static size_t deps_slot(const struct expression_deps *deps, const struct tree_node *node) {
+	size_t mask = deps->capacity - 1;
+	size_t slot = (size_t)(((uint64_t)(uintptr_t)node >> 4) * 0x9e3779b97f4a7c15ULL) & mask;
+
+	while (deps->nodes[slot] && deps->nodes[slot] != node) {
+		slot = (slot + 1) & mask;
+	}
+
+	return slot;
+}
+
+int expression_deps_find(const struct expression_deps *deps, const struct tree_node *node,
+			 size_t var_idx) {
+	assert (deps);
+	assert (node);
+
+	if (!deps->len || var_idx / 64 >= deps->words) {
+		return -1;
+	}
+
+	size_t slot = deps_slot(deps, node);
+	if (!deps->nodes[slot]) {
+		return -1;
+	}
+
+	return (deps->masks[slot * deps->words + var_idx / 64] >> (var_idx % 64)) & 1;
+}
+
+static void deps_dtor(struct expression_deps *deps) {
+	free(deps->nodes);
+	free(deps->masks);
+	*deps = (struct expression_deps){0};
+}
+
+static int deps_grow(struct expression_deps *deps) {
+	struct expression_deps old = *deps;
+
+	deps->capacity = old.capacity ? old.capacity * 2 : DEPS_MIN_CAPACITY;
+	deps->nodes = (const struct tree_node **)calloc(deps->capacity, sizeof(*deps->nodes));
+	deps->masks = (uint64_t *)calloc(deps->capacity * deps->words, sizeof(*deps->masks));
+
+	if (!deps->nodes || !deps->masks) {
+		free(deps->nodes);
+		free(deps->masks);
+		*deps = old;
+		return S_FAIL;
+	}
+
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (!old.nodes[i]) {
+			continue;
+		}
+
+		size_t slot = deps_slot(deps, old.nodes[i]);
+		deps->nodes[slot] = old.nodes[i];
+		memcpy(deps->masks + slot * deps->words, old.masks + i * deps->words,
+		       deps->words * sizeof(*deps->masks));
+	}
+
+	free(old.nodes);
+	free(old.masks);
+
+	return S_OK;
+}
+
+static const uint64_t *deps_get(const struct expression_deps *deps, const struct tree_node *node) {
+	if (!deps->len) {
+		return NULL;
+	}
+
+	size_t slot = deps_slot(deps, node);
+
+	return deps->nodes[slot] ? deps->masks + slot * deps->words : NULL;
+}
+
+static int deps_put(struct expression_deps *deps, const struct tree_node *node,
+		    const uint64_t *mask) {
+	if (2 * (deps->len + 1) > deps->capacity && deps_grow(deps)) {
+		return S_FAIL;
+	}
+
+	size_t slot = deps_slot(deps, node);
+
+	deps->nodes[slot] = node;
+	memcpy(deps->masks + slot * deps->words, mask, deps->words * sizeof(*mask));
+	deps->len++;
+
+	return S_OK;
+}
+
+static int deps_push_mask(struct tree_walker *walker, const uint64_t *mask, size_t words) {
+	for (size_t i = 0; i < words; i++) {
+		if (tree_walker_push(walker, (tree_dtype){ .varidx = mask[i] })) {
+			return S_FAIL;
+		}
+	}
+
+	return S_OK;
+}
+
+/*
+ * Post-order pass, every node leaves its mask on the value stack as deps->words values.
+ * A node met again, through a shared subtree, pushes the stored mask and is not walked.
+ */
+static int deps_add(struct expression_deps *deps, struct tree_node *node) {
+	int ret = S_OK;
+	uint64_t *mask = (uint64_t *)calloc(deps->words, sizeof(*mask));
+	struct tree_walker walker;
+
+	if (!mask) {
+		return S_FAIL;
+	}
+
+	if (tree_walker_ctor(&walker, node, TREE_WALK_F_PRE | TREE_WALK_F_POST)) {
+		free(mask);
+		return S_FAIL;
+	}
+
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+
+		if (event == TREE_WALK_PRE) {
+			const uint64_t *known = deps_get(deps, node);
+
+			if (known) {
+				tree_walker_skip(&walker);
+				if (deps_push_mask(&walker, known, deps->words)) {
+					_CT_FAIL();
+				}
+			}
+			continue;
+		}
+
+		memset(mask, 0, deps->words * sizeof(*mask));
+
+		if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE) {
+			if (node->value.varidx / 64 >= deps->words) {
+				_CT_FAIL();
+			}
+			mask[node->value.varidx / 64] |= 1ULL << (node->value.varidx % 64);
+		}
+
+		size_t children = (size_t)(node->left != NULL) + (size_t)(node->right != NULL);
+		for (size_t c = 0; c < children; c++) {
+			for (size_t i = deps->words; i-- > 0;) {
+				mask[i] |= tree_walker_pop(&walker).varidx;
+			}
+		}
+
+		if (deps_put(deps, node, mask) || deps_push_mask(&walker, mask, deps->words)) {
+			_CT_FAIL();
+		}
+	}
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+	free(mask);
+
+	return ret;
+}
+
+static int tnode_is_zero(const struct tree_node *node) {
+	return (node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_NUMBER &&
+		fpclassify(node->value.fnum) == FP_ZERO;
+}
+
+/*
+ * Derives root along vars[first..vars_cnt), a column without a variable is zero.
+ * The row derives in a context of its own, so expr, its memo included, is only read
+ * and rows of one expression may be built on several threads.
+ * The memo is private to the row, its nodes live in the selected arena.
+ */
+static int jacobian_derive_row(struct expression *expr, struct tree_node *root,
+			       const size_t *vars, size_t first, size_t vars_cnt,
+			       struct tree_node **partials) {
+	int ret = S_OK;
+	struct expression_deps deps = { .words = expr->variables.len / 64 + 1 };
+	struct expression row_expr = {
+		.variables = expr->variables,
+		.differentiating_variable = expr->differentiating_variable,
+		.memoize = 1,
+		.derive_deps = &deps,
+	};
+
+	if (deps_add(&deps, root)) {
+		_CT_FAIL();
+	}
+
+	for (size_t j = first; j < vars_cnt; j++) {
+		partials[j] = NULL;
+
+		if (vars[j] == DEPS_NO_VARIABLE || !expression_deps_find(&deps, root, vars[j])) {
+			continue;
+		}
+
+		struct tree_node *partial = expression_derive_tnode(&row_expr, root, vars[j]);
+		if (!partial) {
+			_CT_FAIL();
+		}
+
+		if (!tnode_is_zero(partial)) {
+			partials[j] = partial;
+		}
+	}
+
+_CT_EXIT_POINT:
+	expression_derive_memo_clear(&row_expr);
+	deps_dtor(&deps);
+
+	return ret;
+}
+
+static int jacobian_ctor(struct expression_jacobian *jac, size_t rows_cnt, size_t vars_cnt) {
+	*jac = (struct expression_jacobian){
+		.rows_cnt = rows_cnt,
+		.vars_cnt = vars_cnt,
+	};
+
+	if (tree_arena_ctor(&jac->arena) ||
+	    tree_arena_set_flags(jac->arena, TREE_ARENA_F_HASHCONS)) {
+		expression_jacobian_dtor(jac);
+		return S_FAIL;
+	}
+
+	jac->partials = (struct tree_node **)calloc(rows_cnt * vars_cnt + 1, sizeof(*jac->partials));
+	if (!jac->partials) {
+		expression_jacobian_dtor(jac);
+		return S_FAIL;
+	}
+
+	return S_OK;
+}
+
+int expression_jacobian_dtor(struct expression_jacobian *jac) {
+	assert (jac);
+
+	if (jac->arena) {
+		tree_arena_dtor(jac->arena);
+	}
+	free(jac->partials);
+	*jac = (struct expression_jacobian){0};
+
+	return S_OK;
+}
+
+// Column j of exprs[0] in expr, matched by name
+static size_t jacobian_find_variable(struct expression *expr, const char *name) {
+	for (size_t i = 0; i < expr->variables.len; i++) {
+		struct expression_variable *variable = NULL;
+		if (pvector_get(&expr->variables, i, (void **)&variable)) {
+			return DEPS_NO_VARIABLE;
+		}
+
+		if (!strcmp(variable->name, name)) {
+			return i;
+		}
+	}
+
+	return DEPS_NO_VARIABLE;
+}
+
+int expression_jacobian_ctor(struct expression_jacobian *jac,
+			     struct expression *const *exprs, size_t exprs_cnt) {
+	assert (jac);
+	assert (exprs);
+
+	if (!exprs_cnt) {
+		return S_FAIL;
+	}
+
+	size_t vars_cnt = exprs[0]->variables.len;
+	if (jacobian_ctor(jac, exprs_cnt, vars_cnt)) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	size_t *vars = (size_t *)calloc(vars_cnt + 1, sizeof(*vars));
+	struct tree_arena *prev_arena = tree_arena_select(jac->arena);
+
+	if (!vars) {
+		_CT_FAIL();
+	}
+
+	for (size_t i = 0; i < exprs_cnt; i++) {
+		struct expression *expr = exprs[i];
+
+		if (!expr->tree.root) {
+			_CT_FAIL();
+		}
+
+		for (size_t j = 0; j < vars_cnt; j++) {
+			struct expression_variable *variable = NULL;
+			if (pvector_get(&exprs[0]->variables, j, (void **)&variable)) {
+				_CT_FAIL();
+			}
+
+			vars[j] = i ? jacobian_find_variable(expr, variable->name) : j;
+		}
+
+		// Simplified once into the arena, every column derives the same hash-consed root
+		struct tree_node *root = tnode_simplify(expr, expr->tree.root);
+		if (!root) {
+			_CT_FAIL();
+		}
+
+		struct tree_node **row = jac->partials + i * vars_cnt;
+		if (jacobian_derive_row(expr, root, vars, 0, vars_cnt, row)) {
+			_CT_FAIL();
+		}
+
+		for (size_t j = 0; j < vars_cnt; j++) {
+			jac->nonzero_cnt += row[j] ? 1 : 0;
+		}
+	}
+
+_CT_EXIT_POINT:
+	tree_arena_select(prev_arena);
+	free(vars);
+
+	if (ret) {
+		expression_jacobian_dtor(jac);
+	}
+
+	return ret;
+}
+
+int expression_gradient_ctor(struct expression_jacobian *grad, struct expression *expr) {
+	assert (grad);
+	assert (expr);
+
+	return expression_jacobian_ctor(grad, &expr, 1);
+}
+
+int expression_hessian_ctor(struct expression_jacobian *hess, struct expression *expr) {
+	assert (hess);
+	assert (expr);
+
+	if (!expr->tree.root) {
+		return S_FAIL;
+	}
+
+	size_t vars_cnt = expr->variables.len;
+	if (jacobian_ctor(hess, vars_cnt, vars_cnt)) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	size_t *vars = (size_t *)calloc(vars_cnt + 1, sizeof(*vars));
+	struct tree_node **grad = (struct tree_node **)calloc(vars_cnt + 1, sizeof(*grad));
+	struct tree_arena *prev_arena = tree_arena_select(hess->arena);
+	struct tree_node *root = NULL;
+
+	if (!vars || !grad) {
+		_CT_FAIL();
+	}
+
+	for (size_t j = 0; j < vars_cnt; j++) {
+		vars[j] = j;
+	}
+
+	// The gradient shares the arena, so the second derivatives reuse its nodes
+	root = tnode_simplify(expr, expr->tree.root);
+	if (!root || jacobian_derive_row(expr, root, vars, 0, vars_cnt, grad)) {
+		_CT_FAIL();
+	}
+
+	for (size_t i = 0; i < vars_cnt; i++) {
+		struct tree_node **row = hess->partials + i * vars_cnt;
+
+		if (!grad[i]) {
+			continue;
+		}
+
+		// d2f/dxi dxj = d2f/dxj dxi, the lower half takes the upper one
+		if (jacobian_derive_row(expr, grad[i], vars, i, vars_cnt, row)) {
+			_CT_FAIL();
+		}
+
+		hess->nonzero_cnt += row[i] ? 1 : 0;
+		for (size_t j = i + 1; j < vars_cnt; j++) {
+			hess->partials[j * vars_cnt + i] = row[j];
+			hess->nonzero_cnt += row[j] ? 2 : 0;
+		}
+	}
+
+_CT_EXIT_POINT:
+	tree_arena_select(prev_arena);
+	free(vars);
+	free(grad);
+
+	if (ret) {
+		expression_jacobian_dtor(hess);
+	}
+
+	return ret;
+}
@@ -0,0 +1,365 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include "tree.h"
+#include "expression.h"
+
+static const double deps = 1e-9;
+
+/*
+ * The generated function keeps vars in rbx and the temporaries in its frame,
+ * constants follow the code and are read rip-relative.
+ * Templates get lhs in xmm0 and rhs in xmm1 and leave the result in xmm0.
+ */
+struct expression_jit_fixup {
+	size_t at;
+	size_t slot;
+};
+
+struct expression_jit_emitter {
+	uint8_t *code;
+	size_t len;
+	size_t capacity;
+
+	struct expression_jit_fixup *fixups;
+	size_t fixups_cnt;
+	size_t fixups_capacity;
+
+	const struct expression_program *program;
+	uint32_t frame;
+	int oom;
+};
+
+// Displacements of the frame and of vars must fit in 32 bits
+#define EXPRESSION_JIT_MAX_REGS (1 << 24)
+
+#define EXPRESSION_JIT_EMIT(emitter, ...)					\
+	do {									\
+		const uint8_t _bytes[16] = { __VA_ARGS__ };			\
+		expression_jit_emit(emitter, _bytes,				\
+				    sizeof((const uint8_t[]){ __VA_ARGS__ }));	\
+	} while (0)
+
+static void expression_jit_emit(struct expression_jit_emitter *emitter,
+				const uint8_t *bytes, size_t len) {
+	if (emitter->oom) {
+		return;
+	}
+
+	if (emitter->len + len > emitter->capacity) {
+		size_t capacity = emitter->capacity ? emitter->capacity * 2 : 256;
+		while (capacity < emitter->len + len) {
+			capacity *= 2;
+		}
+
+		uint8_t *code = (uint8_t *)realloc(emitter->code, capacity);
+		if (!code) {
+			emitter->oom = 1;
+			return;
+		}
+
+		emitter->code = code;
+		emitter->capacity = capacity;
+	}
+
+	memcpy(emitter->code + emitter->len, bytes, len);
+	emitter->len += len;
+}
+
+static void expression_jit_emit_u32(struct expression_jit_emitter *emitter, uint32_t value) {
+	expression_jit_emit(emitter, (const uint8_t *)&value, sizeof(value));
+}
+
+static void expression_jit_emit_u64(struct expression_jit_emitter *emitter, uint64_t value) {
+	expression_jit_emit(emitter, (const uint8_t *)&value, sizeof(value));
+}
+
+enum {
+	EXPRESSION_JIT_SLOT_DEPS,
+	EXPRESSION_JIT_SLOT_NAN,
+	EXPRESSION_JIT_SLOTS,
+};
+
+// ModRM of [rip + disp32] to the constant slot, patched once the code size is known
+static void expression_jit_emit_rip(struct expression_jit_emitter *emitter,
+				    uint8_t xmm, size_t slot) {
+	if (emitter->fixups_cnt == emitter->fixups_capacity) {
+		size_t capacity = emitter->fixups_capacity ? emitter->fixups_capacity * 2 : 16;
+		struct expression_jit_fixup *fixups = (struct expression_jit_fixup *)
+			realloc(emitter->fixups, capacity * sizeof(*fixups));
+		if (!fixups) {
+			emitter->oom = 1;
+			return;
+		}
+
+		emitter->fixups = fixups;
+		emitter->fixups_capacity = capacity;
+	}
+
+	EXPRESSION_JIT_EMIT(emitter, (uint8_t)(xmm << 3 | 0x5));
+	emitter->fixups[emitter->fixups_cnt++] = (struct expression_jit_fixup){
+		.at = emitter->len, .slot = slot };
+	expression_jit_emit_u32(emitter, 0);
+}
+
+// Slots of the jit's own constants go after the program constants
+static size_t expression_jit_slot(struct expression_jit_emitter *emitter, size_t slot) {
+	return emitter->program->consts_cnt + slot;
+}
+
+// movsd between xmm and a program register, opcode 0x10 loads and 0x11 stores
+static void expression_jit_emit_reg(struct expression_jit_emitter *emitter,
+				    uint8_t opcode, uint8_t xmm, uint32_t reg) {
+	const struct expression_program *program = emitter->program;
+
+	EXPRESSION_JIT_EMIT(emitter, 0xF2, 0x0F, opcode);
+
+	if (reg < program->consts_cnt) {
+		expression_jit_emit_rip(emitter, xmm, reg);
+	} else if (reg < program->consts_cnt + program->vars_cnt) {
+		// [rbx + disp32]
+		EXPRESSION_JIT_EMIT(emitter, (uint8_t)(0x80 | xmm << 3 | 0x3));
+		expression_jit_emit_u32(emitter, (uint32_t)(reg - program->consts_cnt) * 8);
+	} else {
+		// [rsp + disp32]
+		EXPRESSION_JIT_EMIT(emitter, (uint8_t)(0x80 | xmm << 3 | 0x4), 0x24);
+		expression_jit_emit_u32(emitter, (uint32_t)(reg - program->consts_cnt -
+							    program->vars_cnt) * 8);
+	}
+}
+
+static void expression_jit_emit_return(struct expression_jit_emitter *emitter) {
+	// add rsp, frame; pop rbx; ret
+	EXPRESSION_JIT_EMIT(emitter, 0x48, 0x81, 0xC4);
+	expression_jit_emit_u32(emitter, emitter->frame);
+	EXPRESSION_JIT_EMIT(emitter, 0x5B, 0xC3);
+}
+
+// mov rax, fn; call rax. Arguments are already in xmm0 and xmm1
+static void expression_jit_emit_call(struct expression_jit_emitter *emitter, uintptr_t fn) {
+	EXPRESSION_JIT_EMIT(emitter, 0x48, 0xB8);
+	expression_jit_emit_u64(emitter, (uint64_t)fn);
+	EXPRESSION_JIT_EMIT(emitter, 0xFF, 0xD0);
+}
+
+int expr_op_jit_addition(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	// addsd xmm0, xmm1
+	EXPRESSION_JIT_EMIT(emitter, 0xF2, 0x0F, 0x58, 0xC1);
+
+	return S_OK;
+}
+
+int expr_op_jit_subtraction(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	// subsd xmm0, xmm1
+	EXPRESSION_JIT_EMIT(emitter, 0xF2, 0x0F, 0x5C, 0xC1);
+
+	return S_OK;
+}
+
+int expr_op_jit_multiplication(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	// mulsd xmm0, xmm1
+	EXPRESSION_JIT_EMIT(emitter, 0xF2, 0x0F, 0x59, 0xC1);
+
+	return S_OK;
+}
+
+int expr_op_jit_division(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	// xmm3 = fabs(xmm1): movq rax, xmm1; btr rax, 63; movq xmm3, rax
+	EXPRESSION_JIT_EMIT(emitter, 0x66, 0x48, 0x0F, 0x7E, 0xC8);
+	EXPRESSION_JIT_EMIT(emitter, 0x48, 0x0F, 0xBA, 0xF0, 0x3F);
+	EXPRESSION_JIT_EMIT(emitter, 0x66, 0x48, 0x0F, 0x6E, 0xD8);
+
+	// movsd xmm2, [deps]; ucomisd xmm2, xmm3
+	EXPRESSION_JIT_EMIT(emitter, 0xF2, 0x0F, 0x10);
+	expression_jit_emit_rip(emitter, 2, expression_jit_slot(emitter, EXPRESSION_JIT_SLOT_DEPS));
+	EXPRESSION_JIT_EMIT(emitter, 0x66, 0x0F, 0x2E, 0xD3);
+
+	// Same check as the interpreter, jbe skips the return of NAN unless deps > |rhs|
+	size_t jump = emitter->len;
+	EXPRESSION_JIT_EMIT(emitter, 0x76, 0x00);
+
+	EXPRESSION_JIT_EMIT(emitter, 0xF2, 0x0F, 0x10);
+	expression_jit_emit_rip(emitter, 0, expression_jit_slot(emitter, EXPRESSION_JIT_SLOT_NAN));
+	expression_jit_emit_return(emitter);
+
+	if (!emitter->oom) {
+		emitter->code[jump + 1] = (uint8_t)(emitter->len - jump - 2);
+	}
+
+	// divsd xmm0, xmm1
+	EXPRESSION_JIT_EMIT(emitter, 0xF2, 0x0F, 0x5E, 0xC1);
+
+	return S_OK;
+}
+
+int expr_op_jit_power(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	expression_jit_emit_call(emitter, (uintptr_t)&pow);
+
+	return S_OK;
+}
+
+int expr_op_jit_log(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	expression_jit_emit_call(emitter, (uintptr_t)&log);
+
+	return S_OK;
+}
+
+int expr_op_jit_sin(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	expression_jit_emit_call(emitter, (uintptr_t)&sin);
+
+	return S_OK;
+}
+
+int expr_op_jit_cos(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	expression_jit_emit_call(emitter, (uintptr_t)&cos);
+
+	return S_OK;
+}
+
+int expr_op_jit_small_o(struct expression_jit_emitter *emitter) {
+	assert (emitter);
+
+	// xorpd xmm0, xmm0
+	EXPRESSION_JIT_EMIT(emitter, 0x66, 0x0F, 0x57, 0xC0);
+
+	return S_OK;
+}
+
+static int expression_jit_emit_program(struct expression_jit_emitter *emitter) {
+	const struct expression_program *program = emitter->program;
+
+	// push rbx; mov rbx, rdi; sub rsp, frame. The frame keeps rsp 16-byte aligned for calls
+	EXPRESSION_JIT_EMIT(emitter, 0x53, 0x48, 0x89, 0xFB, 0x48, 0x81, 0xEC);
+	expression_jit_emit_u32(emitter, emitter->frame);
+
+	for (size_t i = 0; i < program->len; i++) {
+		const struct expression_insn *insn = &program->code[i];
+		const size_t ops_cnt = sizeof(expression_operators) / sizeof(*expression_operators) - 1;
+
+		if (insn->opcode >= ops_cnt || !expression_operators[insn->opcode]->jit) {
+			return S_FAIL;
+		}
+
+		expression_jit_emit_reg(emitter, 0x10, 0, insn->lhs);
+		expression_jit_emit_reg(emitter, 0x10, 1, insn->rhs);
+
+		if (expression_operators[insn->opcode]->jit(emitter)) {
+			return S_FAIL;
+		}
+
+		expression_jit_emit_reg(emitter, 0x11, 0, insn->dst);
+	}
+
+	expression_jit_emit_reg(emitter, 0x10, 0, program->result);
+	expression_jit_emit_return(emitter);
+
+	// Constants start 8-byte aligned after the code
+	while (emitter->len % sizeof(double)) {
+		EXPRESSION_JIT_EMIT(emitter, 0xCC);
+	}
+
+	size_t data = emitter->len;
+	for (size_t i = 0; i < program->consts_cnt; i++) {
+		expression_jit_emit(emitter, (const uint8_t *)&program->consts[i], sizeof(double));
+	}
+
+	const double slots[EXPRESSION_JIT_SLOTS] = {
+		[EXPRESSION_JIT_SLOT_DEPS] = deps,
+		[EXPRESSION_JIT_SLOT_NAN] = NAN,
+	};
+	expression_jit_emit(emitter, (const uint8_t *)slots, sizeof(slots));
+
+	if (emitter->oom) {
+		return S_FAIL;
+	}
+
+	for (size_t i = 0; i < emitter->fixups_cnt; i++) {
+		const struct expression_jit_fixup *fixup = &emitter->fixups[i];
+		int32_t rel = (int32_t)(data + fixup->slot * sizeof(double) - (fixup->at + 4));
+
+		memcpy(emitter->code + fixup->at, &rel, sizeof(rel));
+	}
+
+	return S_OK;
+}
+
+int expression_jit_ctor(struct expression_jit *jit, const struct expression_program *program) {
+	assert (jit);
+	assert (program);
+
+	*jit = (struct expression_jit){0};
+
+#if !defined(__x86_64__)
+	return S_FAIL;
+#else
+	if (!program->regs_cnt || program->regs_cnt > EXPRESSION_JIT_MAX_REGS ||
+	    program->consts_cnt + program->vars_cnt > program->regs_cnt) {
+		return S_FAIL;
+	}
+
+	int ret = S_OK;
+	size_t temps = program->regs_cnt - program->consts_cnt - program->vars_cnt;
+	struct expression_jit_emitter emitter = {
+		.program = program,
+		.frame = (uint32_t)((temps * sizeof(double) + 15) & ~(size_t)15),
+	};
+
+	if (expression_jit_emit_program(&emitter)) {
+		_CT_FAIL();
+	}
+
+	// Written while writable, then switched to executable
+	void *code = mmap(NULL, emitter.len, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code == MAP_FAILED) {
+		_CT_FAIL();
+	}
+
+	memcpy(code, emitter.code, emitter.len);
+
+	if (mprotect(code, emitter.len, PROT_READ | PROT_EXEC)) {
+		munmap(code, emitter.len);
+		_CT_FAIL();
+	}
+
+	jit->code = code;
+	jit->size = emitter.len;
+	jit->fn = (expression_jit_fn)code;
+
+_CT_EXIT_POINT:
+	free(emitter.code);
+	free(emitter.fixups);
+
+	return ret;
+#endif
+}
+
+int expression_jit_dtor(struct expression_jit *jit) {
+	assert (jit);
+
+	if (jit->code) {
+		munmap(jit->code, jit->size);
+	}
+	*jit = (struct expression_jit){0};
+
+	return S_OK;
+}
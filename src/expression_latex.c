@@ -5,71 +5,185 @@
 
 #include "expression.h"
 
+static int tvalue_latex_brackets(tree_dtype parent, tree_dtype value) {
+	if ((value.flags & DERIVATOR_F_OPERATOR) != DERIVATOR_F_OPERATOR) {
+		return 0;
+	}
+
+	struct expression_operator *expr_op = parent.ptr;
+	struct expression_operator *inl_op = value.ptr;
+
+	return inl_op->priority > expr_op->priority;
+}
+
+static void tvalue_to_latex(struct expression *expr, tree_dtype value, FILE *out_stream) {
+	if ((value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_OPERATOR) {
+		struct expression_operator *expr_op = value.ptr;
+		fprintf(out_stream, "%s", expr_op->latex_name);
+	} else if ((value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE) {
+		struct expression_variable *ev = NULL;
+		pvector_get(&expr->variables, value.varidx, (void **)&ev);
+
+		fprintf(out_stream, "\\textit{%s}", ev->name);
+	} else {
+		fprintf(out_stream, "%g", value.fnum);
+	}
+}
+
 DSError_t tnode_to_latex(struct expression *expr,
 				struct tree_node *node, FILE *out_stream) {
 	assert (expr);
 	assert (node);
 	assert (out_stream);
 
-	if (node->right && !node->left) {
-		return DS_INVALID_ARG;
+	DSError_t ret = DS_OK;
+	struct tree_walker walker;
+
+	if ((ret = tree_walker_ctor(&walker, node, TREE_WALK_F_PRE | TREE_WALK_F_POST)) != DS_OK) {
+		return ret;
 	}
 
-	if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_OPERATOR) {
-		struct expression_operator *expr_op = node->value.ptr;
-		fprintf(out_stream, "%s", expr_op->latex_name);
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			ret = DS_ALLOCATION;
+			break;
+		}
 
-		if (node->left) {
-			int brackets = 0;
-			if ((node->left->value.flags & DERIVATOR_F_OPERATOR)
-					== DERIVATOR_F_OPERATOR) {
-				struct expression_operator *inl_op =  node->left->value.ptr;
-				if (inl_op->priority > expr_op->priority) {
-					brackets = 1;
+		// Every child is an argument of its parent command
+		struct tree_node *parent = tree_walker_parent(&walker);
+
+		if (event == TREE_WALK_POST) {
+			if (parent) {
+				if (tvalue_latex_brackets(parent->value, node->value)) {
+					fprintf(out_stream, ")");
 				}
+				fprintf(out_stream, "}");
 			}
+			continue;
+		}
 
+		if (parent) {
 			fprintf(out_stream, "{");
-			if (brackets) {
+			if (tvalue_latex_brackets(parent->value, node->value)) {
 				fprintf(out_stream, "(");
 			}
-			tnode_to_latex(expr, node->left, out_stream);
-			if (brackets) {
-				fprintf(out_stream, ")");
-			}
-			fprintf(out_stream, "}");
 		}
 
-		if (node->right) {
-			int brackets = 0;
-			if ((node->right->value.flags & DERIVATOR_F_OPERATOR)
-					== DERIVATOR_F_OPERATOR) {
-				struct expression_operator *inl_op =  node->right->value.ptr;
-				if (inl_op->priority > expr_op->priority) {
-					brackets = 1;
+		if (node->right && !node->left) {
+			ret = DS_INVALID_ARG;
+			tree_walker_skip(&walker);
+			continue;
+		}
+
+		tvalue_to_latex(expr, node->value, out_stream);
+	}
+
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+#define TFROZEN_NO_PARENT SIZE_MAX
+
+struct tfrozen_latex_item {
+	size_t idx;
+	size_t parent;
+	int close;
+};
+
+static DSError_t tfrozen_latex_reserve(struct tfrozen_latex_item **stack,
+					size_t *capacity, size_t needed) {
+	if (needed <= *capacity) {
+		return DS_OK;
+	}
+
+	size_t new_capacity = *capacity ? *capacity * 2 : TREE_WALKER_INLINE_DEPTH;
+	struct tfrozen_latex_item *new_stack = (struct tfrozen_latex_item *)
+		realloc(*stack, new_capacity * sizeof(**stack));
+	if (!new_stack) {
+		return DS_ALLOCATION;
+	}
+
+	*stack = new_stack;
+	*capacity = new_capacity;
+
+	return DS_OK;
+}
+
+DSError_t tfrozen_to_latex(struct expression *expr,
+			   const struct tree_frozen *frozen, FILE *out_stream) {
+	assert (expr);
+	assert (frozen);
+	assert (out_stream);
+
+	if (!frozen->len) {
+		return DS_INVALID_ARG;
+	}
+
+	DSError_t ret = DS_OK;
+	struct tfrozen_latex_item *stack = NULL;
+	size_t stack_len = 0, stack_capacity = 0;
+
+	if (tfrozen_latex_reserve(&stack, &stack_capacity, 1)) {
+		return DS_ALLOCATION;
+	}
+
+	stack[stack_len++] = (struct tfrozen_latex_item){ frozen->len - 1, TFROZEN_NO_PARENT, 0 };
+
+	// Children are pushed right first, so the left one is printed first
+	while (stack_len) {
+		struct tfrozen_latex_item item = stack[--stack_len];
+		const struct tree_fnode *fnode = &frozen->nodes[item.idx];
+		int brackets = item.parent != TFROZEN_NO_PARENT &&
+			tvalue_latex_brackets(tree_fnode_value(&frozen->nodes[item.parent]),
+					      tree_fnode_value(fnode));
+
+		if (item.close) {
+			if (item.parent != TFROZEN_NO_PARENT) {
+				if (brackets) {
+					fprintf(out_stream, ")");
 				}
+				fprintf(out_stream, "}");
 			}
+			continue;
+		}
 
+		if (item.parent != TFROZEN_NO_PARENT) {
 			fprintf(out_stream, "{");
 			if (brackets) {
 				fprintf(out_stream, "(");
 			}
-			tnode_to_latex(expr, node->right, out_stream);
-			if (brackets) {
-				fprintf(out_stream, ")");
-			}
-			fprintf(out_stream, "}");
 		}
-	} else if ((node->value.flags & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE) {
-		struct expression_variable *ev = NULL;
-		pvector_get(&expr->variables, node->value.varidx, (void **)&ev);
 
-		fprintf(out_stream, "\\textit{%s}", ev->name);
-	} else {
-		fprintf(out_stream, "%g", node->value.fnum);
+		if ((fnode->children & TREE_FNODE_RIGHT) && !(fnode->children & TREE_FNODE_LEFT)) {
+			ret = DS_INVALID_ARG;
+			continue;
+		}
+
+		tvalue_to_latex(expr, tree_fnode_value(fnode), out_stream);
+
+		if (tfrozen_latex_reserve(&stack, &stack_capacity, stack_len + 3)) {
+			ret = DS_ALLOCATION;
+			break;
+		}
+
+		item.close = 1;
+		stack[stack_len++] = item;
+
+		if (fnode->children & TREE_FNODE_RIGHT) {
+			stack[stack_len++] = (struct tfrozen_latex_item){
+				tree_frozen_right(frozen, item.idx), item.idx, 0 };
+		}
+		if (fnode->children & TREE_FNODE_LEFT) {
+			stack[stack_len++] = (struct tfrozen_latex_item){
+				tree_frozen_left(frozen, item.idx), item.idx, 0 };
+		}
 	}
 
-	return DS_OK;
+	free(stack);
+
+	return ret;
 }
 
 static const char *latex_command_header =
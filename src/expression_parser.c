@@ -438,7 +438,17 @@ int expression_parse_str(char *str, struct expression *expr) {
 		return S_FAIL;
 	}
 
-	if (CALL_PARSER(getG, &s_copy, &expr->tree.root)) {
+	if (tree_arena_ctor(&expr->tree.arena)) {
+		pvector_destroy(&var_names);
+		expression_dtor(expr);
+		return S_FAIL;
+	}
+
+	struct tree_arena *prev_arena = tree_arena_select(expr->tree.arena);
+	int parse_status = CALL_PARSER(getG, &s_copy, &expr->tree.root);
+	tree_arena_select(prev_arena);
+
+	if (parse_status) {
 		size_t fail_pos = (size_t)(s_copy - str); 
 
 		eprintf("\nExpression parsing failed in position %zu:\n", fail_pos);
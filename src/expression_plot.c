@@ -13,28 +13,75 @@ static double evaluate_tnode_at_x(struct expression *expr, struct tree_node *tno
 	assert (expr);
 	assert (tnode);
 
-	struct expression_variable *ev = NULL;
-	double original_value = 0;
+	// The batch path binds x in its own context, expr stays untouched
+	double result = NAN;
+	if (tnode_evaluate_batch(expr, tnode, 0, expr->differentiating_variable,
+				 &x, &result, 1) != S_OK) {
+		return NAN;
+	}
 
-	if (pvector_get(&expr->variables, expr->differentiating_variable, 
-						(void **)&ev)) {
-		return NAN;	
+	return result;
+}
+
+#define GNUPLOT_MIN_POINTS (1000)
+#define GNUPLOT_CULL_BLOCK (64)
+
+/*
+ * Blocks of points where the interval bound says nothing is defined are
+ * skipped whole, the runs between them go to the batch evaluator.
+ */
+static int evaluate_tnode_culled(struct expression *expr, struct tree_node *tnode,
+				 const double *xs, double *ys, size_t n) {
+	int ret = S_OK;
+	struct expression_program program;
+	struct tree_compact compact;
+	expression_program_ctor(&program);
+	tree_compact_ctor(&compact);
+	program.flags = EXPRESSION_PROGRAM_F_FAST_MATH;
+
+	if (tnode_compile(expr, tnode, &program) || tree_compact_from_node(&compact, tnode)) {
+		_CT_FAIL();
 	}
 
-	original_value = ev->value;
-	ev->value = x;
+	// Points from run on are not evaluated yet
+	size_t run = 0;
+	for (size_t start = 0; start < n; start += GNUPLOT_CULL_BLOCK) {
+		size_t end = start + GNUPLOT_CULL_BLOCK < n ? start + GNUPLOT_CULL_BLOCK : n;
+		struct expression_interval range = {
+			fmin(xs[start], xs[end - 1]), fmax(xs[start], xs[end - 1]), 0
+		};
+		struct expression_interval bound = {0};
+
+		if (tcompact_evaluate_interval(expr, &compact, expr->differentiating_variable,
+					       range, &bound) ||
+		    !(bound.flags & EXPRESSION_INTERVAL_F_EMPTY)) {
+			continue;
+		}
 
-	double result = 0;
-	if (tnode_evaluate(expr, tnode, &result) != S_OK) {
-		result = NAN;
+		for (size_t i = start; i < end; i++) {
+			ys[i] = NAN;
+		}
+
+		if (start > run &&
+		    expression_program_evaluate_batch(expr, &program, expr->differentiating_variable,
+						      xs + run, ys + run, start - run)) {
+			_CT_FAIL();
+		}
+		run = end;
 	}
 
-	ev->value = original_value;
+	if (n > run &&
+	    expression_program_evaluate_batch(expr, &program, expr->differentiating_variable,
+					      xs + run, ys + run, n - run)) {
+		_CT_FAIL();
+	}
 
-	return result;
-}
+_CT_EXIT_POINT:
+	tree_compact_dtor(&compact);
+	expression_program_dtor(&program);
 
-#define GNUPLOT_MIN_POINTS (1000)
+	return ret;
+}
 
 int expression_tnode_plot_pts(struct expression *expr, struct tree_node *tnode,
 			FILE *out_file, double x_min, double x_max, int points) {
@@ -46,20 +93,34 @@ int expression_tnode_plot_pts(struct expression *expr, struct tree_node *tnode,
 		return S_FAIL;
 	}
 
-	fprintf(out_file, "\"<echo '");
+	double *xs = (double *)calloc(2 * (size_t)points, sizeof(double));
+	if (!xs) {
+		return S_FAIL;
+	}
+	double *ys = xs + points;
 
 	double step = (x_max - x_min) / (points - 1);
 	for (int i = 0; i < points; i++) {
-		double x = x_min + i * step;
-		double y = evaluate_tnode_at_x(expr, tnode, x);
+		xs[i] = x_min + i * step;
+	}
 
-		if (!isnan(y) && !isinf(y)) {
-			fprintf(out_file, "%f %f\\n", x, y);
+	if (evaluate_tnode_culled(expr, tnode, xs, ys, (size_t)points)) {
+		free(xs);
+		return S_FAIL;
+	}
+
+	fprintf(out_file, "\"<echo '");
+
+	for (int i = 0; i < points; i++) {
+		if (!isnan(ys[i]) && !isinf(ys[i])) {
+			fprintf(out_file, "%f %f\\n", xs[i], ys[i]);
 		}
 	}
 
 	fprintf(out_file, "'\"");
 
+	free(xs);
+
 	return S_OK;
 }
 
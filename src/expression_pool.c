@@ -0,0 +1,277 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "tree.h"
+#include "expression.h"
+
+#define EXPRESSION_POOL_CHUNK (4096)
+#define EXPRESSION_POOL_CACHE_LINE (64)
+
+/*
+ * Every worker starts on its own contiguous run of chunks and takes them
+ * from the front. Once it runs dry it steals from the other runs the same way,
+ * so an idle worker only touches a busy worker's counter.
+ */
+struct expression_pool_range {
+	size_t next;
+	size_t end;
+} __attribute__((aligned(EXPRESSION_POOL_CACHE_LINE)));
+
+struct expression_pool_job {
+	// Either task is called for every chunk or the program is evaluated
+	expression_pool_task task;
+	void *arg;
+
+	struct expression *expr;
+	const struct expression_program *program;
+	size_t var_idx;
+	const double *xs;
+	double *ys;
+	size_t n;
+	size_t chunk;
+
+	struct expression_pool_range *ranges;
+	size_t ranges_cnt;
+	int failed;
+};
+
+static void expression_pool_run(struct expression_pool_job *job, size_t self) {
+	struct expression_context ctx;
+	if (!job->task && expression_context_ctor(&ctx, job->expr)) {
+		__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (size_t i = 0; i < job->ranges_cnt; i++) {
+		struct expression_pool_range *range = &job->ranges[(self + i) % job->ranges_cnt];
+
+		for (;;) {
+			size_t chunk = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED);
+			if (chunk >= range->end) {
+				break;
+			}
+
+			size_t start = chunk * job->chunk;
+			size_t len = job->n - start < job->chunk ? job->n - start : job->chunk;
+
+			if (job->task) {
+				if (job->task(job->arg, chunk)) {
+					__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+				}
+			} else if (expression_context_evaluate_batch(&ctx, job->program, job->var_idx,
+								     job->xs + start, job->ys + start, len)) {
+				__atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+			}
+		}
+	}
+
+	if (!job->task) {
+		expression_context_dtor(&ctx);
+	}
+}
+
+struct expression_pool_worker {
+	struct expression_pool *pool;
+	size_t idx;
+};
+
+static void *expression_pool_thread(void *arg) {
+	struct expression_pool_worker *worker = (struct expression_pool_worker *)arg;
+	struct expression_pool *pool = worker->pool;
+	uint64_t generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && pool->generation == generation) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		}
+		if (pool->stop) {
+			break;
+		}
+
+		generation = pool->generation;
+		struct expression_pool_job *job = pool->job;
+		pthread_mutex_unlock(&pool->lock);
+
+		expression_pool_run(job, worker->idx);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->active == 0) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+int expression_pool_ctor(struct expression_pool *pool, size_t threads_cnt) {
+	assert (pool);
+
+	*pool = (struct expression_pool){0};
+
+	if (!threads_cnt) {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads_cnt = online > 0 ? (size_t)online : 1;
+	}
+
+	// The caller is a worker too
+	pool->workers = (struct expression_pool_worker *)calloc(threads_cnt, sizeof(*pool->workers));
+	pool->threads = (pthread_t *)calloc(threads_cnt, sizeof(*pool->threads));
+	if (!pool->workers || !pool->threads) {
+		free(pool->workers);
+		free(pool->threads);
+		return S_FAIL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	pool->threads_cnt = 1;
+	for (size_t i = 1; i < threads_cnt; i++) {
+		pool->workers[i] = (struct expression_pool_worker){ .pool = pool, .idx = i };
+
+		if (pthread_create(&pool->threads[i], NULL, expression_pool_thread, &pool->workers[i])) {
+			expression_pool_dtor(pool);
+			return S_FAIL;
+		}
+		pool->threads_cnt++;
+	}
+
+	return S_OK;
+}
+
+int expression_pool_dtor(struct expression_pool *pool) {
+	assert (pool);
+
+	if (!pool->threads) {
+		return S_OK;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 1; i < pool->threads_cnt; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->done);
+
+	free(pool->workers);
+	free(pool->threads);
+	*pool = (struct expression_pool){0};
+
+	return S_OK;
+}
+
+// Splits chunks_cnt chunks in runs, one per thread, and waits for all of them
+static int expression_pool_dispatch(struct expression_pool *pool, struct expression_pool_job *job,
+				    size_t chunks_cnt) {
+	size_t ranges_cnt = pool->threads_cnt < chunks_cnt ? pool->threads_cnt : chunks_cnt;
+
+	struct expression_pool_range *ranges = (struct expression_pool_range *)
+		aligned_alloc(EXPRESSION_POOL_CACHE_LINE, ranges_cnt * sizeof(*ranges));
+	if (!ranges) {
+		return S_FAIL;
+	}
+
+	for (size_t i = 0; i < ranges_cnt; i++) {
+		ranges[i].next = chunks_cnt * i / ranges_cnt;
+		ranges[i].end = chunks_cnt * (i + 1) / ranges_cnt;
+	}
+
+	job->ranges = ranges;
+	job->ranges_cnt = ranges_cnt;
+
+	// Workers past ranges_cnt still wake up and find every range empty
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->active = pool->threads_cnt - 1;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	expression_pool_run(job, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->active) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pool->job = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	free(ranges);
+
+	return job->failed ? S_FAIL : S_OK;
+}
+
+int expression_pool_evaluate_batch(struct expression_pool *pool, struct expression *expr,
+				   const struct expression_program *program, size_t var_idx,
+				   const double *xs, double *ys, size_t n, size_t chunk) {
+	assert (pool);
+	assert (expr);
+	assert (program);
+	assert (xs || !n);
+	assert (ys || !n);
+
+	if (!pool->threads_cnt) {
+		return S_FAIL;
+	}
+
+	if (!chunk) {
+		chunk = EXPRESSION_POOL_CHUNK;
+	}
+
+	size_t chunks_cnt = n / chunk + (n % chunk != 0);
+
+	if (pool->threads_cnt <= 1 || chunks_cnt <= 1) {
+		return expression_program_evaluate_batch(expr, program, var_idx, xs, ys, n);
+	}
+
+	struct expression_pool_job job = {
+		.expr = expr,
+		.program = program,
+		.var_idx = var_idx,
+		.xs = xs,
+		.ys = ys,
+		.n = n,
+		.chunk = chunk,
+	};
+
+	return expression_pool_dispatch(pool, &job, chunks_cnt);
+}
+
+int expression_pool_run_tasks(struct expression_pool *pool, size_t n,
+			      expression_pool_task task, void *arg) {
+	assert (pool);
+	assert (task);
+
+	if (!pool->threads_cnt) {
+		return S_FAIL;
+	}
+
+	if (pool->threads_cnt <= 1 || n <= 1) {
+		for (size_t i = 0; i < n; i++) {
+			if (task(arg, i)) {
+				return S_FAIL;
+			}
+		}
+		return S_OK;
+	}
+
+	struct expression_pool_job job = {
+		.task = task,
+		.arg = arg,
+		.n = n,
+		.chunk = 1,
+	};
+
+	return expression_pool_dispatch(pool, &job, n);
+}
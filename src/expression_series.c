@@ -0,0 +1,286 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tree.h"
+#include "expression.h"
+
+static const double deps = 1e-9;
+
+/*
+ * Truncated power series in t = x - x0, c[k] is the k-th Taylor coefficient.
+ * Every rule is a recurrence over the lower coefficients, O(len^2).
+ */
+
+#define EXPR_BINARY_SERIES(expr_name, ...)						\
+	int expr_op_series_##expr_name(struct expression *expr,			\
+				       const double *const *args, size_t nargs,	\
+				       size_t len, double *scratch, double *c) {	\
+		assert (expr);								\
+		assert (args);								\
+		assert (c);								\
+											\
+		if (nargs < 2) {							\
+			return S_FAIL;							\
+		}									\
+											\
+		const double *a = args[0];						\
+		const double *b = args[1];						\
+		(void)scratch;								\
+		__VA_ARGS__								\
+		return S_OK;								\
+	}										\
+
+#define EXPR_UNARY_SERIES(expr_name, ...)						\
+	int expr_op_series_##expr_name(struct expression *expr,			\
+				       const double *const *args, size_t nargs,	\
+				       size_t len, double *scratch, double *c) {	\
+		assert (expr);								\
+		assert (args);								\
+		assert (c);								\
+											\
+		if (nargs < 1) {							\
+			return S_FAIL;							\
+		}									\
+											\
+		(void)scratch;								\
+		__VA_ARGS__								\
+		return S_OK;								\
+	}										\
+
+static void series_multiply(const double *a, const double *b, size_t len, double *c) {
+	for (size_t k = 0; k < len; k++) {
+		double sum = 0;
+		for (size_t i = 0; i <= k; i++) {
+			sum += a[i] * b[k - i];
+		}
+		c[k] = sum;
+	}
+}
+
+// a * c' = a', c[0] = ln(a[0])
+static void series_log(const double *a, size_t len, double *c) {
+	c[0] = log(a[0]);
+
+	for (size_t k = 1; k < len; k++) {
+		double sum = (double)k * a[k];
+		for (size_t i = 1; i < k; i++) {
+			sum -= (double)i * c[i] * a[k - i];
+		}
+		c[k] = sum / ((double)k * a[0]);
+	}
+}
+
+// c' = a' * c, c[0] = exp(a[0])
+static void series_exp(const double *a, size_t len, double *c) {
+	c[0] = exp(a[0]);
+
+	for (size_t k = 1; k < len; k++) {
+		double sum = 0;
+		for (size_t i = 1; i <= k; i++) {
+			sum += (double)i * a[i] * c[k - i];
+		}
+		c[k] = sum / (double)k;
+	}
+}
+
+// s' = a' * c and c' = -a' * s at once
+static void series_sincos(const double *a, size_t len, double *s, double *c) {
+	s[0] = sin(a[0]);
+	c[0] = cos(a[0]);
+
+	for (size_t k = 1; k < len; k++) {
+		double ssum = 0, csum = 0;
+		for (size_t i = 1; i <= k; i++) {
+			ssum += (double)i * a[i] * c[k - i];
+			csum += (double)i * a[i] * s[k - i];
+		}
+		s[k] = ssum / (double)k;
+		c[k] = -csum / (double)k;
+	}
+}
+
+static int series_is_constant(const double *a, size_t len) {
+	for (size_t k = 1; k < len; k++) {
+		if (fpclassify(a[k]) != FP_ZERO) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+EXPR_BINARY_SERIES(addition,
+	for (size_t k = 0; k < len; k++) {
+		c[k] = a[k] + b[k];
+	}
+)
+
+EXPR_BINARY_SERIES(subtraction,
+	for (size_t k = 0; k < len; k++) {
+		c[k] = a[k] - b[k];
+	}
+)
+
+EXPR_BINARY_SERIES(multiplication,
+	series_multiply(a, b, len, c);
+)
+
+// a = b * c solved for c[k] term by term
+EXPR_BINARY_SERIES(division,
+	if (fabs(b[0]) < deps) {
+		log_error("Division by zero.");
+		return S_FAIL;
+	}
+
+	for (size_t k = 0; k < len; k++) {
+		double sum = a[k];
+		for (size_t i = 0; i < k; i++) {
+			sum -= c[i] * b[k - i];
+		}
+		c[k] = sum / b[0];
+	}
+)
+
+/*
+ * A constant exponent p uses a * c' = p * a' * c, a zero base with a natural p
+ * is squared out. Otherwise the power is exp(b * ln(a)).
+ */
+EXPR_BINARY_SERIES(power,
+	double p = b[0];
+
+	if (series_is_constant(b, len) && fabs(a[0]) >= deps) {
+		c[0] = pow(a[0], p);
+
+		for (size_t k = 1; k < len; k++) {
+			double sum = 0;
+			for (size_t i = 1; i <= k; i++) {
+				sum += (p * (double)i - (double)(k - i)) * a[i] * c[k - i];
+			}
+			c[k] = sum / ((double)k * a[0]);
+		}
+		return S_OK;
+	}
+
+	if (series_is_constant(b, len) && p >= 0 && p < 0x1p63 && fabs(p - nearbyint(p)) < deps) {
+		double *base = scratch;
+		double *product = scratch + len;
+
+		memcpy(base, a, len * sizeof(double));
+		memset(c, 0, len * sizeof(double));
+		c[0] = 1;
+
+		for (uint64_t e = (uint64_t)nearbyint(p); e; e >>= 1) {
+			if (e & 1) {
+				series_multiply(c, base, len, product);
+				memcpy(c, product, len * sizeof(double));
+			}
+			if (e > 1) {
+				series_multiply(base, base, len, product);
+				memcpy(base, product, len * sizeof(double));
+			}
+		}
+		return S_OK;
+	}
+
+	double *log_a = scratch;
+	double *exponent = scratch + len;
+
+	series_log(a, len, log_a);
+	series_multiply(b, log_a, len, exponent);
+	series_exp(exponent, len, c);
+)
+
+EXPR_UNARY_SERIES(log,
+	series_log(args[0], len, c);
+)
+
+EXPR_UNARY_SERIES(sin,
+	series_sincos(args[0], len, c, scratch);
+)
+
+EXPR_UNARY_SERIES(cos,
+	series_sincos(args[0], len, scratch, c);
+)
+
+EXPR_UNARY_SERIES(small_o,
+	memset(c, 0, len * sizeof(double));
+)
+
+int tnode_evaluate_series(struct expression *expr, struct tree_node *node,
+			  size_t var_idx, size_t nth, double *coeffs) {
+	assert (expr);
+	assert (node);
+	assert (coeffs);
+
+	int ret = S_OK;
+	size_t len = nth + 1;
+	double *series = NULL;
+	struct tree_compact compact;
+	tree_compact_ctor(&compact);
+
+	if (tree_compact_from_node(&compact, node) || !compact.len) {
+		_CT_FAIL();
+	}
+
+	// One series per node, then two of scratch
+	series = (double *)calloc((compact.len + 2) * len, sizeof(double));
+	if (!series) {
+		_CT_FAIL();
+	}
+	double *scratch = series + compact.len * len;
+
+	for (size_t i = 0; i < compact.len; i++) {
+		const struct tree_cnode *cnode = &compact.nodes[i];
+		double *c = series + i * len;
+
+		switch (tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) {
+			case DERIVATOR_F_NUMBER:
+				c[0] = cnode->fnum;
+				break;
+			case DERIVATOR_F_VARIABLE: {
+				struct expression_variable *variable = NULL;
+				if (pvector_get(&expr->variables, cnode->varidx, (void **)&variable)) {
+					_CT_FAIL();
+				}
+
+				c[0] = variable->value;
+				if (cnode->varidx == var_idx && len > 1) {
+					c[1] = 1;
+				}
+				break;
+			}
+			case DERIVATOR_F_OPERATOR: {
+				const struct expression_operator *op = cnode->ptr;
+				uint32_t left = tree_cnode_left(cnode), right = tree_cnode_right(cnode);
+				const double *args[2] = {0};
+				size_t nargs = 0;
+
+				if (left == TREE_CNODE_NIL || left >= i ||
+				    (right != TREE_CNODE_NIL && right >= i)) {
+					_CT_FAIL();
+				}
+
+				args[nargs++] = series + left * len;
+				if (right != TREE_CNODE_NIL) {
+					args[nargs++] = series + right * len;
+				}
+
+				if (op->series(expr, args, nargs, len, scratch, c)) {
+					_CT_FAIL();
+				}
+				break;
+			}
+			default:
+				_CT_FAIL();
+		}
+	}
+
+	memcpy(coeffs, series + (compact.len - 1) * len, len * sizeof(double));
+
+_CT_EXIT_POINT:
+	free(series);
+	tree_compact_dtor(&compact);
+
+	return ret;
+}
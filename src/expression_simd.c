@@ -0,0 +1,314 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include "tree.h"
+#include "expression.h"
+
+/*
+ * Four lanes of GCC vector extensions. On x86-64 every kernel is built
+ * for AVX2 and for the SSE2 baseline, the loader picks one by the CPU.
+ */
+typedef double expr_v4d __attribute__((vector_size(32)));
+typedef int64_t expr_v4i __attribute__((vector_size(32)));
+typedef uint64_t expr_v4u __attribute__((vector_size(32)));
+
+#define EXPR_V_LANES (4)
+
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__clang__)
+#define EXPR_SIMD_DISPATCH __attribute__((target_clones("avx2", "default")))
+// Helpers are always inlined into the clones, vectors never cross a call
+#pragma GCC diagnostic ignored "-Wpsabi"
+#else
+#define EXPR_SIMD_DISPATCH
+#endif
+
+#define EXPR_V(value) ((expr_v4d){ (value), (value), (value), (value) })
+#define EXPR_VI(value) ((expr_v4i){ (value), (value), (value), (value) })
+
+// Adding it rounds to an integer kept in the low mantissa bits
+#define EXPR_ROUND_MAGIC (0x1.8p52)
+
+static const double expr_pio2_1 = 1.57079632673412561417e+00;
+static const double expr_pio2_2 = 6.07710050630396597660e-11;
+static const double expr_pio2_3 = 2.02226624871116645580e-21;
+static const double expr_two_over_pi = 6.36619772367581382433e-01;
+static const double expr_sincos_limit = 1e5;
+
+static const double expr_ln2_hi = 6.93147180369123816490e-01;
+static const double expr_ln2_lo = 1.90821492927058770002e-10;
+static const double expr_inv_ln2 = 1.44269504088896338700e+00;
+static const double expr_exp_limit = 707;
+
+static inline __attribute__((always_inline)) expr_v4d expr_v_blend(expr_v4i mask, expr_v4d a, expr_v4d b) {
+	return (expr_v4d)(((expr_v4i)a & mask) | ((expr_v4i)b & ~mask));
+}
+
+static inline __attribute__((always_inline)) expr_v4d expr_v_round(expr_v4d x, expr_v4i *n) {
+	expr_v4d t = x + EXPR_V(EXPR_ROUND_MAGIC);
+
+	*n = (expr_v4i)t - (expr_v4i)EXPR_V(EXPR_ROUND_MAGIC);
+
+	return t - EXPR_V(EXPR_ROUND_MAGIC);
+}
+
+static inline __attribute__((always_inline)) expr_v4d expr_v_abs(expr_v4d x) {
+	return (expr_v4d)((expr_v4i)x & EXPR_VI(INT64_MAX));
+}
+
+static inline __attribute__((always_inline)) int expr_v_any(expr_v4i mask) {
+	return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+}
+
+/*
+ * Cody-Waite reduction by pi/2 in three parts, then the cephes
+ * polynomials on [-pi/4, pi/4]. Offset 1 turns sin into cos.
+ */
+static inline __attribute__((always_inline)) expr_v4d expr_v_sincos(expr_v4d x, int64_t offset) {
+	expr_v4i quadrant;
+	expr_v4d q = expr_v_round(x * EXPR_V(expr_two_over_pi), &quadrant);
+
+	expr_v4d r = x - q * EXPR_V(expr_pio2_1);
+	r = r - q * EXPR_V(expr_pio2_2);
+	r = r - q * EXPR_V(expr_pio2_3);
+
+	expr_v4d z = r * r;
+
+	expr_v4d sin_poly = EXPR_V(1.58962301576546568060e-10);
+	sin_poly = sin_poly * z + EXPR_V(-2.50507477628578072866e-8);
+	sin_poly = sin_poly * z + EXPR_V(2.75573136213857245213e-6);
+	sin_poly = sin_poly * z + EXPR_V(-1.98412698295895385996e-4);
+	sin_poly = sin_poly * z + EXPR_V(8.33333333332211858878e-3);
+	sin_poly = sin_poly * z + EXPR_V(-1.66666666666666307295e-1);
+	expr_v4d sin_r = r + r * z * sin_poly;
+
+	expr_v4d cos_poly = EXPR_V(-1.13585365213876817300e-11);
+	cos_poly = cos_poly * z + EXPR_V(2.08757008419747316778e-9);
+	cos_poly = cos_poly * z + EXPR_V(-2.75573141792967388112e-7);
+	cos_poly = cos_poly * z + EXPR_V(2.48015872888517045348e-5);
+	cos_poly = cos_poly * z + EXPR_V(-1.38888888888730564116e-3);
+	cos_poly = cos_poly * z + EXPR_V(4.16666666666665929218e-2);
+	expr_v4d cos_r = EXPR_V(1) - EXPR_V(0.5) * z + z * z * cos_poly;
+
+	quadrant += EXPR_VI(offset);
+
+	expr_v4i odd = (quadrant & EXPR_VI(1)) != EXPR_VI(0);
+	expr_v4d result = expr_v_blend(odd, cos_r, sin_r);
+
+	return (expr_v4d)((expr_v4u)result ^ ((expr_v4u)(quadrant & EXPR_VI(2)) << 62));
+}
+
+// fdlibm log: x = 2^k * (1 + f) with 1 + f in [sqrt(2)/2, sqrt(2))
+static inline __attribute__((always_inline)) expr_v4d expr_v_log(expr_v4d x) {
+	expr_v4i bits = (expr_v4i)x;
+	expr_v4i k = (bits >> 52) - EXPR_VI(1023);
+	expr_v4d m = (expr_v4d)((bits & EXPR_VI(0x000FFFFFFFFFFFFF)) | EXPR_VI(0x3FF0000000000000));
+
+	expr_v4i big = m > EXPR_V(M_SQRT2);
+	m = expr_v_blend(big, m * EXPR_V(0.5), m);
+	k -= big;
+
+	expr_v4d dk = (expr_v4d)(k + (expr_v4i)EXPR_V(EXPR_ROUND_MAGIC)) - EXPR_V(EXPR_ROUND_MAGIC);
+	expr_v4d f = m - EXPR_V(1);
+	expr_v4d s = f / (EXPR_V(2) + f);
+	expr_v4d z = s * s;
+	expr_v4d w = z * z;
+
+	expr_v4d t1 = w * (EXPR_V(3.999999999940941908e-01) +
+		      w * (EXPR_V(2.222219843214978396e-01) +
+		      w * EXPR_V(1.531383769920937332e-01)));
+	expr_v4d t2 = z * (EXPR_V(6.666666666666735130e-01) +
+		      w * (EXPR_V(2.857142874366239149e-01) +
+		      w * (EXPR_V(1.818357216161805012e-01) +
+		      w * EXPR_V(1.479819860511658591e-01))));
+	expr_v4d hfsq = EXPR_V(0.5) * f * f;
+
+	return dk * EXPR_V(expr_ln2_hi) -
+	       ((hfsq - (s * (hfsq + t1 + t2) + dk * EXPR_V(expr_ln2_lo))) - f);
+}
+
+// fdlibm exp, |x| < expr_exp_limit keeps 2^n normal
+static inline __attribute__((always_inline)) expr_v4d expr_v_exp(expr_v4d x) {
+	expr_v4i n;
+	expr_v4d dn = expr_v_round(x * EXPR_V(expr_inv_ln2), &n);
+
+	expr_v4d hi = x - dn * EXPR_V(expr_ln2_hi);
+	expr_v4d lo = dn * EXPR_V(expr_ln2_lo);
+	expr_v4d r = hi - lo;
+	expr_v4d z = r * r;
+
+	expr_v4d poly = EXPR_V(4.13813679705723846039e-08);
+	poly = poly * z + EXPR_V(-1.65339022054652515390e-06);
+	poly = poly * z + EXPR_V(6.61375632143793436117e-05);
+	poly = poly * z + EXPR_V(-2.77777777770155933842e-03);
+	poly = poly * z + EXPR_V(1.66666666666666019037e-01);
+
+	expr_v4d c = r - z * poly;
+	expr_v4d y = EXPR_V(1) - ((lo - (r * c) / (EXPR_V(2) - c)) - hi);
+
+	return (expr_v4d)((expr_v4u)y + ((expr_v4u)n << 52));
+}
+
+static inline __attribute__((always_inline)) expr_v4d expr_v_load(const double *src) {
+	expr_v4d v;
+	memcpy(&v, src, sizeof(v));
+
+	return v;
+}
+
+static inline __attribute__((always_inline)) void expr_v_store(double *dst, expr_v4d v) {
+	memcpy(dst, &v, sizeof(v));
+}
+
+static inline __attribute__((always_inline))
+void expr_simd_sincos4(const double *x, double *y, int64_t offset) {
+	expr_v4d v = expr_v_load(x);
+
+	expr_v4i special = ~((expr_v_abs(v) <= EXPR_V(expr_sincos_limit)) &
+			   (expr_v_abs(v) >= EXPR_V(DBL_MIN)));
+	expr_v_store(y, expr_v_sincos(v, offset));
+
+	if (expr_v_any(special)) {
+		for (size_t j = 0; j < EXPR_V_LANES; j++) {
+			if (special[j]) {
+				y[j] = offset ? cos(x[j]) : sin(x[j]);
+			}
+		}
+	}
+}
+
+static inline __attribute__((always_inline))
+void expr_simd_log4(const double *x, double *y) {
+	expr_v4d v = expr_v_load(x);
+
+	// Zero, negative, subnormal, infinite and NaN arguments go to libm
+	expr_v4i special = ~((v >= EXPR_V(DBL_MIN)) & (v <= EXPR_V(DBL_MAX)));
+	expr_v_store(y, expr_v_log(v));
+
+	if (expr_v_any(special)) {
+		for (size_t j = 0; j < EXPR_V_LANES; j++) {
+			if (special[j]) {
+				y[j] = log(x[j]);
+			}
+		}
+	}
+}
+
+static inline __attribute__((always_inline))
+void expr_simd_pow4(const double *x, const double *p, double *y) {
+	expr_v4d base = expr_v_load(x);
+	expr_v4d t = expr_v_load(p) * expr_v_log(base);
+
+	expr_v4i special = ~((base >= EXPR_V(DBL_MIN)) & (base <= EXPR_V(DBL_MAX)) &
+			     (expr_v_abs(t) < EXPR_V(expr_exp_limit)));
+	expr_v_store(y, expr_v_exp(t));
+
+	if (expr_v_any(special)) {
+		for (size_t j = 0; j < EXPR_V_LANES; j++) {
+			if (special[j]) {
+				y[j] = pow(x[j], p[j]);
+			}
+		}
+	}
+}
+
+/*
+ * Full vectors are read in place, the tail goes through a copy padded with ones.
+ * The tail takes the same call, so each kernel is inlined once per clone.
+ */
+EXPR_SIMD_DISPATCH
+static void expression_simd_sincos(const double *x, double *y, size_t n, int64_t offset) {
+	double tail_x[EXPR_V_LANES] = {1, 1, 1, 1};
+	double tail_y[EXPR_V_LANES];
+
+	for (size_t i = 0; i < n; i += EXPR_V_LANES) {
+		size_t len = n - i < EXPR_V_LANES ? n - i : EXPR_V_LANES;
+		const double *vx = x + i;
+		double *vy = y + i;
+
+		if (len < EXPR_V_LANES) {
+			memcpy(tail_x, vx, len * sizeof(double));
+			vx = tail_x;
+			vy = tail_y;
+		}
+
+		expr_simd_sincos4(vx, vy, offset);
+
+		if (vy == tail_y) {
+			memcpy(y + i, tail_y, len * sizeof(double));
+		}
+	}
+}
+
+void expression_simd_sin(const double *x, double *y, size_t n) {
+	assert (x || !n);
+	assert (y || !n);
+
+	expression_simd_sincos(x, y, n, 0);
+}
+
+void expression_simd_cos(const double *x, double *y, size_t n) {
+	assert (x || !n);
+	assert (y || !n);
+
+	expression_simd_sincos(x, y, n, 1);
+}
+
+EXPR_SIMD_DISPATCH
+void expression_simd_log(const double *x, double *y, size_t n) {
+	assert (x || !n);
+	assert (y || !n);
+
+	double tail_x[EXPR_V_LANES] = {1, 1, 1, 1};
+	double tail_y[EXPR_V_LANES];
+
+	for (size_t i = 0; i < n; i += EXPR_V_LANES) {
+		size_t len = n - i < EXPR_V_LANES ? n - i : EXPR_V_LANES;
+		const double *vx = x + i;
+		double *vy = y + i;
+
+		if (len < EXPR_V_LANES) {
+			memcpy(tail_x, vx, len * sizeof(double));
+			vx = tail_x;
+			vy = tail_y;
+		}
+
+		expr_simd_log4(vx, vy);
+
+		if (vy == tail_y) {
+			memcpy(y + i, tail_y, len * sizeof(double));
+		}
+	}
+}
+
+EXPR_SIMD_DISPATCH
+void expression_simd_pow(const double *x, const double *p, double *y, size_t n) {
+	assert (x || !n);
+	assert (p || !n);
+	assert (y || !n);
+
+	double tail_x[EXPR_V_LANES] = {1, 1, 1, 1};
+	double tail_p[EXPR_V_LANES] = {1, 1, 1, 1};
+	double tail_y[EXPR_V_LANES];
+
+	for (size_t i = 0; i < n; i += EXPR_V_LANES) {
+		size_t len = n - i < EXPR_V_LANES ? n - i : EXPR_V_LANES;
+		const double *vx = x + i, *vp = p + i;
+		double *vy = y + i;
+
+		if (len < EXPR_V_LANES) {
+			memcpy(tail_x, vx, len * sizeof(double));
+			memcpy(tail_p, vp, len * sizeof(double));
+			vx = tail_x;
+			vp = tail_p;
+			vy = tail_y;
+		}
+
+		expr_simd_pow4(vx, vp, vy);
+
+		if (vy == tail_y) {
+			memcpy(y + i, tail_y, len * sizeof(double));
+		}
+	}
+}
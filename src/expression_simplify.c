@@ -16,44 +16,12 @@ static const double deps = 1e-9;
 						== DERIVATOR_F_OPERATOR)
 #define EXPR_TNODE_IS_CONSTANT(node) (node->value.flags & DERIVATOR_F_CONSTANT)
 
-struct tree_node *tnode_simplify(struct expression *expr, struct tree_node *node) {
-	assert (node);
-
-	if (EXPR_TNODE_IS_CONSTANT(node)) {
-		double fnum = 0;
-
-		if (tnode_evaluate(expr, node, &fnum)) {
-			return NULL;
-		}
-
-		return expr_create_number_tnode(fnum);
-	}
-
-	if (EXPR_TNODE_IS_NUMBER(node)) {
-		return expr_copy_tnode(expr, node);
-	}
-
-	if (EXPR_TNODE_IS_VARIABLE(node)) {
-		return expr_copy_tnode(expr, node);
-	}
-
-	struct expression_operator *op = node->value.ptr;
-
-	struct tree_node *lnode = NULL, *rnode = NULL;
-	if (node->left) {
-		lnode = tnode_simplify(expr, node->left);
-		if (!lnode) {
-			return NULL;
-		}
-	}
-	if (node->right) {
-		rnode = tnode_simplify(expr, node->right);
-		if (!rnode) {
-			if (lnode) tnode_recursive_dtor(lnode, NULL);
-
-			return NULL;
-		}
-	}
+struct tree_node *expr_simplify_operator_tnode(struct expression *expr,
+					       const struct expression_operator *op,
+					       struct tree_node *lnode,
+					       struct tree_node *rnode) {
+	assert (expr);
+	assert (op);
 
 	if (op->idx == DERIVATOR_IDX_MULTIPLY) {
 		if ((EXPR_TNODE_IS_NUMBER(lnode) && fabs(lnode->value.fnum) < deps) ||
@@ -152,18 +120,86 @@ struct tree_node *tnode_simplify(struct expression *expr, struct tree_node *node
 		return NULL;
 	}
 
-	if (EXPR_TNODE_IS_NUMBER(new_node)) {
-		double fnum = 0;
+	// Operands are folded already, so a constant node is an operator over numbers.
+	// One that can not be evaluated, like 1/0, is kept as it is
+	double fnum = 0;
+	if (EXPR_TNODE_IS_CONSTANT(new_node) && !tnode_evaluate(expr, new_node, &fnum)) {
+		tnode_recursive_dtor(new_node, NULL);
+
+		return expr_create_number_tnode(fnum);
+	}
+
+	return new_node;
+}
+
+struct tree_node *tnode_simplify(struct expression *expr, struct tree_node *node) {
+	assert (node);
+
+	int ret = S_OK;
+	struct tree_node *new_node = NULL;
+	struct tree_walker walker;
+
+	if (tree_walker_ctor(&walker, node, TREE_WALK_F_PRE | TREE_WALK_F_POST)) {
+		return NULL;
+	}
+
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+
+		if (event == TREE_WALK_PRE) {
+			double fnum = 0;
+
+			// A constant that can not be evaluated, like 1/0, is copied as it is
+			if (EXPR_TNODE_IS_CONSTANT(node) && !tnode_evaluate(expr, node, &fnum)) {
+				new_node = expr_create_number_tnode(fnum);
+			} else if (EXPR_TNODE_IS_CONSTANT(node) ||
+				   EXPR_TNODE_IS_NUMBER(node) || EXPR_TNODE_IS_VARIABLE(node)) {
+				new_node = expr_copy_tnode(expr, node);
+			} else {
+				continue;
+			}
+
+			tree_walker_skip(&walker);
+		} else {
+			struct tree_node *lnode = NULL, *rnode = NULL;
+
+			if (node->right) {
+				rnode = tree_walker_pop(&walker).ptr;
+			}
+			if (node->left) {
+				lnode = tree_walker_pop(&walker).ptr;
+			}
 
-		if (tnode_evaluate(expr, new_node, &fnum)) {
-			return NULL;
+			new_node = expr_simplify_operator_tnode(expr, node->value.ptr, lnode, rnode);
 		}
 
+		if (!new_node) {
+			_CT_FAIL();
+		}
+
+		if (tree_walker_push(&walker, (tree_dtype){ .ptr = new_node })) {
+			_CT_FAIL();
+		}
+		new_node = NULL;
+	}
+
+	new_node = tree_walker_pop(&walker).ptr;
+
+_CT_EXIT_POINT:
+	if (ret) {
 		tnode_recursive_dtor(new_node, NULL);
+		new_node = NULL;
 
-		return expr_create_number_tnode(fnum);
+		while (walker.values_len) {
+			tnode_recursive_dtor(tree_walker_pop(&walker).ptr, NULL);
+		}
 	}
 
+	tree_walker_dtor(&walker);
+
 	return new_node;
 }
 
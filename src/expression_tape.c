@@ -0,0 +1,158 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "tree.h"
+#include "expression.h"
+
+int expression_tape_ctor(struct expression_tape *tape, struct tree_node *node) {
+	assert (tape);
+	assert (node);
+
+	int ret = S_OK;
+
+	*tape = (struct expression_tape){0};
+	tree_compact_ctor(&tape->compact);
+
+	if (tree_compact_from_node(&tape->compact, node) || !tape->compact.len) {
+		_CT_FAIL();
+	}
+
+	for (size_t i = 0; i < tape->compact.len; i++) {
+		const struct tree_cnode *cnode = &tape->compact.nodes[i];
+		uint32_t left = tree_cnode_left(cnode), right = tree_cnode_right(cnode);
+
+		if ((tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE &&
+		    cnode->varidx >= tape->vars_cnt) {
+			tape->vars_cnt = cnode->varidx + 1;
+		}
+
+		// The sweeps index children as they go, so the tape is checked once here
+		if ((tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) == DERIVATOR_F_OPERATOR &&
+		    (left == TREE_CNODE_NIL || left >= i || (right != TREE_CNODE_NIL && right >= i))) {
+			_CT_FAIL();
+		}
+	}
+
+	tape->values = (double *)calloc(2 * tape->compact.len, sizeof(double));
+	if (!tape->values) {
+		_CT_FAIL();
+	}
+	tape->adjoints = tape->values + tape->compact.len;
+
+_CT_EXIT_POINT:
+	if (ret) {
+		expression_tape_dtor(tape);
+	}
+
+	return ret;
+}
+
+int expression_tape_dtor(struct expression_tape *tape) {
+	assert (tape);
+
+	tree_compact_dtor(&tape->compact);
+	free(tape->values);
+	*tape = (struct expression_tape){0};
+
+	return S_OK;
+}
+
+static size_t tcnode_args(const struct expression_tape *tape, const struct tree_cnode *cnode,
+			  double *args, uint32_t *children) {
+	uint32_t left = tree_cnode_left(cnode), right = tree_cnode_right(cnode);
+	size_t nargs = 0;
+
+	children[nargs] = left;
+	args[nargs++] = tape->values[left];
+
+	if (right != TREE_CNODE_NIL) {
+		children[nargs] = right;
+		args[nargs++] = tape->values[right];
+	}
+
+	return nargs;
+}
+
+int expression_tape_gradient(struct expression *expr, struct expression_tape *tape,
+			     const double *vars, size_t vars_cnt, double *fnum, double *grad) {
+	assert (expr);
+	assert (tape);
+	assert (vars || !vars_cnt);
+	assert (fnum);
+	assert (grad || !vars_cnt);
+
+	if (tape->vars_cnt > vars_cnt) {
+		return S_FAIL;
+	}
+
+	const struct tree_cnode *nodes = tape->compact.nodes;
+	size_t len = tape->compact.len;
+
+	for (size_t i = 0; i < len; i++) {
+		const struct tree_cnode *cnode = &nodes[i];
+
+		switch (tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) {
+			case DERIVATOR_F_NUMBER:
+				tape->values[i] = cnode->fnum;
+				break;
+			case DERIVATOR_F_VARIABLE:
+				tape->values[i] = vars[cnode->varidx];
+				break;
+			case DERIVATOR_F_OPERATOR: {
+				const struct expression_operator *op = cnode->ptr;
+				double args[2] = {0};
+				uint32_t children[2] = {0};
+				size_t nargs = tcnode_args(tape, cnode, args, children);
+
+				if (op->evaluator(expr, args, nargs, &tape->values[i])) {
+					return S_FAIL;
+				}
+				break;
+			}
+			default:
+				return S_FAIL;
+		}
+	}
+
+	memset(tape->adjoints, 0, len * sizeof(double));
+	memset(grad, 0, vars_cnt * sizeof(double));
+	tape->adjoints[len - 1] = 1;
+
+	// Parents follow their children, so every adjoint is complete when its node is reached
+	for (size_t i = len; i-- > 0;) {
+		const struct tree_cnode *cnode = &nodes[i];
+		double adjoint = tape->adjoints[i];
+
+		if (fpclassify(adjoint) == FP_ZERO) {
+			continue;
+		}
+
+		if ((tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) == DERIVATOR_F_VARIABLE) {
+			grad[cnode->varidx] += adjoint;
+			continue;
+		}
+
+		if ((tree_cnode_flags(cnode) & DERIVATOR_F_OPERATOR) != DERIVATOR_F_OPERATOR) {
+			continue;
+		}
+
+		const struct expression_operator *op = cnode->ptr;
+		double args[2] = {0};
+		double partials[2] = {0};
+		uint32_t children[2] = {0};
+		size_t nargs = tcnode_args(tape, cnode, args, children);
+
+		if (op->partials(expr, args, nargs, tape->values[i], partials)) {
+			return S_FAIL;
+		}
+
+		for (size_t j = 0; j < nargs; j++) {
+			tape->adjoints[children[j]] += adjoint * partials[j];
+		}
+	}
+
+	*fnum = tape->values[len - 1];
+
+	return S_OK;
+}
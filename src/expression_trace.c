@@ -0,0 +1,282 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tree.h"
+#include "expression.h"
+
+#define EXPRESSION_TRACE_MAX (256)
+#define EXPRESSION_TRACE_MIN_CAPACITY (64)
+
+// Rules past the operators, see expression_trace_rule()
+enum {
+	EXPRESSION_TRACE_NUMBER = DERIVATOR_IDX_SMALL_O + 1,
+	EXPRESSION_TRACE_VARIABLE,
+	EXPRESSION_TRACE_RULES,
+};
+
+/*
+ * A step is the derived node and the rule applied to it. Nothing is copied,
+ * the shown steps are rebuilt from the source tree when they are rendered.
+ */
+struct expression_trace_step {
+	struct tree_node *node;
+	uint32_t rule;
+};
+
+struct expression_trace {
+	struct expression_trace_step *steps;
+	size_t len;
+	size_t capacity;
+};
+
+int expression_trace_clear(struct expression *expr) {
+	assert (expr);
+
+	struct expression_trace *trace = expr->trace;
+	if (!trace) {
+		return S_OK;
+	}
+
+	free(trace->steps);
+	free(trace);
+	expr->trace = NULL;
+
+	return S_OK;
+}
+
+static uint32_t expression_trace_rule(const struct tree_node *node) {
+	switch (node->value.flags & DERIVATOR_F_OPERATOR) {
+		case DERIVATOR_F_NUMBER:
+			return EXPRESSION_TRACE_NUMBER;
+		case DERIVATOR_F_VARIABLE:
+			return EXPRESSION_TRACE_VARIABLE;
+		default:
+			return ((const struct expression_operator *)node->value.ptr)->idx;
+	}
+}
+
+int expression_trace_record(struct expression *expr, struct tree_node *node,
+			    struct tree_node *derivative) {
+	assert (expr);
+	assert (node);
+	assert (derivative);
+
+	struct expression_trace *trace = expr->trace;
+
+	if (!trace) {
+		trace = (struct expression_trace *)calloc(1, sizeof(*trace));
+		if (!trace) {
+			return S_FAIL;
+		}
+		expr->trace = trace;
+	}
+
+	if (trace->len == trace->capacity) {
+		size_t capacity = trace->capacity ? trace->capacity * 2 : EXPRESSION_TRACE_MIN_CAPACITY;
+		struct expression_trace_step *steps = (struct expression_trace_step *)
+			realloc(trace->steps, capacity * sizeof(*steps));
+		if (!steps) {
+			return S_FAIL;
+		}
+
+		trace->steps = steps;
+		trace->capacity = capacity;
+	}
+
+	trace->steps[trace->len++] = (struct expression_trace_step){
+		.node = node,
+		.rule = expression_trace_rule(node),
+	};
+
+	return S_OK;
+}
+
+static int trace_node_cmp(const void *lhs, const void *rhs) {
+	uintptr_t lnode = (uintptr_t)*(struct tree_node *const *)lhs;
+	uintptr_t rnode = (uintptr_t)*(struct tree_node *const *)rhs;
+
+	return (lnode > rnode) - (lnode < rnode);
+}
+
+/*
+ * The nodes of the top levels of root, as many levels as fit in max nodes.
+ * The root is always there.
+ */
+static int trace_top_levels(struct tree_node *root, size_t max,
+			    struct tree_node ***levels, size_t *levels_len) {
+	int ret = S_OK;
+	size_t *level_cnt = (size_t *)calloc(max + 2, sizeof(*level_cnt));
+	size_t shown_depth = 1, shown_cnt = 1;
+	struct tree_node *node = NULL;
+	struct tree_walker walker;
+
+	*levels = NULL;
+	*levels_len = 0;
+
+	if (!level_cnt) {
+		return S_FAIL;
+	}
+
+	if (tree_walker_ctor(&walker, root, TREE_WALK_F_PRE)) {
+		free(level_cnt);
+		return S_FAIL;
+	}
+
+	// Every level holds a node, so no more than max + 1 of them may fit
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+
+		level_cnt[walker.depth]++;
+		if (walker.depth > max) {
+			tree_walker_skip(&walker);
+		}
+	}
+	tree_walker_dtor(&walker);
+
+	while (shown_depth <= max && shown_cnt + level_cnt[shown_depth + 1] <= max &&
+	       level_cnt[shown_depth + 1]) {
+		shown_cnt += level_cnt[++shown_depth];
+	}
+
+	*levels = (struct tree_node **)calloc(shown_cnt, sizeof(**levels));
+	if (!*levels || tree_walker_ctor(&walker, root, TREE_WALK_F_PRE)) {
+		free(*levels);
+		*levels = NULL;
+		free(level_cnt);
+		return S_FAIL;
+	}
+
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_FAIL();
+		}
+
+		(*levels)[(*levels_len)++] = node;
+		if (walker.depth == shown_depth) {
+			tree_walker_skip(&walker);
+		}
+	}
+
+	qsort(*levels, *levels_len, sizeof(**levels), trace_node_cmp);
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+	free(level_cnt);
+
+	if (ret) {
+		free(*levels);
+		*levels = NULL;
+		*levels_len = 0;
+	}
+
+	return ret;
+}
+
+static int trace_render_step(struct expression *expr, struct tree_node *node,
+			     struct tree_node *derivative, FILE *out_stream) {
+	fprintf(out_stream, "\\begin{equation}\n");
+	fprintf(out_stream, "\\frac{d}{dx}(");
+	if (tnode_to_latex(expr, node, out_stream)) {
+		return S_FAIL;
+	}
+	fprintf(out_stream, ") = ");
+	if (tnode_to_latex(expr, derivative, out_stream)) {
+		return S_FAIL;
+	}
+	fprintf(out_stream, "\\end{equation}\n\n");
+
+	return S_OK;
+}
+
+int expression_trace_render(struct expression *expr, struct tree_node *root,
+			    struct tree_node *derivative, FILE *out_stream) {
+	assert (expr);
+	assert (root);
+	assert (derivative);
+	assert (out_stream);
+
+	struct expression_trace *trace = expr->trace;
+	if (!trace) {
+		return S_OK;
+	}
+
+	int ret = S_OK;
+	size_t omitted[EXPRESSION_TRACE_RULES] = {0};
+	size_t omitted_cnt = 0;
+	size_t max = expr->trace_max ? expr->trace_max : EXPRESSION_TRACE_MAX;
+	struct tree_node **levels = NULL;
+	size_t levels_len = 0;
+	struct tree_arena *arena = NULL;
+	struct tree_arena *prev_arena = NULL;
+
+	// Shown steps are derived again, without the memo, the trace or the caller's arena
+	struct expression step_expr = {
+		.variables = expr->variables,
+		.differentiating_variable = expr->differentiating_variable,
+	};
+
+	if (trace_top_levels(root, max, &levels, &levels_len) || tree_arena_ctor(&arena)) {
+		_CT_FAIL();
+	}
+	prev_arena = tree_arena_select(arena);
+
+	for (size_t i = 0; i < trace->len; i++) {
+		struct expression_trace_step *step = &trace->steps[i];
+
+		if (!bsearch(&step->node, levels, levels_len, sizeof(*levels), trace_node_cmp)) {
+			omitted[step->rule]++;
+			omitted_cnt++;
+			continue;
+		}
+
+		struct tree_node *node = step->node;
+		struct tree_node *step_derivative = node == root ? derivative :
+			expression_derive_tnode(&step_expr, node, expr->differentiating_variable);
+
+		if (!step_derivative) {
+			_CT_FAIL();
+		}
+
+		int rendered = trace_render_step(expr, node, step_derivative, out_stream);
+		if (step_derivative != derivative) {
+			tnode_recursive_dtor(step_derivative, NULL);
+		}
+
+		if (rendered) {
+			_CT_FAIL();
+		}
+	}
+
+	if (omitted_cnt) {
+		fprintf(out_stream, "\\noindent %zu more steps:", omitted_cnt);
+
+		for (uint32_t rule = 0; rule < EXPRESSION_TRACE_RULES; rule++) {
+			if (!omitted[rule]) {
+				continue;
+			}
+
+			if (rule == EXPRESSION_TRACE_NUMBER) {
+				fprintf(out_stream, " %zu on numbers", omitted[rule]);
+			} else if (rule == EXPRESSION_TRACE_VARIABLE) {
+				fprintf(out_stream, " %zu on variables", omitted[rule]);
+			} else {
+				fprintf(out_stream, " %zu on \\verb|%s|", omitted[rule],
+					expression_operators[rule]->name);
+			}
+		}
+		fprintf(out_stream, ".\n\n");
+	}
+
+_CT_EXIT_POINT:
+	if (arena) {
+		tree_arena_select(prev_arena);
+		tree_arena_dtor(arena);
+	}
+	free(levels);
+	expression_trace_clear(expr);
+
+	return ret;
+}
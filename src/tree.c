@@ -3,6 +3,12 @@
 #include <assert.h>
 #include <string.h>
 #include <stdint.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include "hash.h"
 #include "ctio.h"
 
@@ -13,6 +19,7 @@ DSError_t tree_ctor(struct tree *tree) {
 	assert (tree);
 
 	tree->root = NULL;
+	tree->arena = NULL;
 	
 	return DS_OK;
 }
@@ -27,223 +34,2833 @@ DSError_t tree_set_node_value_dtor(struct tree *tree,
 DSError_t tree_dtor(struct tree *tree) {
 	assert (tree);
 
-	tnode_recursive_dtor(tree->root, tree->tree_node_dtor);
+	if (tree->arena) {
+		// Value destructors still have to see every node
+		if (tree->tree_node_dtor) {
+			struct tree_arena *prev_arena = tree_arena_select(tree->arena);
+			tnode_recursive_dtor(tree->root, tree->tree_node_dtor);
+			tree_arena_select(prev_arena);
+		}
+
+		tree_arena_dtor(tree->arena);
+		tree->arena = NULL;
+	} else {
+		tnode_recursive_dtor(tree->root, tree->tree_node_dtor);
+	}
+
 	tree->root = NULL;
 	tree->tree_node_dtor = NULL;
 
-	return DS_OK;
+	return DS_OK;
+}
+
+#define TREE_ARENA_MIN_SLAB (64)
+#define TREE_ARENA_MAX_SLAB (1 << 16)
+
+struct tree_arena_slab {
+	struct tree_arena_slab *next;
+	// Nodes go back to the arena owning their slab, whichever one is selected
+	struct tree_arena *arena;
+	size_t capacity;
+	struct tree_node nodes[];
+};
+
+struct tree_arena {
+	struct tree_arena_slab *slabs;
+	size_t slab_used;
+
+	// Released nodes, linked through the left pointer
+	struct tree_node *free_list;
+
+	size_t reserved_bytes;
+	size_t used_nodes;
+
+	size_t refs;
+	int flags;
+
+	// Shared nodes of copy-on-write trees, read only
+	struct tree_arena *parent;
+	// Arenas on top of this one, while there are any the nodes are not released
+	size_t children;
+
+	// Open addressing table of interned nodes
+	struct tree_node **intern_table;
+	size_t intern_capacity;
+	size_t intern_len;
+};
+
+static _Thread_local struct tree_arena *tnode_arena = NULL;
+
+// Slabs of all arenas sorted by address, so a node can be traced to its arena
+static pthread_mutex_t tree_slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct tree_arena_slab **tree_slabs = NULL;
+static size_t tree_slabs_len = 0;
+static size_t tree_slabs_capacity = 0;
+// Changes whenever slabs come, go or move to another arena
+static size_t tree_slabs_generation = 0;
+
+// The last slab or gap between slabs tnode_owner() found on this thread
+static _Thread_local struct {
+	size_t generation;
+	uintptr_t begin;
+	uintptr_t end;
+	struct tree_arena *arena;
+} tnode_owner_hint;
+
+static int tree_slab_holds(const struct tree_arena_slab *slab, const struct tree_node *node) {
+	return (uintptr_t)node >= (uintptr_t)slab->nodes &&
+	       (uintptr_t)node < (uintptr_t)(slab->nodes + slab->capacity);
+}
+
+// The first slab past node, tree_slabs_lock is held
+static size_t tree_slabs_upper_bound(const struct tree_node *node) {
+	size_t left = 0, right = tree_slabs_len;
+
+	while (left < right) {
+		size_t mid = left + (right - left) / 2;
+
+		if ((uintptr_t)tree_slabs[mid] <= (uintptr_t)node) {
+			left = mid + 1;
+		} else {
+			right = mid;
+		}
+	}
+
+	return left;
+}
+
+static DSError_t tree_slabs_insert(struct tree_arena_slab *slab) {
+	pthread_mutex_lock(&tree_slabs_lock);
+
+	if (tree_slabs_len == tree_slabs_capacity) {
+		size_t capacity = tree_slabs_capacity ? tree_slabs_capacity * 2 : TREE_ARENA_MIN_SLAB;
+		struct tree_arena_slab **slabs = (struct tree_arena_slab **)
+			realloc(tree_slabs, capacity * sizeof(*slabs));
+
+		if (!slabs) {
+			pthread_mutex_unlock(&tree_slabs_lock);
+			return DS_ALLOCATION;
+		}
+
+		tree_slabs = slabs;
+		tree_slabs_capacity = capacity;
+	}
+
+	size_t idx = tree_slabs_upper_bound(slab->nodes);
+	memmove(tree_slabs + idx + 1, tree_slabs + idx, (tree_slabs_len - idx) * sizeof(*tree_slabs));
+	tree_slabs[idx] = slab;
+	__atomic_store_n(&tree_slabs_len, tree_slabs_len + 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&tree_slabs_generation, 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&tree_slabs_lock);
+
+	return DS_OK;
+}
+
+// tree_slabs_lock is held
+static void tree_slabs_remove(struct tree_arena_slab *slab) {
+	size_t idx = tree_slabs_upper_bound(slab->nodes);
+
+	assert (idx > 0 && tree_slabs[idx - 1] == slab);
+
+	memmove(tree_slabs + idx - 1, tree_slabs + idx, (tree_slabs_len - idx) * sizeof(*tree_slabs));
+	__atomic_store_n(&tree_slabs_len, tree_slabs_len - 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&tree_slabs_generation, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * The arena node was taken from, NULL for calloc nodes.
+ * Nodes are mostly released next to the previous one, so the slab or the gap
+ * found last is tried before the lock.
+ */
+static struct tree_arena *tnode_owner(const struct tree_node *node) {
+	uintptr_t addr = (uintptr_t)node;
+
+	if (tnode_arena && tnode_arena->slabs && tree_slab_holds(tnode_arena->slabs, node)) {
+		return tnode_arena;
+	}
+
+	if (!__atomic_load_n(&tree_slabs_len, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+
+	if (tnode_owner_hint.generation == __atomic_load_n(&tree_slabs_generation, __ATOMIC_ACQUIRE) &&
+	    addr >= tnode_owner_hint.begin && addr < tnode_owner_hint.end) {
+		return tnode_owner_hint.arena;
+	}
+
+	pthread_mutex_lock(&tree_slabs_lock);
+
+	size_t idx = tree_slabs_upper_bound(node);
+	struct tree_arena_slab *slab = idx > 0 ? tree_slabs[idx - 1] : NULL;
+
+	tnode_owner_hint.generation = tree_slabs_generation;
+	if (slab && tree_slab_holds(slab, node)) {
+		tnode_owner_hint.begin = (uintptr_t)slab->nodes;
+		tnode_owner_hint.end = (uintptr_t)(slab->nodes + slab->capacity);
+		tnode_owner_hint.arena = slab->arena;
+	} else {
+		tnode_owner_hint.begin = slab ? (uintptr_t)(slab->nodes + slab->capacity) : 0;
+		tnode_owner_hint.end = idx < tree_slabs_len ? (uintptr_t)tree_slabs[idx] : UINTPTR_MAX;
+		tnode_owner_hint.arena = NULL;
+	}
+
+	pthread_mutex_unlock(&tree_slabs_lock);
+
+	return tnode_owner_hint.arena;
+}
+
+// Nodes of shared arenas and of the ones under copy-on-write clones stay until the arena goes
+static int tree_arena_releases(struct tree_arena *arena) {
+	return !(arena->flags & TREE_ARENA_F_SHARED) &&
+	       !__atomic_load_n(&arena->children, __ATOMIC_ACQUIRE);
+}
+
+DSError_t tree_arena_ctor(struct tree_arena **arena) {
+	assert (arena);
+
+	*arena = (struct tree_arena *)calloc(1, sizeof(struct tree_arena));
+	if (!*arena) {
+		return DS_ALLOCATION;
+	}
+
+	(*arena)->refs = 1;
+
+	return DS_OK;
+}
+
+// Shared arenas may be released from several threads
+void tree_arena_dtor(struct tree_arena *arena) {
+	while (arena) {
+		assert (arena->refs > 0);
+
+		if (__atomic_sub_fetch(&arena->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+			return;
+		}
+
+		assert (tnode_arena != arena);
+
+		pthread_mutex_lock(&tree_slabs_lock);
+		for (struct tree_arena_slab *slab = arena->slabs; slab; slab = slab->next) {
+			tree_slabs_remove(slab);
+		}
+		pthread_mutex_unlock(&tree_slabs_lock);
+
+		struct tree_arena_slab *slab = arena->slabs;
+		while (slab) {
+			struct tree_arena_slab *next = slab->next;
+			free(slab);
+			slab = next;
+		}
+
+		struct tree_arena *parent = arena->parent;
+		if (parent) {
+			__atomic_sub_fetch(&parent->children, 1, __ATOMIC_ACQ_REL);
+		}
+
+		free(arena->intern_table);
+		free(arena);
+
+		arena = parent;
+	}
+}
+
+struct tree_arena *tree_arena_ref(struct tree_arena *arena) {
+	assert (arena);
+
+	__atomic_add_fetch(&arena->refs, 1, __ATOMIC_RELAXED);
+
+	return arena;
+}
+
+DSError_t tree_arena_set_flags(struct tree_arena *arena, int flags) {
+	assert (arena);
+
+	// Shared nodes can not be given back to the free list
+	if ((arena->flags & TREE_ARENA_F_SHARED) && !(flags & TREE_ARENA_F_SHARED)) {
+		return DS_INVALID_STATE;
+	}
+
+	arena->flags = flags;
+
+	return DS_OK;
+}
+
+int tree_arena_get_flags(const struct tree_arena *arena) {
+	assert (arena);
+
+	return arena->flags;
+}
+
+struct tree_arena *tree_arena_select(struct tree_arena *arena) {
+	struct tree_arena *prev_arena = tnode_arena;
+	tnode_arena = arena;
+
+	return prev_arena;
+}
+
+struct tree_arena *tree_arena_selected(void) {
+	return tnode_arena;
+}
+
+size_t tree_arena_reserved_bytes(const struct tree_arena *arena) {
+	assert (arena);
+
+	return arena->reserved_bytes;
+}
+
+size_t tree_arena_used_bytes(const struct tree_arena *arena) {
+	assert (arena);
+
+	return arena->used_nodes * sizeof(struct tree_node);
+}
+
+DSError_t tree_arena_merge(struct tree_arena *arena, struct tree_arena *other) {
+	assert (arena);
+	assert (other);
+	assert (arena != other);
+
+	if (other->intern_len || other->parent) {
+		return DS_INVALID_STATE;
+	}
+
+	if (!other->slabs) {
+		return DS_OK;
+	}
+
+	pthread_mutex_lock(&tree_slabs_lock);
+	for (struct tree_arena_slab *slab = other->slabs; slab; slab = slab->next) {
+		slab->arena = arena;
+	}
+	__atomic_add_fetch(&tree_slabs_generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tree_slabs_lock);
+
+	// The current slab of arena stays in front, so slab_used still describes it
+	if (!arena->slabs) {
+		arena->slabs = other->slabs;
+		arena->slab_used = other->slab_used;
+	} else {
+		struct tree_arena_slab *tail = other->slabs;
+		while (tail->next) {
+			tail = tail->next;
+		}
+
+		tail->next = arena->slabs->next;
+		arena->slabs->next = other->slabs;
+	}
+
+	if (other->free_list) {
+		struct tree_node *tail = other->free_list;
+		while (tail->left) {
+			tail = tail->left;
+		}
+
+		tail->left = arena->free_list;
+		arena->free_list = other->free_list;
+	}
+
+	arena->reserved_bytes += other->reserved_bytes;
+	arena->used_nodes += other->used_nodes;
+
+	other->slabs = NULL;
+	other->slab_used = 0;
+	other->free_list = NULL;
+	other->reserved_bytes = 0;
+	other->used_nodes = 0;
+
+	return DS_OK;
+}
+
+static struct tree_node *tree_arena_alloc(struct tree_arena *arena) {
+	assert (arena);
+
+	struct tree_node *node = NULL;
+
+	if (arena->free_list) {
+		node = arena->free_list;
+		arena->free_list = node->left;
+	} else {
+		struct tree_arena_slab *slab = arena->slabs;
+
+		if (!slab || arena->slab_used == slab->capacity) {
+			size_t capacity = TREE_ARENA_MIN_SLAB;
+			if (slab && slab->capacity < TREE_ARENA_MAX_SLAB) {
+				capacity = slab->capacity * 2;
+			} else if (slab) {
+				capacity = slab->capacity;
+			}
+
+			size_t slab_size = sizeof(struct tree_arena_slab) +
+				capacity * sizeof(struct tree_node);
+
+			slab = (struct tree_arena_slab *)malloc(slab_size);
+			if (!slab) {
+				return NULL;
+			}
+
+			slab->arena = arena;
+			slab->capacity = capacity;
+			if (tree_slabs_insert(slab)) {
+				free(slab);
+				return NULL;
+			}
+
+			slab->next = arena->slabs;
+			arena->slabs = slab;
+			arena->slab_used = 0;
+			arena->reserved_bytes += slab_size;
+		}
+
+		node = &slab->nodes[arena->slab_used++];
+	}
+
+	memset(node, 0, sizeof(*node));
+	arena->used_nodes++;
+
+	return node;
+}
+
+static void tree_arena_free(struct tree_arena *arena, struct tree_node *node) {
+	assert (arena);
+	assert (node);
+
+	node->left = arena->free_list;
+	arena->free_list = node;
+	arena->used_nodes--;
+}
+
+struct tree_node *tnode_ctor(void) {
+	if (tnode_arena) {
+		return tree_arena_alloc(tnode_arena);
+	}
+
+	return (struct tree_node *)
+		calloc(1, sizeof(struct tree_node));
+}
+
+void tnode_dtor(struct tree_node *node, tree_node_value_dtor vdtor) {
+	assert (node);
+
+	if (vdtor != NULL) {
+		vdtor(node);
+	}
+
+	struct tree_arena *arena = tnode_owner(node);
+	if (!arena) {
+		free(node);
+		return;
+	}
+
+	if (tree_arena_releases(arena)) {
+		tree_arena_free(arena, node);
+	}
+}
+
+static uint64_t tree_hash_mix(uint64_t hsh) {
+	hsh ^= hsh >> 30;
+	hsh *= 0xbf58476d1ce4e5b9ULL;
+	hsh ^= hsh >> 27;
+	hsh *= 0x94d049bb133111ebULL;
+	hsh ^= hsh >> 31;
+
+	return hsh;
+}
+
+static uint64_t tnode_intern_hash(const struct tree_node *node) {
+	uint64_t value_bits = 0;
+	memcpy(&value_bits, &node->value.fnum, sizeof(value_bits));
+
+	uint64_t hsh = tree_hash_mix((uint64_t)(unsigned int)node->value.flags ^ value_bits);
+	hsh = tree_hash_mix(hsh ^ (uint64_t)(uintptr_t)node->left);
+	hsh = tree_hash_mix(hsh ^ (uint64_t)(uintptr_t)node->right);
+
+	return hsh;
+}
+
+static int tnode_intern_equal(const struct tree_node *a, const struct tree_node *b) {
+	return	a->value.flags == b->value.flags &&
+		!memcmp(&a->value.fnum, &b->value.fnum, sizeof(a->value.fnum)) &&
+		a->left == b->left &&
+		a->right == b->right;
+}
+
+static struct tree_node **tree_arena_intern_slot(struct tree_arena *arena,
+						 const struct tree_node *node) {
+	assert (arena->intern_capacity);
+
+	size_t mask = arena->intern_capacity - 1;
+	size_t slot_idx = (size_t)tnode_intern_hash(node) & mask;
+
+	while (arena->intern_table[slot_idx] &&
+	       !tnode_intern_equal(arena->intern_table[slot_idx], node)) {
+		slot_idx = (slot_idx + 1) & mask;
+	}
+
+	return &arena->intern_table[slot_idx];
+}
+
+static DSError_t tree_arena_intern_grow(struct tree_arena *arena) {
+	size_t old_capacity = arena->intern_capacity;
+	struct tree_node **old_table = arena->intern_table;
+
+	size_t capacity = old_capacity ? old_capacity * 2 : TREE_ARENA_MIN_SLAB;
+	struct tree_node **table = (struct tree_node **)
+		calloc(capacity, sizeof(struct tree_node *));
+	if (!table) {
+		return DS_ALLOCATION;
+	}
+
+	arena->intern_table = table;
+	arena->intern_capacity = capacity;
+
+	for (size_t i = 0; i < old_capacity; i++) {
+		if (old_table[i]) {
+			*tree_arena_intern_slot(arena, old_table[i]) = old_table[i];
+		}
+	}
+
+	free(old_table);
+
+	return DS_OK;
+}
+
+struct tree_node *tnode_intern(struct tree_node *node) {
+	if (!node || !tnode_arena ||
+	    (tnode_arena->flags & TREE_ARENA_F_HASHCONS) != TREE_ARENA_F_HASHCONS) {
+		return node;
+	}
+
+	struct tree_arena *arena = tnode_arena;
+
+	if (2 * (arena->intern_len + 1) > arena->intern_capacity &&
+	    tree_arena_intern_grow(arena)) {
+		return NULL;
+	}
+
+	struct tree_node **slot = tree_arena_intern_slot(arena, node);
+	if (*slot) {
+		// The duplicate was never shared, so it may go back to the slab
+		if (*slot != node) {
+			tree_arena_free(arena, node);
+		}
+
+		return *slot;
+	}
+
+	*slot = node;
+	arena->intern_len++;
+
+	return node;
+}
+
+int tnode_is_interned(const struct tree_node *node) {
+	if (!node || !tnode_arena || !tnode_arena->intern_len) {
+		return 0;
+	}
+
+	return *tree_arena_intern_slot(tnode_arena, node) == node;
+}
+
+static DSError_t tree_arena_child(struct tree_arena *parent, struct tree_arena **child) {
+	DSError_t ret = tree_arena_ctor(child);
+	if (ret != DS_OK) {
+		return ret;
+	}
+
+	(*child)->parent = tree_arena_ref(parent);
+	(*child)->flags = parent->flags;
+	__atomic_add_fetch(&parent->children, 1, __ATOMIC_ACQ_REL);
+
+	return DS_OK;
+}
+
+DSError_t tree_share(struct tree *tree, struct tree *clone) {
+	assert (tree);
+	assert (clone);
+	assert (tree != clone);
+
+	if (!tree->arena || tree->tree_node_dtor) {
+		return DS_INVALID_STATE;
+	}
+
+	DSError_t ret = DS_OK;
+	struct tree_arena *shared = tree->arena;
+	struct tree_arena *clone_arena = NULL;
+
+	// An untouched clone keeps sharing its parent, so chains do not grow
+	if (shared->parent && !shared->slabs) {
+		shared = shared->parent;
+	}
+
+	if ((ret = tree_arena_child(shared, &clone_arena)) != DS_OK) {
+		return ret;
+	}
+
+	*clone = (struct tree){
+		.root = tree->root,
+		.tree_node_dtor = NULL,
+		.arena = clone_arena,
+	};
+
+	return DS_OK;
+}
+
+// Clones see the nodes of this arena, the tree moves onto one of its own before a change
+static DSError_t tree_arena_detach(struct tree *tree) {
+	if (!tree->arena || !__atomic_load_n(&tree->arena->children, __ATOMIC_ACQUIRE)) {
+		return DS_OK;
+	}
+
+	struct tree_arena *own = NULL;
+
+	DSError_t ret = tree_arena_child(tree->arena, &own);
+	if (ret != DS_OK) {
+		return ret;
+	}
+
+	tree_arena_dtor(tree->arena);
+	tree->arena = own;
+
+	return DS_OK;
+}
+
+DSError_t tree_cow_path(struct tree *tree, const uint8_t *path, size_t len,
+			struct tree_node **node) {
+	assert (tree);
+	assert (path || !len);
+	assert (node);
+
+	DSError_t ret = tree_arena_detach(tree);
+	if (ret != DS_OK) {
+		return ret;
+	}
+
+	struct tree_node **slot = &tree->root;
+	struct tree_arena *prev_arena = tree_arena_select(tree->arena);
+
+	for (size_t depth = 0; ; depth++) {
+		if (!*slot) {
+			_CT_CHECKED(DS_INVALID_ARG);
+		}
+
+		if (tree->arena && tree->arena->parent && tnode_owner(*slot) != tree->arena) {
+			struct tree_node *copy = tnode_ctor();
+			if (!copy) {
+				_CT_CHECKED(DS_ALLOCATION);
+			}
+
+			*copy = **slot;
+			*slot = copy;
+		}
+
+		// The caller is going to change the subtree
+		(*slot)->value.hash = 0;
+
+		if (depth == len) {
+			break;
+		}
+
+		slot = path[depth] ? &(*slot)->right : &(*slot)->left;
+	}
+
+	*node = *slot;
+
+_CT_EXIT_POINT:
+	tree_arena_select(prev_arena);
+
+	return ret;
+}
+
+static void tnode_shared_vdtor(struct tree_node *node, tree_node_value_dtor vdtor);
+
+static int tnode_releases(const struct tree_node *node) {
+	struct tree_arena *arena = tnode_owner(node);
+
+	return !arena || tree_arena_releases(arena);
+}
+
+void tnode_recursive_dtor(struct tree_node *node, tree_node_value_dtor vdtor) {
+
+	if (!node) {
+		return;
+	}
+
+	// Shared nodes live until the arena is released
+	if (!tnode_releases(node)) {
+		if (vdtor) {
+			tnode_shared_vdtor(node, vdtor);
+		}
+		return;
+	}
+
+	// Rotates left subtrees up, so no stack is needed at all.
+	// Only released nodes are rotated, shared subtrees are cut off instead
+	while (node) {
+		struct tree_node *left = node->left;
+
+		if (left && !tnode_releases(left)) {
+			if (vdtor) {
+				tnode_shared_vdtor(left, vdtor);
+			}
+			node->left = left = NULL;
+		}
+
+		if (left) {
+			node->left = left->right;
+			left->right = node;
+			node = left;
+			continue;
+		}
+
+		struct tree_node *right = node->right;
+		if (right && !tnode_releases(right)) {
+			if (vdtor) {
+				tnode_shared_vdtor(right, vdtor);
+			}
+			right = NULL;
+		}
+
+		tnode_dtor(node, vdtor);
+		node = right;
+	}
+}
+
+static DSError_t tree_walker_reserve(void **buffer, size_t *capacity,
+				     void *inline_buffer, size_t el_size) {
+	size_t new_capacity = *capacity * 2;
+
+	void *new_buffer = NULL;
+	if (*buffer == inline_buffer) {
+		new_buffer = malloc(new_capacity * el_size);
+		if (new_buffer) {
+			memcpy(new_buffer, *buffer, *capacity * el_size);
+		}
+	} else {
+		new_buffer = realloc(*buffer, new_capacity * el_size);
+	}
+
+	if (!new_buffer) {
+		return DS_ALLOCATION;
+	}
+
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+
+	return DS_OK;
+}
+
+static DSError_t tree_walker_enter(struct tree_walker *walker, struct tree_node *node) {
+	if (walker->depth == walker->frames_capacity &&
+	    tree_walker_reserve((void **)&walker->frames, &walker->frames_capacity,
+				walker->inline_frames, sizeof(struct tree_walk_frame))) {
+		return DS_ALLOCATION;
+	}
+
+	walker->frames[walker->depth++] = (struct tree_walk_frame) {
+		.node = node,
+		.state = 0,
+	};
+
+	return DS_OK;
+}
+
+DSError_t tree_walker_ctor(struct tree_walker *walker, struct tree_node *root,
+			   int events) {
+	assert (walker);
+
+	walker->events = events;
+
+	walker->frames = walker->inline_frames;
+	walker->depth = 0;
+	walker->frames_capacity = TREE_WALKER_INLINE_DEPTH;
+
+	walker->values = walker->inline_values;
+	walker->values_len = 0;
+	walker->values_capacity = TREE_WALKER_INLINE_DEPTH;
+
+	if (root) {
+		return tree_walker_enter(walker, root);
+	}
+
+	return DS_OK;
+}
+
+void tree_walker_dtor(struct tree_walker *walker) {
+	assert (walker);
+
+	if (walker->frames != walker->inline_frames) {
+		free(walker->frames);
+	}
+	if (walker->values != walker->inline_values) {
+		free(walker->values);
+	}
+
+	walker->frames = NULL;
+	walker->values = NULL;
+	walker->depth = 0;
+	walker->values_len = 0;
+}
+
+enum {
+	TREE_WALK_S_PRE,
+	TREE_WALK_S_LEFT,
+	TREE_WALK_S_IN,
+	TREE_WALK_S_RIGHT,
+	TREE_WALK_S_POST,
+	TREE_WALK_S_DONE,
+};
+
+enum tree_walk_event tree_walker_next(struct tree_walker *walker, struct tree_node **node) {
+	assert (walker);
+	assert (node);
+
+	// Events nobody asked for fall through to the next state in place
+	while (walker->depth) {
+		struct tree_walk_frame *frame = &walker->frames[walker->depth - 1];
+		struct tree_node *cur = frame->node;
+
+		switch (frame->state) {
+			case TREE_WALK_S_PRE:
+				frame->state = TREE_WALK_S_LEFT;
+				if (walker->events & TREE_WALK_F_PRE) {
+					*node = cur;
+					return TREE_WALK_PRE;
+				}
+				/* fall through */
+			case TREE_WALK_S_LEFT:
+				frame->state = TREE_WALK_S_IN;
+				if (cur->left) {
+					if (tree_walker_enter(walker, cur->left)) {
+						return TREE_WALK_ERROR;
+					}
+					break;
+				}
+				/* fall through */
+			case TREE_WALK_S_IN:
+				frame->state = TREE_WALK_S_RIGHT;
+				if (walker->events & TREE_WALK_F_IN) {
+					*node = cur;
+					return TREE_WALK_IN;
+				}
+				/* fall through */
+			case TREE_WALK_S_RIGHT:
+				frame->state = TREE_WALK_S_POST;
+				if (cur->right) {
+					if (tree_walker_enter(walker, cur->right)) {
+						return TREE_WALK_ERROR;
+					}
+					break;
+				}
+				/* fall through */
+			case TREE_WALK_S_POST:
+				// The frame stays until the next call, so the parent is known
+				frame->state = TREE_WALK_S_DONE;
+				if (walker->events & TREE_WALK_F_POST) {
+					*node = cur;
+					return TREE_WALK_POST;
+				}
+				/* fall through */
+			case TREE_WALK_S_DONE:
+			default:
+				walker->depth--;
+				break;
+		}
+	}
+
+	*node = NULL;
+
+	return TREE_WALK_END;
+}
+
+void tree_walker_skip(struct tree_walker *walker) {
+	assert (walker);
+	assert (walker->depth);
+
+	walker->frames[walker->depth - 1].state = TREE_WALK_S_DONE;
+}
+
+struct tree_node *tree_walker_parent(const struct tree_walker *walker) {
+	assert (walker);
+
+	if (walker->depth < 2) {
+		return NULL;
+	}
+
+	return walker->frames[walker->depth - 2].node;
+}
+
+DSError_t tree_walker_grow_values(struct tree_walker *walker) {
+	assert (walker);
+
+	return tree_walker_reserve((void **)&walker->values, &walker->values_capacity,
+				   walker->inline_values, sizeof(tree_dtype));
+}
+
+DSError_t tree_walk(struct tree_node *root, enum tree_walk_event order,
+		    tree_walk_visitor visitor, void *ctx) {
+	assert (visitor);
+
+	DSError_t ret = DS_OK;
+	struct tree_walker walker;
+
+	if ((ret = tree_walker_ctor(&walker, root, 1 << order)) != DS_OK) {
+		return ret;
+	}
+
+	struct tree_node *node = NULL;
+	enum tree_walk_event event = TREE_WALK_END;
+
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			ret = DS_ALLOCATION;
+			break;
+		}
+
+		if (event == order && (ret = visitor(node, ctx)) != DS_OK) {
+			break;
+		}
+	}
+
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+struct tnode_map_entry {
+	struct tree_node *node;
+	size_t idx;
+	size_t refs;
+	// Where the node went, see tree_unshare()
+	struct tree_node *copy;
+};
+
+// Pointer keyed table for walks over shared nodes
+struct tnode_map {
+	struct tnode_map_entry *entries;
+	size_t capacity;
+	size_t len;
+};
+
+static void tnode_map_dtor(struct tnode_map *map) {
+	assert (map);
+
+	free(map->entries);
+	*map = (struct tnode_map){0};
+}
+
+static struct tnode_map_entry *tnode_map_slot(struct tnode_map *map,
+					      const struct tree_node *node) {
+	assert (map->capacity);
+
+	size_t mask = map->capacity - 1;
+	size_t slot_idx = (size_t)tree_hash_mix((uint64_t)(uintptr_t)node) & mask;
+
+	while (map->entries[slot_idx].node && map->entries[slot_idx].node != node) {
+		slot_idx = (slot_idx + 1) & mask;
+	}
+
+	return &map->entries[slot_idx];
+}
+
+static struct tnode_map_entry *tnode_map_find(struct tnode_map *map,
+					      const struct tree_node *node) {
+	assert (map);
+
+	if (!map->len) {
+		return NULL;
+	}
+
+	struct tnode_map_entry *entry = tnode_map_slot(map, node);
+
+	return entry->node ? entry : NULL;
+}
+
+static struct tnode_map_entry *tnode_map_insert(struct tnode_map *map,
+						struct tree_node *node) {
+	assert (map);
+	assert (node);
+
+	if (2 * (map->len + 1) > map->capacity) {
+		struct tnode_map old_map = *map;
+
+		map->capacity = old_map.capacity ? old_map.capacity * 2 : TREE_ARENA_MIN_SLAB;
+		map->entries = (struct tnode_map_entry *)
+			calloc(map->capacity, sizeof(struct tnode_map_entry));
+		if (!map->entries) {
+			*map = old_map;
+			return NULL;
+		}
+
+		for (size_t i = 0; i < old_map.capacity; i++) {
+			if (old_map.entries[i].node) {
+				*tnode_map_slot(map, old_map.entries[i].node) = old_map.entries[i];
+			}
+		}
+
+		tnode_map_dtor(&old_map);
+	}
+
+	struct tnode_map_entry *entry = tnode_map_slot(map, node);
+	if (!entry->node) {
+		entry->node = node;
+		map->len++;
+	}
+
+	return entry;
+}
+
+static DSError_t tnode_count_refs(struct tree_node *node, struct tnode_map *refs) {
+	assert (refs);
+
+	DSError_t ret = DS_OK;
+	struct tree_walker walker;
+
+	if ((ret = tree_walker_ctor(&walker, node, TREE_WALK_F_PRE)) != DS_OK) {
+		return ret;
+	}
+
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			ret = DS_ALLOCATION;
+			break;
+		}
+
+		struct tnode_map_entry *entry = tnode_map_insert(refs, node);
+		if (!entry) {
+			ret = DS_ALLOCATION;
+			break;
+		}
+
+		if (entry->refs++ > 0) {
+			tree_walker_skip(&walker);
+		}
+	}
+
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+// Every node once, value destructors of shared nodes run when their tree goes
+static void tnode_shared_vdtor(struct tree_node *node, tree_node_value_dtor vdtor) {
+	struct tnode_map nodes = {0};
+
+	if (tnode_count_refs(node, &nodes) == DS_OK) {
+		for (size_t i = 0; i < nodes.capacity; i++) {
+			if (nodes.entries[i].node) {
+				vdtor(nodes.entries[i].node);
+			}
+		}
+	}
+
+	tnode_map_dtor(&nodes);
+}
+
+DSError_t tree_unshare(struct tree *tree) {
+	assert (tree);
+
+	DSError_t ret = tree_arena_detach(tree);
+	if (ret != DS_OK || !tree->root || !tree->arena || !tree->arena->parent) {
+		return ret;
+	}
+
+	struct tnode_map copies = {0};
+	struct tree_node *node = NULL;
+	struct tree_walker walker;
+	struct tree_arena *prev_arena = tree_arena_select(tree->arena);
+
+	ret = tree_walker_ctor(&walker, tree->root, TREE_WALK_F_PRE | TREE_WALK_F_POST);
+	if (ret != DS_OK) {
+		tree_arena_select(prev_arena);
+		return ret;
+	}
+
+	// Children are rebuilt first, a node reachable twice is copied once
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		struct tnode_map_entry *entry = tnode_map_find(&copies, node);
+
+		if (event == TREE_WALK_PRE) {
+			if (entry) {
+				tree_walker_skip(&walker);
+				_CT_CHECKED(tree_walker_push(&walker, (tree_dtype){ .ptr = entry->copy }));
+			}
+			continue;
+		}
+
+		struct tree_node *right = node->right ? tree_walker_pop(&walker).ptr : NULL;
+		struct tree_node *left = node->left ? tree_walker_pop(&walker).ptr : NULL;
+		struct tree_node *copy = node;
+
+		// Shapes do not change, so the copies keep their hashes
+		if (tnode_owner(node) != tree->arena) {
+			copy = tnode_ctor();
+			if (!copy) {
+				_CT_CHECKED(DS_ALLOCATION);
+			}
+			*copy = *node;
+		}
+		copy->left = left;
+		copy->right = right;
+
+		if (!(entry = tnode_map_insert(&copies, node))) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+		entry->copy = copy;
+
+		_CT_CHECKED(tree_walker_push(&walker, (tree_dtype){ .ptr = copy }));
+	}
+
+	tree->root = tree_walker_pop(&walker).ptr;
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+	tnode_map_dtor(&copies);
+	tree_arena_select(prev_arena);
+
+	return ret;
+}
+
+/*
+ * A node reachable through several parents is written once as
+ * @<label>("value" left right) and referenced later as #<label>.
+ */
+static DSError_t tree_serialize_shared(struct tree_node *node, FILE *file,
+				       value_serializer serializer,
+				       struct tnode_map *shared, size_t *labels_cnt) {
+	assert (file);
+
+	DSError_t ret = DS_OK;
+
+	if (!node) {
+		if (fprintf(file, "nil") < 0) {
+			return DS_ALLOCATION;
+		}
+
+		return DS_OK;
+	}
+
+	struct tree_walker walker;
+	if ((ret = tree_walker_ctor(&walker, node, TREE_WALK_F_ALL)) != DS_OK) {
+		return ret;
+	}
+
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		if (event == TREE_WALK_IN) {
+			if (fputc(' ', file) == EOF) {
+				_CT_CHECKED(DS_ALLOCATION);
+			}
+
+			if (!node->right && fprintf(file, "nil") < 0) {
+				_CT_CHECKED(DS_ALLOCATION);
+			}
+
+			continue;
+		}
+
+		if (event == TREE_WALK_POST) {
+			if (fputc(')', file) == EOF) {
+				_CT_CHECKED(DS_ALLOCATION);
+			}
+
+			continue;
+		}
+
+		if (shared) {
+			struct tnode_map_entry *entry = tnode_map_find(shared, node);
+			assert (entry);
+
+			if (entry->refs > 1) {
+				if (entry->idx) {
+					if (fprintf(file, "#%zu", entry->idx - 1) < 0)
+						_CT_CHECKED(DS_ALLOCATION);
+
+					tree_walker_skip(&walker);
+					continue;
+				}
+
+				entry->idx = ++(*labels_cnt);
+				if (fprintf(file, "@%zu", entry->idx - 1) < 0)
+					_CT_CHECKED(DS_ALLOCATION);
+			}
+		}
+
+		if (fprintf(file, "(\"") < 0)
+			_CT_CHECKED(DS_ALLOCATION);
+
+		_CT_CHECKED(serializer(node->value, file));
+
+		if (fprintf(file, "\" ") < 0)
+			_CT_CHECKED(DS_ALLOCATION);
+
+		if (!node->left && fprintf(file, "nil") < 0) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+	}
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+DSError_t tree_store(struct tree *tree, const char *filename, value_serializer serializer) {
+	assert (tree);
+	assert (filename);
+
+	struct tnode_map shared = {0};
+	int is_shared = tree->arena &&
+		(tree_arena_get_flags(tree->arena) & TREE_ARENA_F_SHARED);
+
+	if (is_shared && tnode_count_refs(tree->root, &shared)) {
+		tnode_map_dtor(&shared);
+		return DS_ALLOCATION;
+	}
+
+	FILE *file = fopen(filename, "w");
+	if (!file) {
+		tnode_map_dtor(&shared);
+		return DS_INVALID_ARG;
+	}
+
+	size_t labels_cnt = 0;
+	DSError_t result = tree_serialize_shared(tree->root, file, serializer,
+						 is_shared ? &shared : NULL, &labels_cnt);
+	fclose(file);
+	tnode_map_dtor(&shared);
+
+	return result;
+}
+
+DSError_t tree_serialize_node(struct tree_node *node, FILE *file, value_serializer serializer) {
+	assert (file);
+
+	return tree_serialize_shared(node, file, serializer, NULL, NULL);
+}
+
+DSError_t tree_compact_ctor(struct tree_compact *compact) {
+	assert (compact);
+
+	*compact = (struct tree_compact){0};
+
+	return DS_OK;
+}
+
+DSError_t tree_compact_dtor(struct tree_compact *compact) {
+	assert (compact);
+
+	free(compact->nodes);
+	*compact = (struct tree_compact){0};
+
+	return DS_OK;
+}
+
+static DSError_t tree_buffer_reserve(void **buffer, size_t *capacity,
+				     size_t needed, size_t el_size) {
+	if (needed <= *capacity) {
+		return DS_OK;
+	}
+
+	size_t new_capacity = *capacity ? *capacity : TREE_ARENA_MIN_SLAB;
+	while (new_capacity < needed) {
+		new_capacity *= 2;
+	}
+
+	void *new_buffer = realloc(*buffer, new_capacity * el_size);
+	if (!new_buffer) {
+		return DS_ALLOCATION;
+	}
+
+	*buffer = new_buffer;
+	*capacity = new_capacity;
+
+	return DS_OK;
+}
+
+int tnode_hash_enabled(void) {
+	return tnode_arena && (tnode_arena->flags & TREE_ARENA_F_MERKLE);
+}
+
+uint32_t tnode_hash_combine(uint64_t value_hash, const struct tree_node *left,
+			    const struct tree_node *right) {
+	if ((left && !left->value.hash) || (right && !right->value.hash)) {
+		return 0;
+	}
+
+	uint64_t hsh = tree_hash_mix(value_hash);
+	hsh = tree_hash_mix(hsh ^ (left ? left->value.hash : 0x9e3779b9u));
+	hsh = tree_hash_mix(hsh + (right ? right->value.hash : 0x7f4a7c15u));
+
+	// 0 is kept for nodes without a hash
+	uint32_t folded = (uint32_t)(hsh ^ (hsh >> 32));
+	return folded ? folded : 1;
+}
+
+DSError_t tnode_hash(struct tree_node *root, value_hasher hasher) {
+	assert (hasher);
+
+	if (!root || root->value.hash) {
+		return DS_OK;
+	}
+
+	DSError_t ret = DS_OK;
+	struct tree_walker walker;
+	if ((ret = tree_walker_ctor(&walker, root, TREE_WALK_F_PRE | TREE_WALK_F_POST)) != DS_OK) {
+		return ret;
+	}
+
+	struct tree_node *node = NULL;
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		if (event == TREE_WALK_PRE) {
+			if (node->value.hash) {
+				tree_walker_skip(&walker);
+			}
+			continue;
+		}
+
+		node->value.hash = tnode_hash_combine(hasher(node->value), node->left, node->right);
+	}
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+
+	return ret;
+}
+
+struct tnode_pair {
+	const struct tree_node *a;
+	const struct tree_node *b;
+};
+
+#define TNODE_EQUAL_INLINE_DEPTH (64)
+
+int tnode_equal(const struct tree_node *a, const struct tree_node *b,
+		value_comparator comparator) {
+	struct tnode_pair inline_stack[TNODE_EQUAL_INLINE_DEPTH];
+	struct tnode_pair *stack = inline_stack, *heap_stack = NULL;
+	size_t stack_len = 0, heap_capacity = 0;
+	int equal = 1;
+
+	stack[stack_len++] = (struct tnode_pair){ a, b };
+
+	while (stack_len && equal) {
+		struct tnode_pair pair = stack[--stack_len];
+
+		if (pair.a == pair.b) {
+			continue;
+		}
+
+		if (!pair.a || !pair.b ||
+		    (pair.a->value.hash && pair.b->value.hash && pair.a->value.hash != pair.b->value.hash) ||
+		    !pair.a->left != !pair.b->left || !pair.a->right != !pair.b->right) {
+			equal = 0;
+			break;
+		}
+
+		if (comparator) {
+			equal = comparator(pair.a->value, pair.b->value);
+		} else {
+			equal = pair.a->value.flags == pair.b->value.flags &&
+				!memcmp(&pair.a->value.fnum, &pair.b->value.fnum, sizeof(pair.a->value.fnum));
+		}
+
+		if (!equal) {
+			break;
+		}
+
+		if (stack != inline_stack || stack_len + 2 > TNODE_EQUAL_INLINE_DEPTH) {
+			if (tree_buffer_reserve((void **)&heap_stack, &heap_capacity,
+						stack_len + 2, sizeof(*heap_stack))) {
+				equal = -1;
+				break;
+			}
+
+			if (stack == inline_stack) {
+				memcpy(heap_stack, inline_stack, stack_len * sizeof(*heap_stack));
+			}
+			stack = heap_stack;
+		}
+
+		stack[stack_len++] = (struct tnode_pair){ pair.a->right, pair.b->right };
+		stack[stack_len++] = (struct tnode_pair){ pair.a->left, pair.b->left };
+	}
+
+	free(heap_stack);
+
+	return equal;
+}
+
+static DSError_t tree_compact_append(struct tree_compact *compact,
+				     const struct tree_node *node,
+				     uint32_t left, uint32_t right) {
+	if (compact->len >= TREE_CNODE_NIL ||
+	    ((unsigned int)node->value.flags & ~TREE_CNODE_FLAGS_MASK)) {
+		return DS_INVALID_ARG;
+	}
+
+	DSError_t ret = tree_buffer_reserve((void **)&compact->nodes, &compact->capacity,
+					    compact->len + 1, sizeof(struct tree_cnode));
+	if (ret != DS_OK) {
+		return ret;
+	}
+
+	struct tree_cnode *cnode = &compact->nodes[compact->len++];
+	cnode->left = left | ((uint32_t)node->value.flags << TREE_CNODE_INDEX_BITS);
+	cnode->right = right;
+	memcpy(&cnode->fnum, &node->value.fnum, sizeof(cnode->fnum));
+
+	return DS_OK;
+}
+
+DSError_t tree_compact_from_node(struct tree_compact *compact, struct tree_node *root) {
+	assert (compact);
+
+	compact->len = 0;
+
+	if (!root) {
+		return DS_OK;
+	}
+
+	DSError_t ret = DS_OK;
+	struct tnode_map stored = {0};
+	struct tree_walker walker;
+
+	if ((ret = tree_walker_ctor(&walker, root, TREE_WALK_F_PRE | TREE_WALK_F_POST)) != DS_OK) {
+		return ret;
+	}
+
+	struct tree_node *node = NULL;
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		// Children indices go through the value stack
+		if (event == TREE_WALK_PRE) {
+			struct tnode_map_entry *entry = tnode_map_find(&stored, node);
+			if (entry) {
+				tree_walker_skip(&walker);
+				_CT_CHECKED(tree_walker_push(&walker, (tree_dtype){ .varidx = entry->idx }));
+			}
+
+			continue;
+		}
+
+		uint32_t left = TREE_CNODE_NIL, right = TREE_CNODE_NIL;
+		if (node->right) {
+			right = (uint32_t)tree_walker_pop(&walker).varidx;
+		}
+		if (node->left) {
+			left = (uint32_t)tree_walker_pop(&walker).varidx;
+		}
+
+		_CT_CHECKED(tree_compact_append(compact, node, left, right));
+
+		struct tnode_map_entry *entry = tnode_map_insert(&stored, node);
+		if (!entry) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		entry->idx = compact->len - 1;
+		_CT_CHECKED(tree_walker_push(&walker, (tree_dtype){ .varidx = entry->idx }));
+	}
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+	tnode_map_dtor(&stored);
+
+	if (ret != DS_OK) {
+		compact->len = 0;
+	}
+
+	return ret;
+}
+
+struct tree_compact_slot {
+	size_t idx;
+	struct tree_node **slot;
+};
+
+DSError_t tree_compact_to_node(const struct tree_compact *compact, struct tree_node **root) {
+	assert (compact);
+	assert (root);
+
+	*root = NULL;
+
+	if (!compact->len) {
+		return DS_OK;
+	}
+
+	DSError_t ret = DS_OK;
+	int shared = tnode_arena && (tnode_arena->flags & TREE_ARENA_F_SHARED);
+
+	struct tree_node **built = NULL;
+	struct tree_compact_slot *stack = NULL;
+	size_t stack_len = 0, stack_capacity = 0;
+
+	if (shared) {
+		built = (struct tree_node **)calloc(compact->len, sizeof(*built));
+		if (!built) {
+			return DS_ALLOCATION;
+		}
+	}
+
+	_CT_CHECKED(tree_buffer_reserve((void **)&stack, &stack_capacity, 1, sizeof(*stack)));
+	stack[stack_len++] = (struct tree_compact_slot){ compact->len - 1, root };
+
+	// Top-down, so a half built tree is always reachable from the root
+	while (stack_len) {
+		struct tree_compact_slot top = stack[--stack_len];
+
+		if (built && built[top.idx]) {
+			*top.slot = built[top.idx];
+			continue;
+		}
+
+		const struct tree_cnode *cnode = &compact->nodes[top.idx];
+
+		struct tree_node *node = tnode_ctor();
+		if (!node) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		node->value.flags = tree_cnode_flags(cnode);
+		memcpy(&node->value.fnum, &cnode->fnum, sizeof(cnode->fnum));
+
+		*top.slot = node;
+		if (built) {
+			built[top.idx] = node;
+		}
+
+		_CT_CHECKED(tree_buffer_reserve((void **)&stack, &stack_capacity,
+						stack_len + 2, sizeof(*stack)));
+
+		if (tree_cnode_right(cnode) != TREE_CNODE_NIL) {
+			stack[stack_len++] = (struct tree_compact_slot){
+				tree_cnode_right(cnode), &node->right };
+		}
+		if (tree_cnode_left(cnode) != TREE_CNODE_NIL) {
+			stack[stack_len++] = (struct tree_compact_slot){
+				tree_cnode_left(cnode), &node->left };
+		}
+	}
+
+_CT_EXIT_POINT:
+	free(stack);
+	free(built);
+
+	if (ret != DS_OK) {
+		tnode_recursive_dtor(*root, NULL);
+		*root = NULL;
+	}
+
+	return ret;
+}
+
+DSError_t tree_compact_copy(const struct tree_compact *src, struct tree_compact *dst) {
+	assert (src);
+	assert (dst);
+
+	dst->len = 0;
+
+	if (!src->len) {
+		return DS_OK;
+	}
+
+	DSError_t ret = tree_buffer_reserve((void **)&dst->nodes, &dst->capacity,
+					    src->len, sizeof(struct tree_cnode));
+	if (ret != DS_OK) {
+		return ret;
+	}
+
+	memcpy(dst->nodes, src->nodes, src->len * sizeof(struct tree_cnode));
+	dst->len = src->len;
+
+	return DS_OK;
+}
+
+// Pending output of the serializer: a node index shifted by two with the kind in low bits
+enum tree_compact_item {
+	TREE_CITEM_NODE,
+	TREE_CITEM_NIL,
+	TREE_CITEM_SPACE,
+	TREE_CITEM_CLOSE,
+};
+
+struct tree_compact_label {
+	uint32_t refs;
+	uint32_t label;
+};
+
+static DSError_t tree_cnode_value(const struct tree_cnode *cnode,
+				  const struct tree_mapped *mapped, tree_dtype *value) {
+	value->flags = tree_cnode_flags(cnode);
+	memcpy(&value->fnum, &cnode->fnum, sizeof(cnode->fnum));
+
+	if (mapped && mapped->codec->value_kind(value->flags) == TREE_BIN_VALUE_SYMBOL) {
+		if (cnode->varidx >= mapped->symbols_cnt) {
+			return DS_INVALID_ARG;
+		}
+
+		value->ptr = (void *)(uintptr_t)mapped->symbols[cnode->varidx];
+	}
+
+	return DS_OK;
+}
+
+/*
+ * Writes the same text as tree_store(), nodes with several parents are labeled.
+ * Symbol values are looked up in mapped, if there is one.
+ */
+static DSError_t tree_cnodes_serialize(const struct tree_cnode *nodes, size_t len,
+				       const struct tree_mapped *mapped, FILE *file,
+				       value_serializer serializer) {
+	if (!len) {
+		return fprintf(file, "nil") < 0 ? DS_ALLOCATION : DS_OK;
+	}
+
+	DSError_t ret = DS_OK;
+	size_t *stack = NULL;
+	size_t stack_len = 0, stack_capacity = 0;
+	uint32_t labels_cnt = 0;
+
+	struct tree_compact_label *labels = (struct tree_compact_label *)
+		calloc(len, sizeof(*labels));
+	if (!labels) {
+		return DS_ALLOCATION;
+	}
+
+	// Children must precede parents, mapped files are not trusted
+	for (size_t i = 0; i < len; i++) {
+		uint32_t left = tree_cnode_left(&nodes[i]), right = tree_cnode_right(&nodes[i]);
+
+		if ((left != TREE_CNODE_NIL && left >= i) || (right != TREE_CNODE_NIL && right >= i)) {
+			_CT_CHECKED(DS_INVALID_ARG);
+		}
+
+		if (left != TREE_CNODE_NIL) {
+			labels[left].refs++;
+		}
+		if (right != TREE_CNODE_NIL) {
+			labels[right].refs++;
+		}
+	}
+
+	_CT_CHECKED(tree_buffer_reserve((void **)&stack, &stack_capacity, 1, sizeof(*stack)));
+	stack[stack_len++] = (len - 1) << 2 | TREE_CITEM_NODE;
+
+	while (stack_len) {
+		size_t item = stack[--stack_len];
+		size_t idx = item >> 2;
+
+		switch ((enum tree_compact_item)(item & 0x3)) {
+			case TREE_CITEM_NIL:
+				if (fprintf(file, "nil") < 0)
+					_CT_CHECKED(DS_ALLOCATION);
+				continue;
+			case TREE_CITEM_SPACE:
+				if (fputc(' ', file) == EOF)
+					_CT_CHECKED(DS_ALLOCATION);
+				continue;
+			case TREE_CITEM_CLOSE:
+				if (fputc(')', file) == EOF)
+					_CT_CHECKED(DS_ALLOCATION);
+				continue;
+			case TREE_CITEM_NODE:
+			default:
+				break;
+		}
+
+		const struct tree_cnode *cnode = &nodes[idx];
+
+		if (labels[idx].refs > 1) {
+			if (labels[idx].label) {
+				if (fprintf(file, "#%u", labels[idx].label - 1) < 0)
+					_CT_CHECKED(DS_ALLOCATION);
+				continue;
+			}
+
+			labels[idx].label = ++labels_cnt;
+			if (fprintf(file, "@%u", labels[idx].label - 1) < 0)
+				_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		tree_dtype value = {0};
+		_CT_CHECKED(tree_cnode_value(cnode, mapped, &value));
+
+		if (fprintf(file, "(\"") < 0)
+			_CT_CHECKED(DS_ALLOCATION);
+
+		_CT_CHECKED(serializer(value, file));
+
+		if (fprintf(file, "\" ") < 0)
+			_CT_CHECKED(DS_ALLOCATION);
+
+		_CT_CHECKED(tree_buffer_reserve((void **)&stack, &stack_capacity,
+						stack_len + 4, sizeof(*stack)));
+
+		uint32_t left = tree_cnode_left(cnode), right = tree_cnode_right(cnode);
+
+		stack[stack_len++] = TREE_CITEM_CLOSE;
+		stack[stack_len++] = right == TREE_CNODE_NIL ? TREE_CITEM_NIL :
+				     (size_t)right << 2 | TREE_CITEM_NODE;
+		stack[stack_len++] = TREE_CITEM_SPACE;
+		stack[stack_len++] = left == TREE_CNODE_NIL ? TREE_CITEM_NIL :
+				     (size_t)left << 2 | TREE_CITEM_NODE;
+	}
+
+_CT_EXIT_POINT:
+	free(stack);
+	free(labels);
+
+	return ret;
+}
+
+DSError_t tree_compact_serialize(const struct tree_compact *compact, FILE *file,
+				 value_serializer serializer) {
+	assert (compact);
+	assert (file);
+	assert (serializer);
+
+	return tree_cnodes_serialize(compact->nodes, compact->len, NULL, file, serializer);
+}
+
+DSError_t tnode_freeze(struct tree_node *root, struct tree_frozen *frozen) {
+	assert (frozen);
+
+	*frozen = (struct tree_frozen){0};
+
+	if (!root) {
+		return DS_OK;
+	}
+
+	DSError_t ret = DS_OK;
+	size_t capacity = 0, stack_len = 0;
+	struct tree_walker walker;
+
+	if ((ret = tree_walker_ctor(&walker, root, TREE_WALK_F_POST)) != DS_OK) {
+		return ret;
+	}
+
+	struct tree_node *node = NULL;
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		if (frozen->len >= UINT32_MAX ||
+		    node->value.flags < 0 || node->value.flags > UINT16_MAX) {
+			_CT_CHECKED(DS_INVALID_ARG);
+		}
+
+		_CT_CHECKED(tree_buffer_reserve((void **)&frozen->nodes, &capacity,
+						frozen->len + 1, sizeof(struct tree_fnode)));
+
+		struct tree_fnode *fnode = &frozen->nodes[frozen->len++];
+		*fnode = (struct tree_fnode){ .size = 1, .flags = (uint16_t)node->value.flags };
+		memcpy(&fnode->fnum, &node->value.fnum, sizeof(fnode->fnum));
+
+		// Children sizes are on the value stack
+		if (node->right) {
+			fnode->children |= TREE_FNODE_RIGHT;
+			fnode->size += (uint32_t)tree_walker_pop(&walker).varidx;
+			stack_len--;
+		}
+		if (node->left) {
+			fnode->children |= TREE_FNODE_LEFT;
+			fnode->size += (uint32_t)tree_walker_pop(&walker).varidx;
+			stack_len--;
+		}
+
+		_CT_CHECKED(tree_walker_push(&walker, (tree_dtype){ .varidx = fnode->size }));
+
+		if (++stack_len > frozen->stack_depth) {
+			frozen->stack_depth = stack_len;
+		}
+	}
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+
+	if (ret != DS_OK) {
+		tree_frozen_dtor(frozen);
+	}
+
+	return ret;
+}
+
+DSError_t tree_freeze(const struct tree *tree, struct tree_frozen *frozen) {
+	assert (tree);
+	assert (frozen);
+
+	return tnode_freeze(tree->root, frozen);
+}
+
+DSError_t tree_frozen_dtor(struct tree_frozen *frozen) {
+	assert (frozen);
+
+	free(frozen->nodes);
+	*frozen = (struct tree_frozen){0};
+
+	return DS_OK;
+}
+
+uint64_t tree_frozen_hash(const struct tree_frozen *frozen) {
+	assert (frozen);
+
+	// Post-order with the children bits is unambiguous, so a plain fold will do
+	uint64_t hsh = tree_hash_mix(frozen->len);
+
+	for (size_t i = 0; i < frozen->len; i++) {
+		const struct tree_fnode *fnode = &frozen->nodes[i];
+		uint64_t value_bits = 0;
+		memcpy(&value_bits, &fnode->fnum, sizeof(value_bits));
+
+		hsh = tree_hash_mix(hsh ^ ((uint64_t)fnode->flags << 16 | fnode->children));
+		hsh = tree_hash_mix(hsh ^ value_bits);
+	}
+
+	return hsh;
+}
+
+struct tnode_labels {
+	struct tree_node **nodes;
+	size_t len;
+	size_t capacity;
+};
+
+// The buffer is null-terminated, read_size does not count the terminator
+static DSError_t tree_read_file(const char *filename, char **buffer, size_t *read_size) {
+	FILE *file = fopen(filename, "rb");
+	if (!file) {
+		return DS_INVALID_ARG;
+	}
+
+	ssize_t file_size = get_file_size(file);
+
+	if (file_size <= 0) {
+		fclose(file);
+		return DS_INVALID_ARG;
+	}
+
+	*buffer = calloc((size_t)file_size + 1, 1);
+	if (!*buffer) {
+		fclose(file);
+		return DS_ALLOCATION;
+	}
+
+	*read_size = fread(*buffer, 1, (size_t)file_size, file);
+	fclose(file);
+
+	(*buffer)[*read_size] = '\0';
+
+	return DS_OK;
+}
+
+DSError_t tree_load(struct tree *tree, const char *filename, value_deserializer deserializer) {
+	assert (tree);
+	assert (filename);
+	assert (deserializer);
+
+	FILE *file = fopen(filename, "rb");
+	if (!file) {
+		return DS_INVALID_ARG;
+	}
+
+	DSError_t result = tree_load_stream(tree, file, deserializer);
+	fclose(file);
+
+	return result;
+}
+
+DSError_t tree_deserialize_node(struct tree_node **node, char *buffer, size_t *pos, value_deserializer deserializer) {
+	assert (node);
+	assert (buffer);
+	assert (pos);
+	assert (deserializer);
+
+	while (buffer[*pos] == ' ') {
+		(*pos)++;
+	}
+
+	if (strncmp(buffer + *pos, "nil", 3) == 0) {
+		*node = NULL;
+		*pos += 3;
+		return DS_OK;
+	}
+
+	if (buffer[*pos] != '(') {
+		return DS_INVALID_ARG;
+	}
+
+	(*pos)++;
+
+	if (buffer[*pos] != '"') {
+		return DS_INVALID_ARG;
+	}
+
+	(*pos)++;
+
+	char *value_start = buffer + *pos;
+	char *value_end = strchr(value_start, '"');
+	if (!value_end) {
+		return DS_INVALID_ARG;
+	}
+
+	*value_end = '\0';
+	*pos = (size_t)(value_end - buffer + 1);
+
+	*node = tnode_ctor();
+	if (!*node) {
+		*value_end = '"';
+		return DS_INVALID_ARG;
+	}
+
+	DSError_t ret = DS_OK;
+	if ((ret = deserializer(&((*node)->value), value_start)) != DS_OK) {
+		*value_end = '"';
+		tnode_recursive_dtor(*node, NULL);
+		*node = NULL;
+		return ret;
+	}
+
+	if ((ret = tree_deserialize_node(&(*node)->left, buffer, pos, deserializer)) != DS_OK) {
+		*value_end = '"';
+		tnode_recursive_dtor(*node, NULL);
+		*node = NULL;
+		return ret;
+	}
+
+	if ((ret = tree_deserialize_node(&(*node)->right, buffer, pos, deserializer)) != DS_OK) {
+		*value_end = '"';
+		tnode_recursive_dtor(*node, NULL);
+		*node = NULL;
+		return ret;
+	}
+
+	if (buffer[*pos] != ')') {
+		*value_end = '"';
+		tnode_recursive_dtor(*node, NULL);
+		*node = NULL;
+		return ret;
+	}
+
+	(*pos)++;
+
+	return DS_OK;
+}
+
+#define TREE_STREAM_CHUNK (4096)
+#define TREE_STREAM_NO_LABEL (SIZE_MAX)
+
+struct tree_stream {
+	FILE *file;
+	size_t pos;
+	size_t len;
+	char chunk[TREE_STREAM_CHUNK];
+};
+
+struct tree_stream_frame {
+	struct tree_node *node;
+	size_t label;
+	int has_left;
+};
+
+// Returns EOF at the end of the stream
+static int tree_stream_peek(struct tree_stream *stream) {
+	if (stream->pos == stream->len) {
+		stream->pos = 0;
+		stream->len = fread(stream->chunk, 1, sizeof(stream->chunk), stream->file);
+
+		if (!stream->len) {
+			return EOF;
+		}
+	}
+
+	return (unsigned char)stream->chunk[stream->pos];
+}
+
+static int tree_stream_get(struct tree_stream *stream) {
+	int c = tree_stream_peek(stream);
+	if (c != EOF) {
+		stream->pos++;
+	}
+
+	return c;
+}
+
+static int tree_stream_skip_spaces(struct tree_stream *stream) {
+	int c = EOF;
+	while ((c = tree_stream_peek(stream)) == ' ' || c == '\n' || c == '\t' || c == '\r') {
+		stream->pos++;
+	}
+
+	return c;
+}
+
+static DSError_t tree_stream_expect(struct tree_stream *stream, const char *str) {
+	for (; *str; str++) {
+		if (tree_stream_get(stream) != (unsigned char)*str) {
+			return DS_INVALID_ARG;
+		}
+	}
+
+	return DS_OK;
+}
+
+static DSError_t tree_stream_get_label(struct tree_stream *stream, size_t *label) {
+	size_t digits = 0;
+	int c = EOF;
+
+	*label = 0;
+	while ((c = tree_stream_peek(stream)) >= '0' && c <= '9') {
+		if (*label >= TREE_STREAM_NO_LABEL / 10 - 1) {
+			return DS_INVALID_ARG;
+		}
+
+		*label = *label * 10 + (size_t)(c - '0');
+		stream->pos++;
+		digits++;
+	}
+
+	return digits ? DS_OK : DS_INVALID_ARG;
+}
+
+// Value text is kept null-terminated in value, which grows up to the longest value
+static DSError_t tree_stream_get_value(struct tree_stream *stream, char **value, size_t *capacity) {
+	DSError_t ret = DS_OK;
+	size_t len = 0;
+	int c = EOF;
+
+	if ((ret = tree_stream_expect(stream, "(\"")) != DS_OK) {
+		return ret;
+	}
+
+	while ((c = tree_stream_get(stream)) != '"') {
+		if (c == EOF) {
+			return DS_INVALID_ARG;
+		}
+
+		if ((ret = tree_buffer_reserve((void **)value, capacity, len + 2, 1)) != DS_OK) {
+			return ret;
+		}
+		(*value)[len++] = (char)c;
+	}
+
+	if ((ret = tree_buffer_reserve((void **)value, capacity, len + 1, 1)) != DS_OK) {
+		return ret;
+	}
+	(*value)[len] = '\0';
+
+	return DS_OK;
+}
+
+/*
+ * Nodes are linked into the tree as soon as they are created,
+ * so whatever was built is freed with the tree on error.
+ */
+static DSError_t tree_stream_parse(struct tree_stream *stream, struct tree_node **root,
+				   value_deserializer deserializer, struct tnode_labels *labels) {
+	DSError_t ret = DS_OK;
+	struct tree_stream_frame *frames = NULL;
+	size_t frames_len = 0, frames_capacity = 0;
+	char *value = NULL;
+	size_t value_capacity = 0;
+	struct tree_node **slot = root;
+
+	for (;;) {
+		int c = tree_stream_skip_spaces(stream);
+		size_t label = TREE_STREAM_NO_LABEL;
+
+		if (c == 'n') {
+			_CT_CHECKED(tree_stream_expect(stream, "nil"));
+			*slot = NULL;
+		} else if (c == '#') {
+			stream->pos++;
+			_CT_CHECKED(tree_stream_get_label(stream, &label));
+
+			if (label >= labels->len || !labels->nodes[label]) {
+				_CT_CHECKED(DS_INVALID_ARG);
+			}
+
+			*slot = labels->nodes[label];
+		} else {
+			if (c == '@') {
+				stream->pos++;
+				_CT_CHECKED(tree_stream_get_label(stream, &label));
+
+				if (label != labels->len) {
+					_CT_CHECKED(DS_INVALID_ARG);
+				}
+
+				_CT_CHECKED(tree_buffer_reserve((void **)&labels->nodes, &labels->capacity,
+								labels->len + 1, sizeof(*labels->nodes)));
+				labels->nodes[labels->len++] = NULL;
+
+				// From now on a subtree freed on error may be referenced elsewhere
+				if (tnode_arena) {
+					tnode_arena->flags |= TREE_ARENA_F_SHARED;
+				}
+			}
+
+			_CT_CHECKED(tree_stream_get_value(stream, &value, &value_capacity));
+
+			struct tree_node *node = tnode_ctor();
+			if (!node) {
+				_CT_CHECKED(DS_ALLOCATION);
+			}
+			*slot = node;
+
+			_CT_CHECKED(deserializer(&node->value, value));
+
+			_CT_CHECKED(tree_buffer_reserve((void **)&frames, &frames_capacity,
+							frames_len + 1, sizeof(*frames)));
+			frames[frames_len++] = (struct tree_stream_frame){ node, label, 0 };
+
+			slot = &node->left;
+			continue;
+		}
+
+		// A subtree is complete, close the parents it finishes
+		while (frames_len && frames[frames_len - 1].has_left) {
+			struct tree_stream_frame *frame = &frames[--frames_len];
+
+			if (tree_stream_skip_spaces(stream) != ')') {
+				_CT_CHECKED(DS_INVALID_ARG);
+			}
+			stream->pos++;
+
+			if (frame->label != TREE_STREAM_NO_LABEL) {
+				labels->nodes[frame->label] = frame->node;
+			}
+		}
+
+		if (!frames_len) {
+			break;
+		}
+
+		frames[frames_len - 1].has_left = 1;
+		slot = &frames[frames_len - 1].node->right;
+	}
+
+_CT_EXIT_POINT:
+	free(frames);
+	free(value);
+
+	return ret;
+}
+
+/*
+ * Reads the text format in fixed-size chunks, so file can be a pipe.
+ * Memory besides the tree itself grows with its depth and the number of labels.
+ */
+DSError_t tree_load_stream(struct tree *tree, FILE *file, value_deserializer deserializer) {
+	assert (tree);
+	assert (file);
+	assert (deserializer);
+
+	DSError_t ret = DS_OK;
+	struct tnode_labels labels = {0};
+	struct tree_arena *prev_arena = NULL;
+
+	struct tree_stream *stream = (struct tree_stream *)calloc(1, sizeof(*stream));
+	if (!stream) {
+		return DS_ALLOCATION;
+	}
+	stream->file = file;
+
+	_CT_CHECKED(tree_ctor(tree));
+	_CT_CHECKED(tree_arena_ctor(&tree->arena));
+
+	prev_arena = tree_arena_select(tree->arena);
+	ret = tree_stream_parse(stream, &tree->root, deserializer, &labels);
+	tree_arena_select(prev_arena);
+	_CT_CHECKED(ret);
+
+	if (ferror(file)) {
+		_CT_CHECKED(DS_INVALID_ARG);
+	}
+
+_CT_EXIT_POINT:
+	free(labels.nodes);
+	free(stream);
+
+	if (ret != DS_OK) {
+		tree_dtor(tree);
+	}
+
+	return ret;
+}
+
+#define TREE_BIN_BUFFER_SIZE (2048)
+
+struct tree_bin_writer {
+	FILE *file;
+	DSError_t error;
+	size_t len;
+	uint8_t buffer[TREE_BIN_BUFFER_SIZE];
+};
+
+static void tree_bin_flush(struct tree_bin_writer *writer) {
+	if (writer->len && fwrite(writer->buffer, 1, writer->len, writer->file) != writer->len) {
+		writer->error = DS_ALLOCATION;
+	}
+
+	writer->len = 0;
+}
+
+static void tree_bin_put(struct tree_bin_writer *writer, const void *data, size_t size) {
+	if (writer->len + size > TREE_BIN_BUFFER_SIZE) {
+		tree_bin_flush(writer);
+	}
+
+	if (size > TREE_BIN_BUFFER_SIZE) {
+		if (fwrite(data, 1, size, writer->file) != size) {
+			writer->error = DS_ALLOCATION;
+		}
+		return;
+	}
+
+	memcpy(writer->buffer + writer->len, data, size);
+	writer->len += size;
 }
 
-struct tree_node *tnode_ctor(void) {
-	return (struct tree_node *)
-		calloc(1, sizeof(struct tree_node));
+static void tree_bin_put_varint(struct tree_bin_writer *writer, uint64_t value) {
+	uint8_t bytes[10] = {0};
+	size_t len = 0;
+
+	do {
+		bytes[len] = value & 0x7F;
+		value >>= 7;
+		if (value) {
+			bytes[len] |= 0x80;
+		}
+		len++;
+	} while (value);
+
+	tree_bin_put(writer, bytes, len);
 }
 
-void tnode_dtor(struct tree_node *node, tree_node_value_dtor vdtor) {
-	assert (node);
+// Little-endian whatever the host is
+static void tree_bin_put_u64(struct tree_bin_writer *writer, uint64_t value) {
+	uint8_t bytes[8] = {0};
 
-	if (vdtor != NULL) {
-		vdtor(node);
+	for (size_t i = 0; i < sizeof(bytes); i++) {
+		bytes[i] = (uint8_t)(value >> (8 * i));
 	}
-	free(node);
+
+	tree_bin_put(writer, bytes, sizeof(bytes));
 }
 
-void tnode_recursive_dtor(struct tree_node *node, tree_node_value_dtor vdtor) {
+static void tree_bin_put_symbols(struct tree_bin_writer *writer,
+				 const struct tree_bin_codec *codec) {
+	tree_bin_put_varint(writer, codec->symbols_cnt);
 
-	if (!node) {
-		return;
+	for (size_t i = 0; i < codec->symbols_cnt; i++) {
+		const char *name = codec->symbol_name(i);
+
+		tree_bin_put_varint(writer, strlen(name));
+		tree_bin_put(writer, name, strlen(name));
+	}
+}
+
+static DSError_t tree_bin_put_node(struct tree_bin_writer *writer,
+				   const struct tree_bin_codec *codec,
+				   const struct tree_node *node, size_t idx,
+				   size_t left, size_t right) {
+	if (node->value.flags < 0) {
+		return DS_INVALID_ARG;
 	}
 
+	uint64_t children = (node->left ? TREE_FNODE_LEFT : 0) | (node->right ? TREE_FNODE_RIGHT : 0);
+	tree_bin_put_varint(writer, (uint64_t)node->value.flags << 2 | children);
+
 	if (node->left) {
-		tnode_recursive_dtor(node->left, vdtor);
-		node->left = NULL;
+		tree_bin_put_varint(writer, idx - left);
 	}
 	if (node->right) {
-		tnode_recursive_dtor(node->right, vdtor);
-		node->right = NULL;
+		tree_bin_put_varint(writer, idx - right);
 	}
-	
-	tnode_dtor(node, vdtor);
+
+	switch (codec->value_kind(node->value.flags)) {
+		case TREE_BIN_VALUE_VARINT:
+			tree_bin_put_varint(writer, node->value.varidx);
+			break;
+		case TREE_BIN_VALUE_SYMBOL: {
+			size_t symbol_idx = codec->symbol_index(node->value.ptr);
+			if (symbol_idx >= codec->symbols_cnt) {
+				return DS_INVALID_ARG;
+			}
+
+			tree_bin_put_varint(writer, symbol_idx);
+			break;
+		}
+		case TREE_BIN_VALUE_RAW:
+		default: {
+			uint64_t bits = 0;
+			memcpy(&bits, &node->value.fnum, sizeof(bits));
+			tree_bin_put_u64(writer, bits);
+			break;
+		}
+	}
+
+	return writer->error;
 }
 
-DSError_t tree_store(struct tree *tree, const char *filename, value_serializer serializer) {
+static DSError_t tree_bin_put_nodes(struct tree_bin_writer *writer,
+				    const struct tree_bin_codec *codec,
+				    struct tree_node *root, int is_shared, size_t *count) {
+	DSError_t ret = DS_OK;
+	struct tnode_map written = {0};
+	struct tree_walker walker;
+
+	*count = 0;
+
+	int events = is_shared ? (TREE_WALK_F_PRE | TREE_WALK_F_POST) : TREE_WALK_F_POST;
+	if ((ret = tree_walker_ctor(&walker, root, events)) != DS_OK) {
+		return ret;
+	}
+
+	struct tree_node *node = NULL;
+	enum tree_walk_event event = TREE_WALK_END;
+	while ((event = tree_walker_next(&walker, &node)) != TREE_WALK_END) {
+		if (event == TREE_WALK_ERROR) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
+
+		// Indices of written children go through the value stack
+		if (event == TREE_WALK_PRE) {
+			struct tnode_map_entry *entry = tnode_map_find(&written, node);
+			if (entry) {
+				tree_walker_skip(&walker);
+				_CT_CHECKED(tree_walker_push(&walker, (tree_dtype){ .varidx = entry->idx }));
+			}
+
+			continue;
+		}
+
+		size_t left = 0, right = 0;
+		if (node->right) {
+			right = tree_walker_pop(&walker).varidx;
+		}
+		if (node->left) {
+			left = tree_walker_pop(&walker).varidx;
+		}
+
+		_CT_CHECKED(tree_bin_put_node(writer, codec, node, *count, left, right));
+
+		if (is_shared) {
+			struct tnode_map_entry *entry = tnode_map_insert(&written, node);
+			if (!entry) {
+				_CT_CHECKED(DS_ALLOCATION);
+			}
+			entry->idx = *count;
+		}
+
+		_CT_CHECKED(tree_walker_push(&walker, (tree_dtype){ .varidx = *count }));
+		(*count)++;
+	}
+
+_CT_EXIT_POINT:
+	tree_walker_dtor(&walker);
+	tnode_map_dtor(&written);
+
+	return ret;
+}
+
+DSError_t tree_store_binary(struct tree *tree, const char *filename,
+			    const struct tree_bin_codec *codec) {
 	assert (tree);
 	assert (filename);
+	assert (codec);
 
-	FILE *file = fopen(filename, "w");
-	if (!file) {
+	DSError_t ret = DS_OK;
+	struct tree_bin_writer writer = { .file = fopen(filename, "wb") };
+	if (!writer.file) {
 		return DS_INVALID_ARG;
 	}
 
-	DSError_t result = tree_serialize_node(tree->root, file, serializer);
-	fclose(file);
+	tree_bin_put(&writer, TREE_BIN_MAGIC, strlen(TREE_BIN_MAGIC));
+	tree_bin_put_varint(&writer, TREE_BIN_VERSION);
 
-	return result;
+	tree_bin_put_symbols(&writer, codec);
+
+	// The node count is known only at the end, so it has a fixed width
+	tree_bin_flush(&writer);
+	long count_offset = ftell(writer.file);
+	tree_bin_put_u64(&writer, 0);
+
+	size_t count = 0;
+	int is_shared = tree->arena &&
+		(tree_arena_get_flags(tree->arena) & TREE_ARENA_F_SHARED);
+
+	if (tree->root) {
+		_CT_CHECKED(tree_bin_put_nodes(&writer, codec, tree->root, is_shared, &count));
+	}
+
+	tree_bin_flush(&writer);
+	if (count_offset < 0 || fseek(writer.file, count_offset, SEEK_SET)) {
+		_CT_CHECKED(DS_ALLOCATION);
+	}
+
+	tree_bin_put_u64(&writer, count);
+	tree_bin_flush(&writer);
+	_CT_CHECKED(writer.error);
+
+_CT_EXIT_POINT:
+	if (fclose(writer.file) && ret == DS_OK) {
+		ret = DS_ALLOCATION;
+	}
+
+	return ret;
 }
 
-DSError_t tree_serialize_node(struct tree_node *node, FILE *file, value_serializer serializer) {
-	assert (file);
+struct tree_bin_reader {
+	const uint8_t *pos;
+	const uint8_t *end;
+};
 
-	DSError_t ret = DS_OK;
+static DSError_t tree_bin_get_varint(struct tree_bin_reader *reader, uint64_t *value) {
+	*value = 0;
 
-	if (!node) {
-		if (fprintf(file, "nil") < 0) {
-			return DS_ALLOCATION;
+	for (unsigned int shift = 0; shift < 64; shift += 7) {
+		if (reader->pos == reader->end) {
+			return DS_INVALID_ARG;
 		}
 
-		return DS_OK;
+		uint8_t byte = *reader->pos++;
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+
+		if (!(byte & 0x80)) {
+			return DS_OK;
+		}
 	}
 
-	if (fprintf(file, "(\"") < 0)
-		return DS_ALLOCATION;
+	return DS_INVALID_ARG;
+}
 
-	if ((ret = serializer(node->value, file)) != DS_OK)
-		return ret;
+static DSError_t tree_bin_get_u64(struct tree_bin_reader *reader, uint64_t *value) {
+	if ((size_t)(reader->end - reader->pos) < sizeof(*value)) {
+		return DS_INVALID_ARG;
+	}
 
-	if (fprintf(file, "\" ") < 0)
-		return DS_ALLOCATION;
+	*value = 0;
+	for (size_t i = 0; i < sizeof(*value); i++) {
+		*value |= (uint64_t)reader->pos[i] << (8 * i);
+	}
+	reader->pos += sizeof(*value);
+
+	return DS_OK;
+}
+
+// Maps the symbol table of the file onto the codec by names
+static DSError_t tree_bin_get_symbols(struct tree_bin_reader *reader,
+				      const struct tree_bin_codec *codec,
+				      const void ***symbols, size_t *symbols_cnt) {
+	DSError_t ret = DS_OK;
+	uint64_t cnt = 0;
 
-	if ((ret = tree_serialize_node(node->left, file, serializer)) != DS_OK) {
+	if ((ret = tree_bin_get_varint(reader, &cnt)) != DS_OK) {
 		return ret;
 	}
 
-	if (fputc(' ', file) == EOF) {
+	if (cnt > (uint64_t)(reader->end - reader->pos)) {
+		return DS_INVALID_ARG;
+	}
+
+	*symbols_cnt = (size_t)cnt;
+	*symbols = (const void **)calloc(*symbols_cnt + 1, sizeof(**symbols));
+	if (!*symbols) {
 		return DS_ALLOCATION;
 	}
 
-	if ((ret = tree_serialize_node(node->right, file, serializer)) != DS_OK) {
-		return ret;
+	for (size_t i = 0; i < *symbols_cnt; i++) {
+		uint64_t len = 0;
+		if ((ret = tree_bin_get_varint(reader, &len)) != DS_OK) {
+			return ret;
+		}
+
+		if (len > (uint64_t)(reader->end - reader->pos)) {
+			return DS_INVALID_ARG;
+		}
+
+		for (size_t j = 0; j < codec->symbols_cnt && !(*symbols)[i]; j++) {
+			const char *name = codec->symbol_name(j);
+
+			if (strlen(name) == len && !memcmp(name, reader->pos, (size_t)len)) {
+				(*symbols)[i] = codec->symbol(j);
+			}
+		}
+
+		if (!(*symbols)[i]) {
+			return DS_INVALID_ARG;
+		}
+
+		reader->pos += len;
 	}
 
-	if (fputc(')', file) == EOF) {
-		return DS_ALLOCATION;
+	return DS_OK;
+}
+
+static DSError_t tree_bin_get_nodes(struct tree_bin_reader *reader,
+				    const struct tree_bin_codec *codec,
+				    const void **symbols, size_t symbols_cnt,
+				    struct tree_node **nodes, uint8_t *used,
+				    size_t count, int *is_shared) {
+	DSError_t ret = DS_OK;
+
+	for (size_t idx = 0; idx < count; idx++) {
+		uint64_t header = 0, payload = 0;
+
+		if ((ret = tree_bin_get_varint(reader, &header)) != DS_OK) {
+			return ret;
+		}
+
+		if ((header >> 2) > INT_MAX) {
+			return DS_INVALID_ARG;
+		}
+
+		struct tree_node *node = tnode_ctor();
+		if (!node) {
+			return DS_ALLOCATION;
+		}
+
+		node->value.flags = (int)(header >> 2);
+		nodes[idx] = node;
+
+		for (uint64_t child_bit = TREE_FNODE_LEFT; child_bit <= TREE_FNODE_RIGHT; child_bit <<= 1) {
+			if (!(header & child_bit)) {
+				continue;
+			}
+
+			uint64_t distance = 0;
+			if ((ret = tree_bin_get_varint(reader, &distance)) != DS_OK) {
+				return ret;
+			}
+
+			if (distance == 0 || distance > idx) {
+				return DS_INVALID_ARG;
+			}
+
+			size_t child_idx = idx - (size_t)distance;
+			if (used[child_idx]) {
+				*is_shared = 1;
+			}
+			used[child_idx] = 1;
+
+			if (child_bit == TREE_FNODE_LEFT) {
+				node->left = nodes[child_idx];
+			} else {
+				node->right = nodes[child_idx];
+			}
+		}
+
+		switch (codec->value_kind(node->value.flags)) {
+			case TREE_BIN_VALUE_VARINT:
+				if ((ret = tree_bin_get_varint(reader, &payload)) != DS_OK) {
+					return ret;
+				}
+				node->value.varidx = (size_t)payload;
+				break;
+			case TREE_BIN_VALUE_SYMBOL:
+				if ((ret = tree_bin_get_varint(reader, &payload)) != DS_OK) {
+					return ret;
+				}
+				if (payload >= symbols_cnt) {
+					return DS_INVALID_ARG;
+				}
+				node->value.ptr = (void *)(uintptr_t)symbols[payload];
+				break;
+			case TREE_BIN_VALUE_RAW:
+			default:
+				if ((ret = tree_bin_get_u64(reader, &payload)) != DS_OK) {
+					return ret;
+				}
+				memcpy(&node->value.fnum, &payload, sizeof(payload));
+				break;
+		}
 	}
 
 	return DS_OK;
 }
 
-DSError_t tree_load(struct tree *tree, const char *filename, value_deserializer deserializer) {
+DSError_t tree_load_binary(struct tree *tree, const char *filename,
+			   const struct tree_bin_codec *codec) {
 	assert (tree);
 	assert (filename);
-	assert (deserializer);
+	assert (codec);
 
-	FILE *file = fopen(filename, "r");
-	if (!file) {
-		return DS_INVALID_ARG;
+	DSError_t ret = DS_OK;
+	char *buffer = NULL;
+	size_t read_size = 0;
+	const void **symbols = NULL;
+	size_t symbols_cnt = 0;
+	struct tree_node **nodes = NULL;
+	uint8_t *used = NULL;
+	uint64_t count = 0, version = 0;
+	int is_shared = 0;
+	struct tree_arena *prev_arena = NULL;
+	struct tree_bin_reader reader = {0};
+
+	_CT_CHECKED(tree_ctor(tree));
+	_CT_CHECKED(tree_read_file(filename, &buffer, &read_size));
+
+	reader.pos = (const uint8_t *)buffer;
+	reader.end = (const uint8_t *)buffer + read_size;
+
+	if (read_size < strlen(TREE_BIN_MAGIC) ||
+	    memcmp(buffer, TREE_BIN_MAGIC, strlen(TREE_BIN_MAGIC))) {
+		_CT_CHECKED(DS_INVALID_ARG);
 	}
+	reader.pos += strlen(TREE_BIN_MAGIC);
 
-	ssize_t file_size = get_file_size(file);
-
-	if (file_size <= 0) {
-		fclose(file);
-		return DS_INVALID_ARG;
+	_CT_CHECKED(tree_bin_get_varint(&reader, &version));
+	if (version != TREE_BIN_VERSION) {
+		_CT_CHECKED(DS_INVALID_ARG);
 	}
 
-	char *buffer = calloc((size_t)file_size + 1, 1);
-	if (!buffer) {
-		fclose(file);
-		return DS_ALLOCATION;
+	_CT_CHECKED(tree_bin_get_symbols(&reader, codec, &symbols, &symbols_cnt));
+	_CT_CHECKED(tree_bin_get_u64(&reader, &count));
+
+	// Every node takes at least one byte
+	if (count > (uint64_t)(reader.end - reader.pos)) {
+		_CT_CHECKED(DS_INVALID_ARG);
 	}
 
-	size_t read_size = fread(buffer, 1, (size_t)file_size, file);
-	fclose(file);
+	// An empty tree is just the header
+	if (count) {
+		nodes = (struct tree_node **)calloc((size_t)count, sizeof(*nodes));
+		used = (uint8_t *)calloc((size_t)count, sizeof(*used));
+		if (!nodes || !used) {
+			_CT_CHECKED(DS_ALLOCATION);
+		}
 
-	buffer[read_size] = '\0';
+		_CT_CHECKED(tree_arena_ctor(&tree->arena));
 
-	DSError_t result = tree_ctor(tree);
-	if (result != DS_OK) {
-		free(buffer);
-		return result;
-	}
+		prev_arena = tree_arena_select(tree->arena);
+		ret = tree_bin_get_nodes(&reader, codec, symbols, symbols_cnt,
+					 nodes, used, (size_t)count, &is_shared);
+		tree_arena_select(prev_arena);
+		_CT_CHECKED(ret);
 
-	size_t pos = 0;
-	result = tree_deserialize_node(&tree->root, buffer, &pos, deserializer);
-	if (result != DS_OK) {
-		free(buffer);
-		tree_dtor(tree);
-		return result;
+		if (is_shared) {
+			_CT_CHECKED(tree_arena_set_flags(tree->arena, TREE_ARENA_F_SHARED));
+		}
+
+		tree->root = nodes[count - 1];
 	}
 
+_CT_EXIT_POINT:
+	free(used);
+	free(nodes);
+	free(symbols);
 	free(buffer);
 
-	return DS_OK;
+	if (ret != DS_OK) {
+		tree_dtor(tree);
+	}
+
+	return ret;
 }
 
-DSError_t tree_deserialize_node(struct tree_node **node, char *buffer, size_t *pos, value_deserializer deserializer) {
-	assert (node);
-	assert (buffer);
-	assert (pos);
-	assert (deserializer);
+/*
+ * Mapped files keep the header and nodes in host byte order:
+ * magic, u32 version, u32 endian mark, u64 nodes count, u64 nodes offset,
+ * the symbol table as in tree_store_binary() and the aligned cnode array.
+ */
+#define TREE_MAPPED_ENDIAN_MARK (0x01020304u)
+#define TREE_MAPPED_ALIGN	(64)
+
+struct tree_mapped_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t endian_mark;
+	uint32_t reserved;
+	uint64_t nodes_cnt;
+	uint64_t nodes_offset;
+};
+
+DSError_t tree_store_mapped(struct tree *tree, const char *filename,
+			    const struct tree_bin_codec *codec) {
+	assert (tree);
+	assert (filename);
+	assert (codec);
 
-	while (buffer[*pos] == ' ') {
-		(*pos)++;
+	DSError_t ret = DS_OK;
+	struct tree_compact compact = {0};
+	struct tree_bin_writer writer = { .file = NULL };
+
+	if (tree->root) {
+		_CT_CHECKED(tree_compact_from_node(&compact, tree->root));
 	}
 
-	if (strncmp(buffer + *pos, "nil", 3) == 0) {
-		*node = NULL;
-		*pos += 3;
-		return DS_OK;
+	// Symbol pointers are only meaningful in this process
+	for (size_t i = 0; i < compact.len; i++) {
+		struct tree_cnode *cnode = &compact.nodes[i];
+
+		if (codec->value_kind(tree_cnode_flags(cnode)) == TREE_BIN_VALUE_SYMBOL) {
+			size_t symbol_idx = codec->symbol_index(cnode->ptr);
+			if (symbol_idx >= codec->symbols_cnt) {
+				_CT_CHECKED(DS_INVALID_ARG);
+			}
+
+			cnode->varidx = symbol_idx;
+		}
 	}
 
-	if (buffer[*pos] != '(') {
-		return DS_INVALID_ARG;
+	writer.file = fopen(filename, "wb");
+	if (!writer.file) {
+		_CT_CHECKED(DS_INVALID_ARG);
 	}
 
-	(*pos)++;
+	struct tree_mapped_header header = {
+		.version = TREE_MAPPED_VERSION,
+		.endian_mark = TREE_MAPPED_ENDIAN_MARK,
+		.nodes_cnt = compact.len,
+	};
+	memcpy(header.magic, TREE_MAPPED_MAGIC, sizeof(header.magic));
 
-	if (buffer[*pos] != '"') {
-		return DS_INVALID_ARG;
+	tree_bin_put(&writer, &header, sizeof(header));
+	tree_bin_put_symbols(&writer, codec);
+	tree_bin_flush(&writer);
+
+	long offset = ftell(writer.file);
+	if (offset < 0) {
+		_CT_CHECKED(DS_ALLOCATION);
 	}
 
-	(*pos)++;
+	static const uint8_t padding[TREE_MAPPED_ALIGN] = {0};
+	size_t padding_size = (TREE_MAPPED_ALIGN - (size_t)offset % TREE_MAPPED_ALIGN) % TREE_MAPPED_ALIGN;
 
-	char *value_start = buffer + *pos;
-	char *value_end = strchr(value_start, '"');
-	if (!value_end) {
-		return DS_INVALID_ARG;
+	tree_bin_put(&writer, padding, padding_size);
+	if (compact.len) {
+		tree_bin_put(&writer, compact.nodes, compact.len * sizeof(*compact.nodes));
 	}
+	tree_bin_flush(&writer);
 
-	*value_end = '\0';
-	*pos = (size_t)(value_end - buffer + 1);
+	header.nodes_offset = (uint64_t)offset + padding_size;
+	if (fseek(writer.file, 0, SEEK_SET)) {
+		_CT_CHECKED(DS_ALLOCATION);
+	}
 
-	*node = tnode_ctor();
-	if (!*node) {
-		*value_end = '"';
-		return DS_INVALID_ARG;
+	tree_bin_put(&writer, &header, sizeof(header));
+	tree_bin_flush(&writer);
+	_CT_CHECKED(writer.error);
+
+_CT_EXIT_POINT:
+	if (writer.file && fclose(writer.file) && ret == DS_OK) {
+		ret = DS_ALLOCATION;
 	}
 
+	tree_compact_dtor(&compact);
+
+	return ret;
+}
+
+/*
+ * Only the header and the symbol table are read here, node pages are
+ * faulted in on first access and shared with other processes.
+ */
+DSError_t tree_mapped_ctor(struct tree_mapped *mapped, const char *filename,
+			   const struct tree_bin_codec *codec) {
+	assert (mapped);
+	assert (filename);
+	assert (codec);
+
 	DSError_t ret = DS_OK;
-	if ((ret = deserializer(&((*node)->value), value_start)) != DS_OK) {
-		*value_end = '"';
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		return ret;
+	struct stat st = {0};
+
+	*mapped = (struct tree_mapped){ .codec = codec };
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return DS_INVALID_ARG;
 	}
 
-	if ((ret = tree_deserialize_node(&(*node)->left, buffer, pos, deserializer)) != DS_OK) {
-		*value_end = '"';
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		return ret;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(struct tree_mapped_header)) {
+		close(fd);
+		return DS_INVALID_ARG;
 	}
 
-	if ((ret = tree_deserialize_node(&(*node)->right, buffer, pos, deserializer)) != DS_OK) {
-		*value_end = '"';
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		return ret;
+	void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return DS_ALLOCATION;
 	}
 
-	if (buffer[*pos] != ')') {
-		*value_end = '"';
-		tnode_recursive_dtor(*node, NULL);
-		*node = NULL;
-		return ret;
+	mapped->map = map;
+	mapped->map_size = (size_t)st.st_size;
+
+	// The mapping is page aligned, the header is read in place instead of a stack copy
+	const struct tree_mapped_header *header = (const struct tree_mapped_header *)map;
+	if (memcmp(header->magic, TREE_MAPPED_MAGIC, sizeof(header->magic)) ||
+	    header->version != TREE_MAPPED_VERSION ||
+	    header->endian_mark != TREE_MAPPED_ENDIAN_MARK) {
+		_CT_CHECKED(DS_INVALID_ARG);
 	}
 
-	(*pos)++;
+	if (header->nodes_offset < sizeof(*header) || header->nodes_offset > mapped->map_size ||
+	    header->nodes_offset % TREE_MAPPED_ALIGN ||
+	    header->nodes_cnt > (mapped->map_size - header->nodes_offset) / sizeof(struct tree_cnode) ||
+	    header->nodes_cnt > TREE_CNODE_NIL) {
+		_CT_CHECKED(DS_INVALID_ARG);
+	}
 
-	return DS_OK;
+	struct tree_bin_reader reader = {
+		.pos = (const uint8_t *)map + sizeof(*header),
+		.end = (const uint8_t *)map + header->nodes_offset,
+	};
+	_CT_CHECKED(tree_bin_get_symbols(&reader, codec, &mapped->symbols, &mapped->symbols_cnt));
+
+	mapped->nodes = (const struct tree_cnode *)((const uint8_t *)map + header->nodes_offset);
+	mapped->len = (size_t)header->nodes_cnt;
+
+_CT_EXIT_POINT:
+	if (ret != DS_OK) {
+		tree_mapped_dtor(mapped);
+	}
+
+	return ret;
+}
+
+DSError_t tree_mapped_dtor(struct tree_mapped *mapped) {
+	assert (mapped);
+
+	DSError_t ret = DS_OK;
+	if (mapped->map && munmap(mapped->map, mapped->map_size)) {
+		ret = DS_INVALID_ARG;
+	}
+
+	free(mapped->symbols);
+	*mapped = (struct tree_mapped){0};
+
+	return ret;
+}
+
+DSError_t tree_mapped_serialize(const struct tree_mapped *mapped, FILE *file,
+				value_serializer serializer) {
+	assert (mapped);
+	assert (file);
+	assert (serializer);
+
+	return tree_cnodes_serialize(mapped->nodes, mapped->len, mapped, file, serializer);
 }
 
 static DSError_t dump_draw_dot(struct tree *tree, const char *drawing_filename,
@@ -372,9 +2989,11 @@ static uint32_t inverse_color(uint32_t color) {
 }
 
 static DSError_t tree_dump_node(struct tree_node *node, size_t *node_idx,
+				struct tnode_map *visited,
 				FILE *dot_file, value_serializer serializer) {
 	assert (node);
 	assert (node_idx);
+	assert (visited);
 
 	DSError_t ret = DS_OK;
 
@@ -382,6 +3001,12 @@ static DSError_t tree_dump_node(struct tree_node *node, size_t *node_idx,
 
 	size_t cnode_idx = *node_idx;
 
+	struct tnode_map_entry *entry = tnode_map_insert(visited, node);
+	if (!entry) {
+		return DS_ALLOCATION;
+	}
+	entry->idx = cnode_idx;
+
 	const char *box_color = "lightgreen";
 
 	if (cnode_idx == 0) {
@@ -412,20 +3037,35 @@ static DSError_t tree_dump_node(struct tree_node *node, size_t *node_idx,
 
 	(*node_idx)++;
 
+	// Shared nodes are drawn once with an edge from every parent
 	if (node->left) {
 		size_t lnode_idx = *node_idx;
+		struct tnode_map_entry *lentry = tnode_map_find(visited, node->left);
+		if (lentry) {
+			lnode_idx = lentry->idx;
+		}
 
 		DOT_PRINTF("node%zu -> node%zu [color=blue];", cnode_idx, lnode_idx);
 
-		_CT_CHECKED(tree_dump_node(node->left, node_idx, dot_file, serializer));
+		if (!lentry) {
+			_CT_CHECKED(tree_dump_node(node->left, node_idx, visited,
+						   dot_file, serializer));
+		}
 	}
 
 	if (node->right) {
 		size_t rnode_idx = *node_idx;
+		struct tnode_map_entry *rentry = tnode_map_find(visited, node->right);
+		if (rentry) {
+			rnode_idx = rentry->idx;
+		}
 
 		DOT_PRINTF("node%zu -> node%zu [color=red];", cnode_idx, rnode_idx);
 
-		_CT_CHECKED(tree_dump_node(node->right, node_idx, dot_file, serializer));
+		if (!rentry) {
+			_CT_CHECKED(tree_dump_node(node->right, node_idx, visited,
+						   dot_file, serializer));
+		}
 	}
 
 #undef DOT_PRINTF
@@ -447,7 +3087,10 @@ DSError_t tree_graph_dump_dot(struct tree *tree, FILE *dot_file, value_serialize
 
 	if (tree->root) {
 		size_t node_idx = 0;
-		tree_dump_node(tree->root, &node_idx, dot_file, serializer);
+		struct tnode_map visited = {0};
+
+		tree_dump_node(tree->root, &node_idx, &visited, dot_file, serializer);
+		tnode_map_dtor(&visited);
 	}
 
 	DOT_PRINTF("}\n");
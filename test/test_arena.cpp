@@ -0,0 +1,90 @@
+#include "test_config.h"
+#include "tree.h"
+
+static size_t test_vdtor_cnt = 0;
+
+static void test_vdtor(struct tree_node *node) {
+	(void)node;
+	test_vdtor_cnt++;
+}
+
+// A chain of len nodes, each the left child of the previous one
+static struct tree_node *test_chain(size_t len) {
+	struct tree_node *root = NULL;
+
+	for (size_t i = 0; i < len; i++) {
+		struct tree_node *node = tnode_ctor();
+		node->left = root;
+		root = node;
+	}
+
+	return root;
+}
+
+TEST(TestArena, FreeAcrossArenas) {
+	struct tree_arena *owner = NULL, *other = NULL;
+	ASSERT_EQ(DS_OK, tree_arena_ctor(&owner));
+	ASSERT_EQ(DS_OK, tree_arena_ctor(&other));
+
+	struct tree_arena *prev_arena = tree_arena_select(owner);
+	struct tree_node *root = test_chain(1000);
+
+	tree_arena_select(other);
+	struct tree_node *other_root = test_chain(10);
+	tnode_recursive_dtor(root, NULL);
+
+	// The nodes went back to their own arena, the selected one is untouched
+	ASSERT_EQ(0u, tree_arena_used_bytes(owner));
+	ASSERT_EQ(10 * sizeof(struct tree_node), tree_arena_used_bytes(other));
+
+	tnode_recursive_dtor(other_root, NULL);
+	ASSERT_EQ(0u, tree_arena_used_bytes(other));
+
+	tree_arena_select(prev_arena);
+	tree_arena_dtor(other);
+	tree_arena_dtor(owner);
+}
+
+TEST(TestArena, FreeWithoutSelectedArena) {
+	struct tree_arena *owner = NULL;
+	ASSERT_EQ(DS_OK, tree_arena_ctor(&owner));
+
+	struct tree_arena *prev_arena = tree_arena_select(owner);
+	struct tree_node *root = test_chain(100);
+	struct tree_node *single = tnode_ctor();
+	tree_arena_select(NULL);
+
+	struct tree_node *calloc_root = test_chain(100);
+
+	tnode_dtor(single, NULL);
+	ASSERT_EQ(100 * sizeof(struct tree_node), tree_arena_used_bytes(owner));
+
+	tnode_recursive_dtor(root, NULL);
+	tnode_recursive_dtor(calloc_root, NULL);
+	ASSERT_EQ(0u, tree_arena_used_bytes(owner));
+
+	tree_arena_select(prev_arena);
+	tree_arena_dtor(owner);
+}
+
+TEST(TestArena, SharedArenaCallsValueDtor) {
+	struct tree tree = {};
+	ASSERT_EQ(DS_OK, tree_ctor(&tree));
+	ASSERT_EQ(DS_OK, tree_arena_ctor(&tree.arena));
+	ASSERT_EQ(DS_OK, tree_arena_set_flags(tree.arena, TREE_ARENA_F_SHARED));
+	ASSERT_EQ(DS_OK, tree_set_node_value_dtor(&tree, test_vdtor));
+
+	struct tree_arena *prev_arena = tree_arena_select(tree.arena);
+
+	// Both children are one node
+	struct tree_node *leaf = tnode_ctor();
+	tree.root = tnode_ctor();
+	tree.root->left = leaf;
+	tree.root->right = leaf;
+
+	tree_arena_select(prev_arena);
+
+	test_vdtor_cnt = 0;
+	ASSERT_EQ(DS_OK, tree_dtor(&tree));
+	ASSERT_EQ(2u, test_vdtor_cnt);
+}
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include "test_config.h"
+#include "test_expression.h"
+
+#define TEST_POINTS_CNT (5)
+
+static const double test_xs[TEST_POINTS_CNT] = {-1, -0.3, 0.4, 1.7, 3.2};
+static const double test_ys[TEST_POINTS_CNT] = {0.5, 1, 1.3, 2, 4.4};
+
+// Denominators stay well away from 0, every order of the quotient rule squares them
+static const char *const test_sources[] = {
+	"sin(x*y)/(x+2.5)^2-ln(y)*0.1$",
+	"cos(x)^2*y+x*y-y/3$",
+	"(x*x+y)*(x*x+y)-ln(y*y)/(y+x*x)$",
+};
+
+#define TEST_SOURCES_CNT (sizeof(test_sources) / sizeof(*test_sources))
+
+static int test_parse(size_t src_idx, struct expression *expr) {
+	char src[64] = "";
+	strcpy(src, test_sources[src_idx]);
+
+	return expression_parse_str(src, expr);
+}
+
+TEST(TestAutodiff, DualMatchesSymbolic) {
+	for (size_t src_idx = 0; src_idx < TEST_SOURCES_CNT; src_idx++) {
+		struct expression expr = {};
+		ASSERT_EQ(S_OK, test_parse(src_idx, &expr));
+
+		for (size_t var_idx = 0; var_idx < 2; var_idx++) {
+			struct tree_node *partial = expression_derive_tnode(&expr, expr.tree.root, var_idx);
+			ASSERT_EQ(true, partial != nullptr);
+
+			for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+				const double values[] = {test_xs[i], test_ys[i]};
+				test_set_variables(&expr, values);
+
+				struct expression_dual dual = {};
+				ASSERT_EQ(S_OK, tnode_evaluate_dual(&expr, expr.tree.root, var_idx, &dual));
+				ASSERT_EQ(1, test_near(test_evaluate(&expr, expr.tree.root), dual.value));
+				ASSERT_EQ(1, test_near(test_evaluate(&expr, partial), dual.deriv));
+			}
+
+			tnode_recursive_dtor(partial, NULL);
+		}
+
+		expression_dtor(&expr);
+	}
+}
+
+TEST(TestAutodiff, TapeMatchesSymbolic) {
+	for (size_t src_idx = 0; src_idx < TEST_SOURCES_CNT; src_idx++) {
+		struct expression expr = {};
+		ASSERT_EQ(S_OK, test_parse(src_idx, &expr));
+
+		struct tree_node *partials[2] = {};
+		for (size_t var_idx = 0; var_idx < 2; var_idx++) {
+			partials[var_idx] = expression_derive_tnode(&expr, expr.tree.root, var_idx);
+			ASSERT_EQ(true, partials[var_idx] != nullptr);
+		}
+
+		// One tape for every point
+		struct expression_tape tape = {};
+		ASSERT_EQ(S_OK, expression_tape_ctor(&tape, expr.tree.root));
+		ASSERT_EQ(2u, tape.vars_cnt);
+
+		for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+			const double values[] = {test_xs[i], test_ys[i]};
+			test_set_variables(&expr, values);
+
+			double fnum = NAN, grad[2] = {NAN, NAN};
+			ASSERT_EQ(S_OK, expression_tape_gradient(&expr, &tape, values, 2, &fnum, grad));
+			ASSERT_EQ(1, test_near(test_evaluate(&expr, expr.tree.root), fnum));
+			ASSERT_EQ(1, test_near(test_evaluate(&expr, partials[0]), grad[0]));
+			ASSERT_EQ(1, test_near(test_evaluate(&expr, partials[1]), grad[1]));
+		}
+
+		expression_tape_dtor(&tape);
+		tnode_recursive_dtor(partials[0], NULL);
+		tnode_recursive_dtor(partials[1], NULL);
+		expression_dtor(&expr);
+	}
+}
+
+#define TEST_SERIES_ORDER (4)
+
+TEST(TestAutodiff, SeriesMatchesSymbolic) {
+	for (size_t src_idx = 0; src_idx < TEST_SOURCES_CNT; src_idx++) {
+		struct expression expr = {};
+		ASSERT_EQ(S_OK, test_parse(src_idx, &expr));
+
+		// derivatives[k] is the k-th derivative by x, derivatives[0] the expression
+		struct tree_node *derivatives[TEST_SERIES_ORDER + 1] = {expr.tree.root};
+		for (size_t k = 1; k <= TEST_SERIES_ORDER; k++) {
+			derivatives[k] = expression_derive_tnode(&expr, derivatives[k - 1], 0);
+			ASSERT_EQ(true, derivatives[k] != nullptr);
+		}
+
+		for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+			const double values[] = {test_xs[i], test_ys[i]};
+			test_set_variables(&expr, values);
+
+			double coeffs[TEST_SERIES_ORDER + 1] = {};
+			ASSERT_EQ(S_OK, tnode_evaluate_series(&expr, expr.tree.root, 0,
+							      TEST_SERIES_ORDER, coeffs));
+
+			// coeffs[k] = f^(k)(x) / k!
+			double factorial = 1;
+			for (size_t k = 0; k <= TEST_SERIES_ORDER; k++) {
+				factorial *= k ? (double)k : 1;
+				ASSERT_EQ(1, test_near(test_evaluate(&expr, derivatives[k]),
+						       coeffs[k] * factorial));
+			}
+		}
+
+		for (size_t k = 1; k <= TEST_SERIES_ORDER; k++) {
+			tnode_recursive_dtor(derivatives[k], NULL);
+		}
+		expression_dtor(&expr);
+	}
+}
@@ -0,0 +1,119 @@
+#include "test_config.h"
+#include "test_expression.h"
+
+// "2*x+3.25", the number 2 is the left child of the left child
+static const uint8_t test_two_path[] = {0, 0};
+
+TEST(TestCow, CloneMutationKeepsOriginal) {
+	char src[] = "2*x+3.25$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	const double x = 1.5;
+	test_set_variables(&expr, &x);
+
+	struct tree_arena *arena = expr.tree.arena;
+	int flags = tree_arena_get_flags(arena);
+
+	struct expression clone = {};
+	ASSERT_EQ(S_OK, expression_clone(&expr, &clone));
+	ASSERT_EQ(expr.tree.root, clone.tree.root);
+
+	// Cloning leaves the source arena as it was
+	ASSERT_EQ(arena, expr.tree.arena);
+	ASSERT_EQ(flags, tree_arena_get_flags(arena));
+
+	struct tree_node *two = NULL;
+	ASSERT_EQ(DS_OK, tree_cow_path(&clone.tree, test_two_path, 2, &two));
+	two->value.fnum = 5;
+
+	ASSERT_EQ(1, test_near(2 * x + 3.25, test_evaluate(&expr, expr.tree.root)));
+	ASSERT_EQ(1, test_near(5 * x + 3.25, test_evaluate(&clone, clone.tree.root)));
+
+	// The source diverges the same way
+	ASSERT_EQ(DS_OK, tree_cow_path(&expr.tree, test_two_path, 2, &two));
+	two->value.fnum = 7;
+
+	ASSERT_EQ(1, test_near(7 * x + 3.25, test_evaluate(&expr, expr.tree.root)));
+	ASSERT_EQ(1, test_near(5 * x + 3.25, test_evaluate(&clone, clone.tree.root)));
+
+	expression_dtor(&clone);
+	expression_dtor(&expr);
+}
+
+TEST(TestCow, ValidateCopiesSharedNodes) {
+	char src[] = "2*x+3.25$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	struct tree_node *two = expr.tree.root->left->left;
+	two->value.flags &= ~DERIVATOR_F_CONSTANT;
+
+	struct expression clone = {};
+	ASSERT_EQ(S_OK, expression_clone(&expr, &clone));
+	ASSERT_EQ(S_OK, expression_validate(&clone));
+
+	ASSERT_EQ(0, two->value.flags & DERIVATOR_F_CONSTANT);
+	ASSERT_EQ(two, expr.tree.root->left->left);
+	ASSERT_EQ(true, clone.tree.root != expr.tree.root);
+	ASSERT_EQ(DERIVATOR_F_CONSTANT,
+		  clone.tree.root->left->left->value.flags & DERIVATOR_F_CONSTANT);
+
+	expression_dtor(&clone);
+	expression_dtor(&expr);
+}
+
+TEST(TestCow, ValidateKeepsHashes) {
+	char src[] = "sin(x)*(x+3)$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+	ASSERT_EQ(S_OK, expression_hash(&expr));
+
+	uint32_t hash = expr.tree.root->value.hash;
+	struct tree_node *root = expr.tree.root;
+	ASSERT_EQ(true, hash != 0);
+
+	// Nothing is shared, the nodes are marked in place
+	ASSERT_EQ(S_OK, expression_validate(&expr));
+	ASSERT_EQ(root, expr.tree.root);
+	ASSERT_EQ(hash, expr.tree.root->value.hash);
+	ASSERT_EQ(true, expr.tree.root->left->value.hash != 0);
+
+	// A clone is copied, the copies keep the hashes too
+	struct expression clone = {};
+	ASSERT_EQ(S_OK, expression_clone(&expr, &clone));
+	ASSERT_EQ(S_OK, expression_validate(&clone));
+	ASSERT_EQ(true, clone.tree.root != expr.tree.root);
+	ASSERT_EQ(hash, clone.tree.root->value.hash);
+
+	expression_dtor(&clone);
+	expression_dtor(&expr);
+}
+
+TEST(TestCow, UnshareCopiesSharedNodesOnce) {
+	struct tree tree = {};
+	ASSERT_EQ(DS_OK, tree_ctor(&tree));
+	ASSERT_EQ(DS_OK, tree_arena_ctor(&tree.arena));
+	ASSERT_EQ(DS_OK, tree_arena_set_flags(tree.arena, TREE_ARENA_F_SHARED));
+
+	struct tree_arena *prev_arena = tree_arena_select(tree.arena);
+	struct tree_node *leaf = tnode_ctor();
+	tree.root = tnode_ctor();
+	tree.root->left = leaf;
+	tree.root->right = leaf;
+	tree_arena_select(prev_arena);
+
+	struct tree clone = {};
+	ASSERT_EQ(DS_OK, tree_share(&tree, &clone));
+	ASSERT_EQ(DS_OK, tree_unshare(&clone));
+
+	// Both children are one copy, the source is untouched
+	ASSERT_EQ(true, clone.root != tree.root);
+	ASSERT_EQ(true, clone.root->left != leaf);
+	ASSERT_EQ(clone.root->left, clone.root->right);
+	ASSERT_EQ(leaf, tree.root->left);
+	ASSERT_EQ(leaf, tree.root->right);
+
+	tree_dtor(&clone);
+	tree_dtor(&tree);
+}
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "test_config.h"
+#include "test_expression.h"
+
+// 9 nodes a term with the +, about 24k nodes, above the size derived on the pool
+#define TEST_DERIVE_TERMS_CNT (2700)
+#define TEST_DERIVE_TERM_LEN (32)
+
+// sin(x*k)*x^2 summed over k
+static char *test_derive_large_sum(void) {
+	size_t size = TEST_DERIVE_TERMS_CNT * TEST_DERIVE_TERM_LEN;
+	char *src = (char *)calloc(size, sizeof(char));
+	if (!src) {
+		return NULL;
+	}
+
+	size_t len = 0;
+	for (size_t k = 1; k <= TEST_DERIVE_TERMS_CNT; k++) {
+		len += (size_t)snprintf(src + len, size - len, "%ssin(x*%zu)*x^2",
+					k > 1 ? "+" : "", k);
+	}
+	snprintf(src + len, size - len, "$");
+
+	return src;
+}
+
+// 1 if the first two derivatives are the same with and without the pool
+static int test_derive_pool_matches(size_t threads_cnt) {
+	char *src = test_derive_large_sum();
+	char *src_pool = test_derive_large_sum();
+	struct expression plain = {}, pooled = {};
+	struct expression_pool pool;
+
+	int matches = src && src_pool &&
+		      !expression_parse_str(src, &plain) &&
+		      !expression_parse_str(src_pool, &pooled) &&
+		      !expression_pool_ctor(&pool, threads_cnt);
+	if (!matches) {
+		free(src);
+		free(src_pool);
+		expression_dtor(&plain);
+		expression_dtor(&pooled);
+		return 0;
+	}
+
+	pooled.pool = &pool;
+	matches = pool.threads_cnt == threads_cnt;
+
+	for (int nth = 1; nth <= 2 && matches; nth++) {
+		struct tree_node *plain_derivative = test_nth_derivative(&plain, nth);
+		struct tree_node *pooled_derivative = test_nth_derivative(&pooled, nth);
+
+		matches = plain_derivative && pooled_derivative &&
+			  expr_tnode_equal(plain_derivative, pooled_derivative) == 1;
+	}
+
+	expression_dtor(&plain);
+	expression_dtor(&pooled);
+	expression_pool_dtor(&pool);
+	free(src);
+	free(src_pool);
+
+	return matches;
+}
+
+TEST(TestDerive, PoolMatchesSingleThread) {
+	ASSERT_EQ(1, test_derive_pool_matches(4));
+}
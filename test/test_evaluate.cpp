@@ -0,0 +1,295 @@
+#include "test_config.h"
+#include "test_expression.h"
+
+#define TEST_POINTS_CNT (7)
+
+// x and y over positive and negative values, ln(y) needs y > 0
+static const double test_xs[TEST_POINTS_CNT] = {-2.5, -1, -0.3, 0, 0.4, 1.7, 3.2};
+static const double test_ys[TEST_POINTS_CNT] = {0.2, 0.5, 1, 1.3, 2, 2.9, 4.4};
+
+static const char *const test_sources[] = {
+	"sin(x*y)/(x+1.5)^2-ln(y)*0.1$",
+	"cos(x)^2+sin(x)^2+x*y-y/3$",
+	"(x*x+y)*(x*x+y)-ln(y*y)/(y+x*x)$",
+};
+
+TEST(TestEvaluate, BytecodeMatchesTree) {
+	for (size_t src_idx = 0; src_idx < sizeof(test_sources) / sizeof(*test_sources); src_idx++) {
+		char src[64] = "";
+		strcpy(src, test_sources[src_idx]);
+
+		struct expression expr = {};
+		ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+		struct expression_program program;
+		ASSERT_EQ(DS_OK, expression_program_ctor(&program));
+		ASSERT_EQ(S_OK, tnode_compile(&expr, expr.tree.root, &program));
+
+		for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+			const double values[] = {test_xs[i], test_ys[i]};
+			test_set_variables(&expr, values);
+
+			// The same libm calls in the same order, so the bits are the same
+			double fnum = NAN;
+			ASSERT_EQ(S_OK, expression_program_evaluate(&expr, &program, &fnum));
+			ASSERT_EQ(test_evaluate(&expr, expr.tree.root), fnum);
+		}
+
+		expression_program_dtor(&program);
+		expression_dtor(&expr);
+	}
+}
+
+TEST(TestEvaluate, BytecodeFailsLikeTree) {
+	char src[] = "x/(y-1)$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	struct expression_program program;
+	ASSERT_EQ(DS_OK, expression_program_ctor(&program));
+	ASSERT_EQ(S_OK, tnode_compile(&expr, expr.tree.root, &program));
+
+	const double values[] = {2, 1};
+	test_set_variables(&expr, values);
+
+	double fnum = NAN;
+	ASSERT_EQ(S_FAIL, tnode_evaluate(&expr, expr.tree.root, &fnum));
+	ASSERT_EQ(S_FAIL, expression_program_evaluate(&expr, &program, &fnum));
+
+	expression_program_dtor(&program);
+	expression_dtor(&expr);
+}
+
+static int test_within_ulp(double expected, double actual, double ulps) {
+	double ulp = nextafter(fabs(expected), INFINITY) - fabs(expected);
+
+	return fabs(expected - actual) <= ulps * ulp;
+}
+
+// Not a multiple of the vector width, so the tail is run as well
+#define TEST_KERNEL_CNT (1003)
+
+TEST(TestEvaluate, SimdKernelsMatchLibm) {
+	static double xs[TEST_KERNEL_CNT], ps[TEST_KERNEL_CNT], ys[TEST_KERNEL_CNT];
+
+	for (size_t i = 0; i < TEST_KERNEL_CNT; i++) {
+		xs[i] = -1e4 + 2e4 * (double)i / (TEST_KERNEL_CNT - 1) + 0.1 * (double)i;
+	}
+
+	expression_simd_sin(xs, ys, TEST_KERNEL_CNT);
+	for (size_t i = 0; i < TEST_KERNEL_CNT; i++) {
+		ASSERT_EQ(1, test_within_ulp(sin(xs[i]), ys[i], 2));
+	}
+
+	expression_simd_cos(xs, ys, TEST_KERNEL_CNT);
+	for (size_t i = 0; i < TEST_KERNEL_CNT; i++) {
+		ASSERT_EQ(1, test_within_ulp(cos(xs[i]), ys[i], 2));
+	}
+
+	for (size_t i = 0; i < TEST_KERNEL_CNT; i++) {
+		xs[i] = 1e-3 + 50 * (double)i / TEST_KERNEL_CNT;
+		ps[i] = -3 + 6 * (double)i / TEST_KERNEL_CNT;
+	}
+
+	expression_simd_log(xs, ys, TEST_KERNEL_CNT);
+	for (size_t i = 0; i < TEST_KERNEL_CNT; i++) {
+		ASSERT_EQ(1, test_within_ulp(log(xs[i]), ys[i], 1));
+	}
+
+	expression_simd_pow(xs, ps, ys, TEST_KERNEL_CNT);
+	for (size_t i = 0; i < TEST_KERNEL_CNT; i++) {
+		ASSERT_EQ(1, test_within_ulp(pow(xs[i], ps[i]), ys[i],
+					     2 * (1 + fabs(ps[i] * log(xs[i])))));
+	}
+
+	// Out of range arguments go to libm
+	const double special[] = {NAN, INFINITY, -INFINITY, 0, -1};
+	double special_ys[5];
+	expression_simd_log(special, special_ys, 5);
+	for (size_t i = 0; i < 5; i++) {
+		double expected = log(special[i]);
+		ASSERT_EQ(1, memcmp(&expected, &special_ys[i], sizeof(double)) == 0 ||
+			     (isnan(expected) && isnan(special_ys[i])));
+	}
+}
+
+TEST(TestEvaluate, FastBatchMatchesTree) {
+	char src[] = "sin(x*y)/(x+1.5)^2-ln(y)*0.1+cos(x)^y$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	// y keeps its value over the batch
+	const double y = 1.3;
+	const double values[] = {0, y};
+	test_set_variables(&expr, values);
+
+	double exact[TEST_POINTS_CNT], fast[TEST_POINTS_CNT];
+	ASSERT_EQ(S_OK, tnode_evaluate_batch(&expr, expr.tree.root, 0,
+					     0, test_xs, exact, TEST_POINTS_CNT));
+	ASSERT_EQ(S_OK, tnode_evaluate_batch(&expr, expr.tree.root, EXPRESSION_PROGRAM_F_FAST_MATH,
+					     0, test_xs, fast, TEST_POINTS_CNT));
+
+	for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+		const double point[] = {test_xs[i], y};
+		test_set_variables(&expr, point);
+
+		double expected = test_evaluate(&expr, expr.tree.root);
+		if (isnan(expected)) {
+			ASSERT_EQ(1, isnan(exact[i]) && isnan(fast[i]));
+			continue;
+		}
+
+		// libm without fast math, the kernels differ in the last bits
+		ASSERT_EQ(expected, exact[i]);
+		ASSERT_EQ(1, test_near(expected, fast[i]));
+	}
+
+	expression_dtor(&expr);
+}
+
+TEST(TestEvaluate, JitMatchesTree) {
+	for (size_t src_idx = 0; src_idx < sizeof(test_sources) / sizeof(*test_sources); src_idx++) {
+		char src[64] = "";
+		strcpy(src, test_sources[src_idx]);
+
+		struct expression expr = {};
+		ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+		struct expression_program program;
+		ASSERT_EQ(DS_OK, expression_program_ctor(&program));
+		ASSERT_EQ(S_OK, tnode_compile(&expr, expr.tree.root, &program));
+
+		struct expression_jit jit = {};
+		ASSERT_EQ(S_OK, expression_jit_ctor(&jit, &program));
+
+		for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+			const double values[] = {test_xs[i], test_ys[i]};
+			test_set_variables(&expr, values);
+
+			// Transcendentals are libm calls from the generated code as well
+			ASSERT_EQ(test_evaluate(&expr, expr.tree.root), jit.fn(values));
+		}
+
+		expression_jit_dtor(&jit);
+		expression_program_dtor(&program);
+		expression_dtor(&expr);
+	}
+}
+
+TEST(TestEvaluate, JitDivisionByZeroIsNan) {
+	char src[] = "x/(y-1)$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	struct expression_program program;
+	ASSERT_EQ(DS_OK, expression_program_ctor(&program));
+	ASSERT_EQ(S_OK, tnode_compile(&expr, expr.tree.root, &program));
+
+	struct expression_jit jit = {};
+	ASSERT_EQ(S_OK, expression_jit_ctor(&jit, &program));
+
+	const double values[] = {2, 1};
+	ASSERT_EQ(true, isnan(jit.fn(values)) != 0);
+
+	const double other[] = {2, 3};
+	ASSERT_EQ(1.0, jit.fn(other));
+
+	expression_jit_dtor(&jit);
+	expression_program_dtor(&program);
+	expression_dtor(&expr);
+}
+
+TEST(TestEvaluate, CompiledMatchesDerivatives) {
+	char src[] = "sin(x*y)+x*x*y-cos(y)$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+	ASSERT_EQ(S_OK, expression_derive_nth(&expr, 3));
+
+	struct expression_compiled compiled = {};
+	ASSERT_EQ(S_OK, expression_compiled_ctor(&compiled, &expr));
+	ASSERT_EQ(4u, compiled.cnt);
+
+	for (size_t nth = 0; nth < compiled.cnt; nth++) {
+		struct tree_node *node = nth ? test_nth_derivative(&expr, (int)nth) : expr.tree.root;
+		ASSERT_EQ(true, node != NULL);
+
+		for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+			const double values[] = {test_xs[i], test_ys[i]};
+			test_set_variables(&expr, values);
+
+			double fnum = NAN;
+			ASSERT_EQ(S_OK, expression_program_evaluate(&expr, &compiled.programs[nth], &fnum));
+			ASSERT_EQ(test_evaluate(&expr, node), fnum);
+		}
+	}
+
+	expression_compiled_dtor(&compiled);
+	expression_dtor(&expr);
+}
+
+#define TEST_CONTEXT_ROUNDS_CNT (200)
+
+struct test_context_run {
+	struct expression_context ctx;
+	const struct expression_program *program;
+	double expected[TEST_POINTS_CNT];
+	int matches;
+};
+
+// Each point over and over, so both threads are inside the program together
+static void *test_context_thread(void *arg) {
+	struct test_context_run *run = (struct test_context_run *)arg;
+
+	run->matches = 1;
+	for (size_t round = 0; round < TEST_CONTEXT_ROUNDS_CNT && run->matches; round++) {
+		for (size_t i = 0; i < TEST_POINTS_CNT && run->matches; i++) {
+			double fnum = NAN;
+			run->ctx.vars[0] = test_xs[i];
+
+			run->matches = !expression_context_evaluate(&run->ctx, run->program, &fnum) &&
+				       memcmp(&fnum, &run->expected[i], sizeof(double)) == 0;
+		}
+	}
+
+	return NULL;
+}
+
+TEST(TestEvaluate, ContextsShareProgram) {
+	char src[] = "sin(x*y)/(x+1.5)^2-ln(y)*0.1$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	struct expression_program program;
+	ASSERT_EQ(DS_OK, expression_program_ctor(&program));
+	ASSERT_EQ(S_OK, tnode_compile(&expr, expr.tree.root, &program));
+
+	// One context binds y to 0.5, the other to 2.9
+	static struct test_context_run runs[2];
+	const double ys[] = {0.5, 2.9};
+
+	for (size_t run_idx = 0; run_idx < 2; run_idx++) {
+		for (size_t i = 0; i < TEST_POINTS_CNT; i++) {
+			const double values[] = {test_xs[i], ys[run_idx]};
+			test_set_variables(&expr, values);
+			runs[run_idx].expected[i] = test_evaluate(&expr, expr.tree.root);
+		}
+
+		runs[run_idx].program = &program;
+		ASSERT_EQ(S_OK, expression_context_ctor(&runs[run_idx].ctx, &expr));
+		runs[run_idx].ctx.vars[1] = ys[run_idx];
+	}
+
+	pthread_t threads[2];
+	for (size_t run_idx = 0; run_idx < 2; run_idx++) {
+		ASSERT_EQ(0, pthread_create(&threads[run_idx], NULL, test_context_thread, &runs[run_idx]));
+	}
+
+	for (size_t run_idx = 0; run_idx < 2; run_idx++) {
+		ASSERT_EQ(0, pthread_join(threads[run_idx], NULL));
+		ASSERT_EQ(1, runs[run_idx].matches);
+		expression_context_dtor(&runs[run_idx].ctx);
+	}
+
+	expression_program_dtor(&program);
+	expression_dtor(&expr);
+}
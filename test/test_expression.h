@@ -0,0 +1,43 @@
+#ifndef TEST_EXPRESSION_H
+#define TEST_EXPRESSION_H
+
+#include <math.h>
+#include <string.h>
+#include "expression.h"
+
+static inline int test_near(double expected, double actual) {
+	return fabs(expected - actual) <= 1e-9 * (1 + fabs(expected));
+}
+
+// Values in the order the parser met the variables
+static inline void test_set_variables(struct expression *expr, const double *values) {
+	for (size_t i = 0; i < expr->variables.len; i++) {
+		struct expression_variable *variable = NULL;
+		pvector_get(&expr->variables, i, (void **)&variable);
+		variable->value = values[i];
+	}
+}
+
+static inline double test_evaluate(struct expression *expr, struct tree_node *node) {
+	double fnum = NAN;
+
+	if (node && tnode_evaluate(expr, node, &fnum)) {
+		return NAN;
+	}
+
+	return node ? fnum : 0;
+}
+
+// The stored nth derivative, derived up to nth first
+static inline struct tree_node *test_nth_derivative(struct expression *expr, int nth) {
+	struct tree *derivative = NULL;
+
+	if (expression_derive_nth(expr, nth) ||
+	    pvector_get(&expr->derivatives, (size_t)nth - 1, (void **)&derivative)) {
+		return NULL;
+	}
+
+	return derivative->root;
+}
+
+#endif /* TEST_EXPRESSION_H */
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "test_config.h"
+#include "test_expression.h"
+
+// Everything written to file so far, the caller frees it
+static char *test_read_all(FILE *file) {
+	long size = ftell(file);
+	char *text = size < 0 ? NULL : (char *)calloc((size_t)size + 1, 1);
+
+	if (text) {
+		rewind(file);
+		if (fread(text, 1, (size_t)size, file) != (size_t)size) {
+			free(text);
+			text = NULL;
+		}
+	}
+
+	return text;
+}
+
+// A fresh file name in path, the file is removed by the caller
+static int test_temp_path(char *path) {
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		return S_FAIL;
+	}
+
+	close(fd);
+	return S_OK;
+}
+
+TEST(TestFormats, CompactRoundTrip) {
+	char src[] = "sin(x*y)/(x+1)^2-ln(y)*0.1$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	const double values[] = {0.7, 1.3};
+	test_set_variables(&expr, values);
+
+	struct tree_compact compact = {};
+	ASSERT_EQ(DS_OK, tree_compact_ctor(&compact));
+	ASSERT_EQ(DS_OK, tree_compact_from_node(&compact, expr.tree.root));
+
+	double fnum = NAN;
+	ASSERT_EQ(S_OK, tcompact_evaluate(&expr, &compact, &fnum));
+	ASSERT_EQ(test_evaluate(&expr, expr.tree.root), fnum);
+
+	struct tree_node *root = NULL;
+	ASSERT_EQ(DS_OK, tree_compact_to_node(&compact, &root));
+	ASSERT_EQ(1, expr_tnode_equal(expr.tree.root, root));
+
+	tnode_recursive_dtor(root, NULL);
+	tree_compact_dtor(&compact);
+	expression_dtor(&expr);
+}
+
+TEST(TestFormats, FrozenMatchesTree) {
+	char src[] = "sin(x*y)/(x+1)^2-ln(y)*0.1$";
+	char src_same[] = "sin(x*y)/(x+1)^2-ln(y)*0.1$";
+	char src_other[] = "sin(x*y)/(x+1)^2-ln(y)*0.2$";
+	struct expression expr = {}, same = {}, other = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+	ASSERT_EQ(S_OK, expression_parse_str(src_same, &same));
+	ASSERT_EQ(S_OK, expression_parse_str(src_other, &other));
+
+	const double values[] = {0.7, 1.3};
+	test_set_variables(&expr, values);
+
+	struct tree_frozen frozen = {}, frozen_same = {}, frozen_other = {};
+	ASSERT_EQ(DS_OK, tree_freeze(&expr.tree, &frozen));
+	ASSERT_EQ(DS_OK, tree_freeze(&same.tree, &frozen_same));
+	ASSERT_EQ(DS_OK, tree_freeze(&other.tree, &frozen_other));
+
+	double fnum = NAN;
+	ASSERT_EQ(S_OK, tfrozen_evaluate(&expr, &frozen, &fnum));
+	ASSERT_EQ(test_evaluate(&expr, expr.tree.root), fnum);
+
+	// The implicit links give back the same tree
+	FILE *tree_latex = tmpfile(), *frozen_latex = tmpfile();
+	ASSERT_EQ(true, tree_latex && frozen_latex);
+	ASSERT_EQ(DS_OK, tnode_to_latex(&expr, expr.tree.root, tree_latex));
+	ASSERT_EQ(DS_OK, tfrozen_to_latex(&expr, &frozen, frozen_latex));
+
+	char *tree_text = test_read_all(tree_latex);
+	char *frozen_text = test_read_all(frozen_latex);
+	ASSERT_EQ(true, tree_text && frozen_text);
+	ASSERT_EQ(0, strcmp(tree_text, frozen_text));
+
+	ASSERT_EQ(tree_frozen_hash(&frozen), tree_frozen_hash(&frozen_same));
+	ASSERT_EQ(true, tree_frozen_hash(&frozen) != tree_frozen_hash(&frozen_other));
+
+	free(tree_text);
+	free(frozen_text);
+	fclose(tree_latex);
+	fclose(frozen_latex);
+	tree_frozen_dtor(&frozen);
+	tree_frozen_dtor(&frozen_same);
+	tree_frozen_dtor(&frozen_other);
+	expression_dtor(&expr);
+	expression_dtor(&same);
+	expression_dtor(&other);
+}
+
+// 1 if every hash in the subtree is unset or the one of its value and children
+static int test_hashes_fresh(const struct tree_node *node) {
+	if (!node) {
+		return 1;
+	}
+
+	if (node->value.hash &&
+	    node->value.hash != tnode_hash_combine(expression_value_hash(node->value),
+						   node->left, node->right)) {
+		return 0;
+	}
+
+	return test_hashes_fresh(node->left) && test_hashes_fresh(node->right);
+}
+
+TEST(TestFormats, HashMatchesEqualSubtrees) {
+	char src[] = "sin(x*y)+sin(x*y)*(x+1)$";
+	char src_same[] = "sin(x*y)+sin(x*y)*(x+1)$";
+	char src_other[] = "sin(x*y)+sin(x*y)*(x+2)$";
+	struct expression expr = {}, same = {}, other = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+	ASSERT_EQ(S_OK, expression_parse_str(src_same, &same));
+	ASSERT_EQ(S_OK, expression_parse_str(src_other, &other));
+
+	ASSERT_EQ(S_OK, expression_hash(&expr));
+	ASSERT_EQ(S_OK, expression_hash(&same));
+	ASSERT_EQ(S_OK, expression_hash(&other));
+
+	struct tree_node *root = expr.tree.root;
+	ASSERT_EQ(true, root->value.hash != 0);
+	ASSERT_EQ(1, test_hashes_fresh(root));
+
+	// Both sin(x*y) are nodes of their own with one hash
+	ASSERT_EQ(true, root->left != root->right->left);
+	ASSERT_EQ(1, expr_tnode_equal(root->left, root->right->left));
+	ASSERT_EQ(root->left->value.hash, root->right->left->value.hash);
+	ASSERT_EQ(true, root->left->value.hash != root->right->right->value.hash);
+
+	ASSERT_EQ(root->value.hash, same.tree.root->value.hash);
+	ASSERT_EQ(true, root->value.hash != other.tree.root->value.hash);
+
+	expression_dtor(&expr);
+	expression_dtor(&same);
+	expression_dtor(&other);
+}
+
+TEST(TestFormats, CowPathClearsPathHashes) {
+	char src[] = "2*x+3.25$";
+	char src_changed[] = "5*x+3.25$";
+	struct expression expr = {}, changed = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+	ASSERT_EQ(S_OK, expression_parse_str(src_changed, &changed));
+	ASSERT_EQ(S_OK, expression_hash(&expr));
+	ASSERT_EQ(S_OK, expression_hash(&changed));
+
+	// The number 2 is the left child of the left child
+	const uint8_t path[] = {0, 0};
+	struct tree_node *two = NULL;
+	ASSERT_EQ(DS_OK, tree_cow_path(&expr.tree, path, 2, &two));
+	two->value.fnum = 5;
+
+	// Nodes on the path are rehashed, the ones off it keep their hashes
+	struct tree_node *root = expr.tree.root;
+	ASSERT_EQ(0u, root->value.hash);
+	ASSERT_EQ(0u, root->left->value.hash);
+	ASSERT_EQ(0u, two->value.hash);
+	ASSERT_EQ(true, root->right->value.hash != 0);
+	ASSERT_EQ(true, root->left->right->value.hash != 0);
+
+	ASSERT_EQ(S_OK, expression_hash(&expr));
+	ASSERT_EQ(1, test_hashes_fresh(expr.tree.root));
+	ASSERT_EQ(changed.tree.root->value.hash, expr.tree.root->value.hash);
+
+	expression_dtor(&expr);
+	expression_dtor(&changed);
+}
+
+TEST(TestFormats, TaylorSeriesHashesFresh) {
+	char src[] = "sin(x)+x*x$";
+	struct expression expr = {}, series = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	const double x = 0.5;
+	test_set_variables(&expr, &x);
+
+	// Nodes are hashed as they are built, the root before its terms are added
+	struct tree_arena *arena = NULL;
+	ASSERT_EQ(DS_OK, tree_arena_ctor(&arena));
+	ASSERT_EQ(DS_OK, tree_arena_set_flags(arena, tree_arena_get_flags(arena) | TREE_ARENA_F_MERKLE));
+
+	struct tree_arena *prev_arena = tree_arena_select(arena);
+	int ret = expression_taylor_series_nth(&expr, &series, 3);
+	tree_arena_select(prev_arena);
+
+	ASSERT_EQ(S_OK, ret);
+	ASSERT_EQ(true, series.tree.root->value.hash != 0);
+	ASSERT_EQ(1, test_hashes_fresh(series.tree.root));
+
+	expression_dtor(&series);
+	expression_dtor(&expr);
+	tree_arena_dtor(arena);
+}
+
+TEST(TestFormats, BinaryRoundTrip) {
+	char src[] = "sin(x*y)/(x+1)^2-ln(y)*0.1+y/3$";
+	struct expression expr = {}, loaded = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+	ASSERT_EQ(S_OK, expression_ctor(&loaded));
+
+	char path[] = "/tmp/test_formats_XXXXXX";
+	ASSERT_EQ(S_OK, test_temp_path(path));
+	ASSERT_EQ(S_OK, expression_store_binary(&expr, path));
+	ASSERT_EQ(S_OK, expression_load_binary(&loaded, path));
+	unlink(path);
+
+	// Doubles are stored raw, so even 0.1 comes back bit for bit
+	ASSERT_EQ(1, expr_tnode_equal(expr.tree.root, loaded.tree.root));
+
+	// Variables are stored by index, so they evaluate in the source context
+	const double values[] = {0.7, 1.3};
+	test_set_variables(&expr, values);
+	ASSERT_EQ(test_evaluate(&expr, expr.tree.root), test_evaluate(&expr, loaded.tree.root));
+
+	expression_dtor(&expr);
+	expression_dtor(&loaded);
+}
+
+TEST(TestFormats, MappedRoundTrip) {
+	char src[] = "sin(x*y)/(x+1)^2-ln(y)*0.1+y/3$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	const double values[] = {0.7, 1.3};
+	test_set_variables(&expr, values);
+
+	char path[] = "/tmp/test_formats_XXXXXX";
+	ASSERT_EQ(S_OK, test_temp_path(path));
+	ASSERT_EQ(S_OK, expression_store_mapped(&expr, path));
+
+	struct tree_mapped mapped = {};
+	ASSERT_EQ(DS_OK, tree_mapped_ctor(&mapped, path, &expression_bin_codec));
+	unlink(path);
+
+	double fnum = NAN;
+	ASSERT_EQ(S_OK, tmapped_evaluate(&expr, &mapped, &fnum));
+	ASSERT_EQ(test_evaluate(&expr, expr.tree.root), fnum);
+
+	// The mapping reads back as the same text tree
+	FILE *tree_text_file = tmpfile(), *mapped_text_file = tmpfile();
+	ASSERT_EQ(true, tree_text_file && mapped_text_file);
+	ASSERT_EQ(DS_OK, tree_serialize_node(expr.tree.root, tree_text_file, expression_serializer));
+	ASSERT_EQ(DS_OK, tree_mapped_serialize(&mapped, mapped_text_file, expression_serializer));
+
+	char *tree_text = test_read_all(tree_text_file);
+	char *mapped_text = test_read_all(mapped_text_file);
+	ASSERT_EQ(true, tree_text && mapped_text);
+	ASSERT_EQ(0, strcmp(tree_text, mapped_text));
+
+	free(tree_text);
+	free(mapped_text);
+	fclose(tree_text_file);
+	fclose(mapped_text_file);
+	tree_mapped_dtor(&mapped);
+	expression_dtor(&expr);
+}
+
+// Loads the text with tree_load_stream() and stores the tree in text_again
+static int test_stream_round_trip(const char *text, struct tree *loaded, char **text_again) {
+	char path[] = "/tmp/test_formats_XXXXXX";
+	FILE *file = tmpfile();
+	int ret = S_FAIL;
+
+	*text_again = NULL;
+
+	if (!file || fputs(text, file) == EOF || fseek(file, 0, SEEK_SET) ||
+	    tree_load_stream(loaded, file, expression_deserializer)) {
+		goto exit;
+	}
+
+	fclose(file);
+	file = NULL;
+
+	if (test_temp_path(path) || tree_store(loaded, path, expression_serializer) ||
+	    !(file = fopen(path, "r")) || fseek(file, 0, SEEK_END)) {
+		goto exit;
+	}
+
+	*text_again = test_read_all(file);
+	ret = *text_again ? S_OK : S_FAIL;
+
+exit:
+	if (file) {
+		fclose(file);
+	}
+	unlink(path);
+
+	return ret;
+}
+
+TEST(TestFormats, StreamKeepsLabels) {
+	const char text[] = "(\"*\" @0(\"sin\" (\"2\" nil nil) nil) #0)";
+
+	struct tree loaded = {};
+	char *text_again = NULL;
+	ASSERT_EQ(S_OK, test_stream_round_trip(text, &loaded, &text_again));
+
+	// The reference is the labeled node itself, so it is written with the same labels
+	ASSERT_EQ(loaded.root->left, loaded.root->right);
+	ASSERT_EQ(0, strcmp(text, text_again));
+
+	free(text_again);
+	tree_dtor(&loaded);
+}
+
+TEST(TestFormats, StreamCrossesChunks) {
+	// Well past one 4 KiB chunk of text
+	const size_t terms = 400;
+	char *src = (char *)calloc(terms * 4 + 2, 1);
+	ASSERT_EQ(true, src != nullptr);
+
+	for (size_t i = 0; i < terms; i++) {
+		strcat(src, i ? "+0.5" : "0.5");
+	}
+	strcat(src, "$");
+
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	char path[] = "/tmp/test_formats_XXXXXX";
+	ASSERT_EQ(S_OK, test_temp_path(path));
+	ASSERT_EQ(S_OK, expression_store(&expr, path));
+
+	FILE *file = fopen(path, "r");
+	ASSERT_EQ(true, file != nullptr);
+	fseek(file, 0, SEEK_END);
+	char *text = test_read_all(file);
+	fclose(file);
+	unlink(path);
+	ASSERT_EQ(true, text && strlen(text) > 4096);
+
+	struct tree loaded = {};
+	char *text_again = NULL;
+	ASSERT_EQ(S_OK, test_stream_round_trip(text, &loaded, &text_again));
+	ASSERT_EQ(0, strcmp(text, text_again));
+
+	double fnum = NAN;
+	ASSERT_EQ(S_OK, tnode_evaluate(&expr, loaded.root, &fnum));
+	ASSERT_EQ(terms * 0.5, fnum);
+
+	free(text);
+	free(text_again);
+	free(src);
+	tree_dtor(&loaded);
+	expression_dtor(&expr);
+}
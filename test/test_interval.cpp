@@ -0,0 +1,164 @@
+#include "test_config.h"
+#include "test_expression.h"
+
+#define TEST_INTERVAL_SAMPLES_CNT (1001)
+
+static int test_interval_of(const char *src, double lo, double hi,
+			    struct expression_interval *result) {
+	char buf[64] = "";
+	strncpy(buf, src, sizeof(buf) - 1);
+
+	struct expression expr = {};
+	if (expression_parse_str(buf, &expr)) {
+		return S_FAIL;
+	}
+
+	struct expression_interval range = { lo, hi, 0 };
+	int ret = tnode_evaluate_interval(&expr, expr.tree.root, 0, range, result);
+
+	expression_dtor(&expr);
+
+	return ret;
+}
+
+// 1 if the bounds are these up to the outward rounding
+static int test_interval_is(const struct expression_interval *result, double lo, double hi) {
+	return result->lo <= lo && result->hi >= hi &&
+	       test_near(lo, result->lo) && test_near(hi, result->hi);
+}
+
+/*
+ * 1 if every finite sample over [lo, hi] is inside the interval
+ * and points without a finite value are flagged.
+ */
+static int test_interval_encloses(const char *src, double lo, double hi) {
+	char buf[64] = "";
+	strncpy(buf, src, sizeof(buf) - 1);
+
+	struct expression expr = {};
+	if (expression_parse_str(buf, &expr)) {
+		return 0;
+	}
+
+	struct expression_interval range = { lo, hi, 0 }, result = {};
+	int encloses = !tnode_evaluate_interval(&expr, expr.tree.root, 0, range, &result);
+
+	for (size_t i = 0; i < TEST_INTERVAL_SAMPLES_CNT && encloses; i++) {
+		const double x = lo + (hi - lo) * (double)i / (TEST_INTERVAL_SAMPLES_CNT - 1);
+		test_set_variables(&expr, &x);
+
+		double y = test_evaluate(&expr, expr.tree.root);
+		if (!isfinite(y)) {
+			encloses = (result.flags & (EXPRESSION_INTERVAL_F_PARTIAL |
+						    EXPRESSION_INTERVAL_F_EMPTY)) != 0;
+		} else {
+			encloses = !(result.flags & EXPRESSION_INTERVAL_F_EMPTY) &&
+				   result.lo <= y && y <= result.hi;
+		}
+	}
+
+	expression_dtor(&expr);
+
+	return encloses;
+}
+
+TEST(TestInterval, LogDomain) {
+	struct expression_interval result = {};
+
+	ASSERT_EQ(S_OK, test_interval_of("ln(x)$", 1, 2, &result));
+	ASSERT_EQ(0, result.flags);
+	ASSERT_EQ(1, test_interval_is(&result, 0, log(2)));
+
+	ASSERT_EQ(S_OK, test_interval_of("ln(x)$", -1, 2, &result));
+	ASSERT_EQ(EXPRESSION_INTERVAL_F_PARTIAL, result.flags);
+	ASSERT_EQ(1, result.hi >= log(2));
+
+	ASSERT_EQ(S_OK, test_interval_of("ln(x)$", -2, -1, &result));
+	ASSERT_EQ(EXPRESSION_INTERVAL_F_EMPTY, result.flags);
+}
+
+TEST(TestInterval, DivisionDomain) {
+	struct expression_interval result = {};
+
+	ASSERT_EQ(S_OK, test_interval_of("1/x$", 1, 4, &result));
+	ASSERT_EQ(0, result.flags);
+	ASSERT_EQ(1, test_interval_is(&result, 0.25, 1));
+
+	// Both sides of zero, the bounds are the ones of the sides
+	ASSERT_EQ(S_OK, test_interval_of("1/x$", -1, 1, &result));
+	ASSERT_EQ(EXPRESSION_INTERVAL_F_PARTIAL, result.flags);
+	ASSERT_EQ(1, result.lo <= -1e9 && result.hi >= 1e9);
+
+	// Only divisors the evaluator rejects
+	ASSERT_EQ(S_OK, test_interval_of("1/x$", -1e-10, 1e-10, &result));
+	ASSERT_EQ(EXPRESSION_INTERVAL_F_EMPTY, result.flags);
+}
+
+TEST(TestInterval, SinCosExtrema) {
+	struct expression_interval result = {};
+
+	// pi / 2 inside, the maximum is reached
+	ASSERT_EQ(S_OK, test_interval_of("sin(x)$", 1, 2, &result));
+	ASSERT_EQ(1, test_interval_is(&result, sin(1), 1));
+
+	// Monotonic between the extrema, the ends bound it
+	ASSERT_EQ(S_OK, test_interval_of("sin(x)$", 2, 3, &result));
+	ASSERT_EQ(1, test_interval_is(&result, sin(3), sin(2)));
+
+	// pi inside, the minimum is reached
+	ASSERT_EQ(S_OK, test_interval_of("cos(x)$", 3, 4, &result));
+	ASSERT_EQ(1, test_interval_is(&result, -1, cos(4)));
+
+	ASSERT_EQ(S_OK, test_interval_of("cos(x)$", -0.5, 0.5, &result));
+	ASSERT_EQ(1, test_interval_is(&result, cos(0.5), 1));
+
+	// A full period
+	ASSERT_EQ(S_OK, test_interval_of("sin(x)$", 0, 10, &result));
+	ASSERT_EQ(1, test_interval_is(&result, -1, 1));
+	ASSERT_EQ(0, result.flags);
+}
+
+TEST(TestInterval, PowerExponents) {
+	struct expression_interval result = {};
+
+	// Integer exponents take any base
+	ASSERT_EQ(S_OK, test_interval_of("x^2$", -2, 1, &result));
+	ASSERT_EQ(0, result.flags);
+	ASSERT_EQ(1, test_interval_is(&result, 0, 4));
+
+	ASSERT_EQ(S_OK, test_interval_of("x^3$", -2, 1, &result));
+	ASSERT_EQ(0, result.flags);
+	ASSERT_EQ(1, test_interval_is(&result, -8, 1));
+
+	// Fractional exponents drop the negative bases
+	ASSERT_EQ(S_OK, test_interval_of("x^0.5$", -1, 4, &result));
+	ASSERT_EQ(EXPRESSION_INTERVAL_F_PARTIAL, result.flags);
+	ASSERT_EQ(1, test_interval_is(&result, 0, 2));
+
+	ASSERT_EQ(S_OK, test_interval_of("x^0.5$", -2, -1, &result));
+	ASSERT_EQ(EXPRESSION_INTERVAL_F_EMPTY, result.flags);
+
+	// Varying exponents are bounded at the corners
+	ASSERT_EQ(S_OK, test_interval_of("x^x$", 0.5, 2, &result));
+	ASSERT_EQ(0, result.flags);
+	ASSERT_EQ(1, test_interval_is(&result, 0.25, 4));
+
+	ASSERT_EQ(S_OK, test_interval_of("x^x$", -1, 2, &result));
+	ASSERT_EQ(EXPRESSION_INTERVAL_F_PARTIAL, result.flags);
+}
+
+TEST(TestInterval, SamplesInsideBounds) {
+	static const char *const sources[] = {
+		"x+2.5$", "2.5-x$", "x*x-3*x$", "1/(x-0.3)$", "x^2$", "x^3$",
+		"x^0.5$", "x^x$", "2^x$", "ln(x)$", "sin(x)$", "cos(x)$",
+		"sin(x)*ln(x*x+1)/(x+4)$",
+	};
+	static const double ranges[][2] = {{-3, 3}, {0.25, 2.5}, {1, 7}, {-5, -0.5}};
+
+	for (size_t src_idx = 0; src_idx < sizeof(sources) / sizeof(*sources); src_idx++) {
+		for (size_t range_idx = 0; range_idx < sizeof(ranges) / sizeof(*ranges); range_idx++) {
+			ASSERT_EQ(1, test_interval_encloses(sources[src_idx], ranges[range_idx][0],
+							   ranges[range_idx][1]));
+		}
+	}
+}
@@ -0,0 +1,98 @@
+#include "test_config.h"
+#include "test_expression.h"
+
+TEST(TestJacobian, GradientOfProduct) {
+	char src[] = "0.5*x*y$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	const double values[] = {2, 3};
+	test_set_variables(&expr, values);
+
+	struct expression_jacobian grad = {};
+	ASSERT_EQ(S_OK, expression_gradient_ctor(&grad, &expr));
+	ASSERT_EQ(2u, grad.vars_cnt);
+	ASSERT_EQ(2u, grad.nonzero_cnt);
+	ASSERT_EQ(1, test_near(1.5, test_evaluate(&expr, grad.partials[0])));
+	ASSERT_EQ(1, test_near(1, test_evaluate(&expr, grad.partials[1])));
+
+	expression_jacobian_dtor(&grad);
+	expression_dtor(&expr);
+}
+
+TEST(TestJacobian, HessianIsMirrored) {
+	char src[] = "sin(x)*y^2$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	const double x = 0.5, y = 1.5;
+	const double values[] = {x, y};
+	test_set_variables(&expr, values);
+
+	struct expression_jacobian hess = {};
+	ASSERT_EQ(S_OK, expression_hessian_ctor(&hess, &expr));
+	ASSERT_EQ(4u, hess.nonzero_cnt);
+	ASSERT_EQ(1, test_near(-sin(x) * y * y, test_evaluate(&expr, hess.partials[0])));
+	ASSERT_EQ(1, test_near(2 * cos(x) * y, test_evaluate(&expr, hess.partials[1])));
+	ASSERT_EQ(1, test_near(2 * sin(x), test_evaluate(&expr, hess.partials[3])));
+
+	// The lower half is the upper one, not a second derivation
+	ASSERT_EQ(hess.partials[1], hess.partials[2]);
+
+	expression_jacobian_dtor(&hess);
+	expression_dtor(&expr);
+}
+
+TEST(TestJacobian, MissingVariableIsNull) {
+	char src_f[] = "x*y+z$";
+	char src_g[] = "z*z+sin(x)$";
+	struct expression f = {}, g = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src_f, &f));
+	ASSERT_EQ(S_OK, expression_parse_str(src_g, &g));
+
+	const double f_values[] = {0.5, 2, 3};
+	const double g_values[] = {3, 0.5};
+	test_set_variables(&f, f_values);
+	test_set_variables(&g, g_values);
+
+	struct expression *exprs[] = {&f, &g};
+	struct expression_jacobian jac = {};
+	ASSERT_EQ(S_OK, expression_jacobian_ctor(&jac, exprs, 2));
+	ASSERT_EQ(2u, jac.rows_cnt);
+	ASSERT_EQ(3u, jac.vars_cnt);
+	ASSERT_EQ(5u, jac.nonzero_cnt);
+
+	ASSERT_EQ(1, test_near(2, test_evaluate(&f, jac.partials[0])));
+	ASSERT_EQ(1, test_near(0.5, test_evaluate(&f, jac.partials[1])));
+	ASSERT_EQ(1, test_near(1, test_evaluate(&f, jac.partials[2])));
+	ASSERT_EQ(1, test_near(cos(0.5), test_evaluate(&g, jac.partials[3])));
+	ASSERT_EQ(nullptr, jac.partials[4]);
+	ASSERT_EQ(1, test_near(6, test_evaluate(&g, jac.partials[5])));
+
+	expression_jacobian_dtor(&jac);
+	expression_dtor(&f);
+	expression_dtor(&g);
+}
+
+TEST(TestJacobian, CallerStateIsKept) {
+	char src[] = "sin(x*y)+x^3$";
+	struct expression expr = {};
+	ASSERT_EQ(S_OK, expression_parse_str(src, &expr));
+
+	expr.memoize = 1;
+	ASSERT_EQ(S_OK, expression_derive_nth(&expr, 1));
+
+	struct expression_derive_memo *derive_memo = expr.derive_memo;
+	size_t differentiating_variable = expr.differentiating_variable;
+
+	struct expression_jacobian hess = {};
+	ASSERT_EQ(S_OK, expression_hessian_ctor(&hess, &expr));
+
+	ASSERT_EQ(1, expr.memoize);
+	ASSERT_EQ(derive_memo, expr.derive_memo);
+	ASSERT_EQ(differentiating_variable, expr.differentiating_variable);
+	ASSERT_EQ(nullptr, expr.derive_deps);
+
+	expression_jacobian_dtor(&hess);
+	expression_dtor(&expr);
+}
@@ -0,0 +1,44 @@
+#include "test_config.h"
+#include "test_expression.h"
+
+// 1 if the first orders of src are the same with and without the memo
+static int test_memo_matches(int hashcons) {
+	// The same subtrees over and over, so the memo is hit
+	char src[] = "sin(x*x)*sin(x*x)+cos(x*x)^2+sin(x*x)/(x*x+1)$";
+	char src_memo[sizeof(src)];
+	memcpy(src_memo, src, sizeof(src));
+
+	struct expression plain = {}, memo = {};
+	if (expression_parse_str(src, &plain) || expression_parse_str(src_memo, &memo)) {
+		return 0;
+	}
+
+	plain.hashcons = hashcons;
+	memo.hashcons = hashcons;
+	memo.memoize = 1;
+
+	int matches = 1;
+	for (int nth = 1; nth <= 3 && matches; nth++) {
+		struct tree_node *plain_derivative = test_nth_derivative(&plain, nth);
+		struct tree_node *memo_derivative = test_nth_derivative(&memo, nth);
+
+		matches = plain_derivative && memo_derivative &&
+			  expr_tnode_equal(plain_derivative, memo_derivative) == 1;
+	}
+
+	// The memo is only filled into hash-consing arenas
+	matches = matches && hashcons == (memo.derive_memo != NULL);
+
+	expression_dtor(&plain);
+	expression_dtor(&memo);
+
+	return matches;
+}
+
+TEST(TestMemo, HashconsMatchesPlain) {
+	ASSERT_EQ(1, test_memo_matches(1));
+}
+
+TEST(TestMemo, CopyingMatchesPlain) {
+	ASSERT_EQ(1, test_memo_matches(0));
+}
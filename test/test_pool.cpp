@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include "test_config.h"
+#include "test_expression.h"
+
+// Not a multiple of the chunk, so the last chunk is short
+#define TEST_POOL_POINTS_CNT (100003)
+#define TEST_POOL_CHUNK (1000)
+#define TEST_POOL_TASKS_CNT (1009)
+
+// 1 if the pool fills ys bit for bit like the serial batch
+static int test_pool_matches_serial(size_t threads_cnt) {
+	char src[] = "sin(x)*x+ln(x*x+1)/(x+3.5)-cos(x/3)^2$";
+	struct expression expr = {};
+	if (expression_parse_str(src, &expr)) {
+		return 0;
+	}
+
+	struct expression_program program;
+	struct expression_pool pool;
+	double *xs = (double *)calloc(TEST_POOL_POINTS_CNT, sizeof(double));
+	double *serial = (double *)calloc(TEST_POOL_POINTS_CNT, sizeof(double));
+	double *pooled = (double *)calloc(TEST_POOL_POINTS_CNT, sizeof(double));
+
+	int matches = xs && serial && pooled && !expression_program_ctor(&program);
+	if (!matches) {
+		free(xs);
+		free(serial);
+		free(pooled);
+		expression_dtor(&expr);
+		return 0;
+	}
+
+	for (size_t i = 0; i < TEST_POOL_POINTS_CNT; i++) {
+		xs[i] = -3 + 6 * (double)i / TEST_POOL_POINTS_CNT;
+	}
+
+	matches = !tnode_compile(&expr, expr.tree.root, &program) &&
+		  !expression_program_evaluate_batch(&expr, &program, 0, xs, serial,
+						     TEST_POOL_POINTS_CNT) &&
+		  !expression_pool_ctor(&pool, threads_cnt);
+
+	if (matches) {
+		matches = pool.threads_cnt == threads_cnt &&
+			  !expression_pool_evaluate_batch(&pool, &expr, &program, 0, xs, pooled,
+							  TEST_POOL_POINTS_CNT, TEST_POOL_CHUNK) &&
+			  memcmp(serial, pooled, TEST_POOL_POINTS_CNT * sizeof(double)) == 0;
+		expression_pool_dtor(&pool);
+	}
+
+	expression_program_dtor(&program);
+	free(xs);
+	free(serial);
+	free(pooled);
+	expression_dtor(&expr);
+
+	return matches;
+}
+
+TEST(TestPool, BatchMatchesSerial) {
+	ASSERT_EQ(1, test_pool_matches_serial(1));
+	ASSERT_EQ(1, test_pool_matches_serial(4));
+}
+
+static int test_pool_count_task(void *arg, size_t idx) {
+	unsigned *counts = (unsigned *)arg;
+
+	__atomic_fetch_add(&counts[idx], 1, __ATOMIC_RELAXED);
+
+	return S_OK;
+}
+
+// 1 if every task ran exactly once
+static int test_pool_runs_tasks_once(size_t threads_cnt) {
+	static unsigned counts[TEST_POOL_TASKS_CNT];
+	memset(counts, 0, sizeof(counts));
+
+	struct expression_pool pool;
+	if (expression_pool_ctor(&pool, threads_cnt)) {
+		return 0;
+	}
+
+	int ran_once = !expression_pool_run_tasks(&pool, TEST_POOL_TASKS_CNT,
+						  test_pool_count_task, counts);
+	for (size_t i = 0; i < TEST_POOL_TASKS_CNT && ran_once; i++) {
+		ran_once = counts[i] == 1;
+	}
+
+	expression_pool_dtor(&pool);
+
+	return ran_once;
+}
+
+TEST(TestPool, RunTasksCallsEachIndexOnce) {
+	ASSERT_EQ(1, test_pool_runs_tasks_once(1));
+	ASSERT_EQ(1, test_pool_runs_tasks_once(4));
+}
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "test_config.h"
+#include "test_expression.h"
+
+static size_t test_count(const char *text, const char *pattern) {
+	size_t cnt = 0;
+
+	for (const char *found = strstr(text, pattern); found; found = strstr(found + 1, pattern)) {
+		cnt++;
+	}
+
+	return cnt;
+}
+
+static char *test_derive_traced(char *src, size_t trace_max) {
+	struct expression expr = {};
+	FILE *latex_file = tmpfile();
+
+	if (!latex_file || expression_parse_str(src, &expr)) {
+		return NULL;
+	}
+
+	expr.latex_file = latex_file;
+	expr.trace_max = trace_max;
+
+	int ret = expression_derive_nth(&expr, 1);
+	expression_dtor(&expr);
+
+	long size = ftell(latex_file);
+	char *text = ret || size < 0 ? NULL : (char *)calloc((size_t)size + 1, 1);
+
+	if (text) {
+		rewind(latex_file);
+		if (fread(text, 1, (size_t)size, latex_file) != (size_t)size) {
+			free(text);
+			text = NULL;
+		}
+	}
+	fclose(latex_file);
+
+	return text;
+}
+
+TEST(TestTrace, RootIsKeptUnderCap) {
+	char src[] = "sin(x*x)/(x+1)^2$";
+
+	char *text = test_derive_traced(src, 1);
+	ASSERT_EQ(true, text != nullptr);
+
+	// The division at the root, the leaves are summarized
+	ASSERT_EQ(1u, test_count(text, "\\frac{d}{dx}("));
+	ASSERT_EQ(1u, test_count(text, "\\frac{d}{dx}(\\eddivide{"));
+	ASSERT_EQ(1u, test_count(text, "8 more steps"));
+
+	free(text);
+}
+
+TEST(TestTrace, TopLevelsAreShown) {
+	char src[] = "sin(x*x)/(x+1)^2$";
+
+	char *text = test_derive_traced(src, 5);
+	ASSERT_EQ(true, text != nullptr);
+
+	// The root and both of its children fit, the third level does not
+	ASSERT_EQ(3u, test_count(text, "\\frac{d}{dx}("));
+	ASSERT_EQ(1u, test_count(text, "\\frac{d}{dx}(\\edsin{"));
+	ASSERT_EQ(1u, test_count(text, "\\frac{d}{dx}(\\edpower{"));
+	ASSERT_EQ(1u, test_count(text, "6 more steps"));
+
+	free(text);
+}